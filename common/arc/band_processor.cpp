@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.camera.common@1.0-arc.stm32mpu"
+// #define LOG_NDEBUG 0
+
+#include <utils/Log.h>
+
+#include "band_processor.h"
+
+#include <cutils/properties.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace arc {
+
+#define BANDS_PROPERTY "vendor.camera.convert.bands"
+
+/* Upper bound of the band count */
+static constexpr int kMaxBands = 8;
+
+/* Bands smaller than this are not worth a thread wake-up */
+static constexpr int kMinBandRows = 32;
+
+/* Completion state of a single Run() call */
+struct BandBatch {
+  std::mutex lock;
+  std::condition_variable cond;
+  int pending;
+  int result;
+};
+
+BandProcessor& BandProcessor::GetInstance() {
+  /* Never destroyed, so that no worker has to be joined at process exit */
+  static BandProcessor *instance = [] {
+    int cores = std::clamp(static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)),
+                           1, kMaxBands);
+    int bands = std::clamp(property_get_int32(BANDS_PROPERTY, cores),
+                           1, kMaxBands);
+
+    ALOGI("%s: image operations split in %d bands", __FUNCTION__, bands);
+
+    return new BandProcessor(bands);
+  }();
+
+  return *instance;
+}
+
+BandProcessor::BandProcessor(int band_count)
+    : band_count_(band_count),
+      active_(true) {
+  for (int i = 1; i < band_count_; ++i)
+    workers_.emplace_back(&BandProcessor::WorkerThread, this);
+}
+
+BandProcessor::~BandProcessor() {
+  {
+    std::lock_guard l(lock_);
+    active_ = false;
+  }
+  cond_.notify_all();
+
+  for (std::thread &worker : workers_)
+    worker.join();
+}
+
+void BandProcessor::WorkerThread() {
+  std::unique_lock l(lock_);
+
+  while (true) {
+    cond_.wait(l, [this] { return !active_ || !tasks_.empty(); });
+    if (!active_)
+      return;
+
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop();
+
+    l.unlock();
+    task();
+    l.lock();
+  }
+}
+
+int BandProcessor::Run(int height, int alignment,
+                       const BandFunction& function) {
+  int bands = std::min(band_count_, height / kMinBandRows);
+  if (bands <= 1)
+    return function(0, height);
+
+  /* Round the band height up to the alignment so that every band but the
+   * last one starts on an aligned row.
+   */
+  int band_rows = (height + bands - 1) / bands;
+  band_rows = (band_rows + alignment - 1) / alignment * alignment;
+  bands = (height + band_rows - 1) / band_rows;
+
+  BandBatch batch;
+  batch.pending = bands - 1;
+  batch.result = 0;
+
+  {
+    std::lock_guard l(lock_);
+    for (int i = 1; i < bands; ++i) {
+      int row = i * band_rows;
+      int rows = std::min(band_rows, height - row);
+
+      tasks_.push([&function, &batch, row, rows] {
+        int res = function(row, rows);
+
+        std::lock_guard batch_lock(batch.lock);
+        if (res && !batch.result)
+          batch.result = res;
+        if (--batch.pending == 0)
+          batch.cond.notify_one();
+      });
+    }
+  }
+  cond_.notify_all();
+
+  int res = function(0, band_rows);
+
+  std::unique_lock batch_lock(batch.lock);
+  batch.cond.wait(batch_lock, [&batch] { return batch.pending == 0; });
+
+  return res ? res : batch.result;
+}
+
+} // namespace arc
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
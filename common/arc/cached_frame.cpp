@@ -34,29 +34,37 @@ namespace common {
 namespace V1_0 {
 namespace arc {
 
-CachedFrame::CachedFrame()
+CachedFrame::CachedFrame(std::shared_ptr<FrameBufferPool> pool)
     : source_frame_(nullptr),
-      cropped_buffer_capacity_(0),
-      yu12_frame_(new AllocatedFrameBuffer(0)) {}
+      pool_(pool ? std::move(pool) : std::make_shared<FrameBufferPool>()),
+      cropped_buffer_(new AllocatedFrameBuffer(0, pool_)),
+      yu12_frame_(new AllocatedFrameBuffer(0, pool_)),
+      yu12_valid_(false),
+      scaled_frame_(new AllocatedFrameBuffer(0, pool_)) {}
 
 CachedFrame::~CachedFrame() { UnsetSource(); }
 
 int CachedFrame::SetSource(const FrameBuffer* frame, int rotate_degree) {
   source_frame_ = frame;
+  yu12_valid_ = false;
+
+  if (rotate_degree <= 0) {
+    return 0;
+  }
+
   int res = ConvertToYU12();
 
   if (res != 0) {
     return res;
   }
 
-  if (rotate_degree > 0) {
-    res = CropRotateScale(rotate_degree);
-  }
-
-  return res;
+  return CropRotateScale(rotate_degree);
 }
 
-void CachedFrame::UnsetSource() { source_frame_ = nullptr; }
+void CachedFrame::UnsetSource() {
+  source_frame_ = nullptr;
+  yu12_valid_ = false;
+}
 
 uint8_t* CachedFrame::GetSourceBuffer() const {
   return source_frame_->GetData();
@@ -76,13 +84,12 @@ uint32_t CachedFrame::GetCachedFourCC() const {
   return yu12_frame_->GetFourcc();
 }
 
-uint32_t CachedFrame::GetWidth() const { return yu12_frame_->GetWidth(); }
+uint32_t CachedFrame::GetWidth() const { return source_frame_->GetWidth(); }
 
-uint32_t CachedFrame::GetHeight() const { return yu12_frame_->GetHeight(); }
+uint32_t CachedFrame::GetHeight() const { return source_frame_->GetHeight(); }
 
 size_t CachedFrame::GetConvertedSize(int fourcc) const {
-  return ImageProcessor::GetConvertedSize(fourcc, yu12_frame_->GetWidth(),
-                                          yu12_frame_->GetHeight());
+  return ImageProcessor::GetConvertedSize(fourcc, GetWidth(), GetHeight());
 }
 
 int CachedFrame::Convert(const CameraMetadata& metadata, FrameBuffer* out_frame,
@@ -94,13 +101,30 @@ int CachedFrame::Convert(const CameraMetadata& metadata, FrameBuffer* out_frame,
     out_frame->SetFourcc(V4L2_PIX_FMT_YUV420);
   }
 
-  FrameBuffer* source_frame = yu12_frame_.get();
-
   ALOGV("%s: w: %d; frame w: %d, h: %d, frame h: %d", __FUNCTION__,
         GetWidth(), out_frame->GetWidth(), GetHeight(), out_frame->GetHeight());
 
-  if (GetWidth() != out_frame->GetWidth() ||
-                                        GetHeight() != out_frame->GetHeight()) {
+  bool same_size = GetWidth() == out_frame->GetWidth() &&
+                   GetHeight() == out_frame->GetHeight();
+
+  if (!yu12_valid_ && same_size &&
+      ImageProcessor::SupportsDirectConversion(source_frame_->GetFourcc(),
+                                               out_frame->GetFourcc())) {
+    ALOGV("%s: Processing direct conversion", __FUNCTION__);
+
+    return ImageProcessor::ConvertFormat(metadata, *source_frame_, out_frame);
+  }
+
+  if (!yu12_valid_) {
+    int res = ConvertToYU12();
+    if (res) {
+      return res;
+    }
+  }
+
+  FrameBuffer* source_frame = yu12_frame_.get();
+
+  if (!same_size) {
     size_t cache_size = ImageProcessor::GetConvertedSize(
                                                       yu12_frame_->GetFourcc(),
                                                       out_frame->GetWidth(),
@@ -109,8 +133,9 @@ int CachedFrame::Convert(const CameraMetadata& metadata, FrameBuffer* out_frame,
     if (cache_size == 0) {
       ALOGE("%s: cache size is null", __FUNCTION__);
       return -EINVAL;
-    } else if (!scaled_frame_ || cache_size > scaled_frame_->GetBufferSize()) {
-      scaled_frame_.reset(new AllocatedFrameBuffer(cache_size));
+    } else if (scaled_frame_->SetDataSize(cache_size)) {
+      ALOGE("%s: can't allocate scaled frame", __FUNCTION__);
+      return -ENOMEM;
     }
 
     scaled_frame_->SetWidth(out_frame->GetWidth());
@@ -137,7 +162,10 @@ int CachedFrame::ConvertToYU12() {
     return -EINVAL;
   }
 
-  yu12_frame_->SetDataSize(cache_size);
+  if (yu12_frame_->SetDataSize(cache_size)) {
+    return -ENOMEM;
+  }
+
   yu12_frame_->SetFourcc(V4L2_PIX_FMT_YUV420);
   yu12_frame_->SetWidth(source_frame_->GetWidth());
   yu12_frame_->SetHeight(source_frame_->GetHeight());
@@ -150,6 +178,8 @@ int CachedFrame::ConvertToYU12() {
     return res;
   }
 
+  yu12_valid_ = true;
+
   return 0;
 }
 
@@ -196,11 +226,11 @@ int CachedFrame::CropRotateScale(int rotate_degree) {
   int rotated_uv_stride = rotated_width / 2;
   size_t rotated_size =
       rotated_y_stride * rotated_height + rotated_uv_stride * rotated_height;
-  if (rotated_size > cropped_buffer_capacity_) {
-    cropped_buffer_.reset(new uint8_t[rotated_size]);
-    cropped_buffer_capacity_ = rotated_size;
+  if (cropped_buffer_->SetDataSize(rotated_size)) {
+    ALOGE("%s: can't allocate rotation buffer", __FUNCTION__);
+    return -ENOMEM;
   }
-  uint8_t* rotated_y_plane = cropped_buffer_.get();
+  uint8_t* rotated_y_plane = cropped_buffer_->GetData();
   uint8_t* rotated_u_plane =
       rotated_y_plane + rotated_y_stride * rotated_height;
   uint8_t* rotated_v_plane =
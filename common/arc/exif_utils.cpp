@@ -21,8 +21,11 @@
 // #define LOG_NDEBUG 0
 #include <utils/Log.h>
 
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <mutex>
 
 #include <libyuv.h>
 
@@ -59,12 +62,152 @@ static void SetLatitudeOrLongitudeData(unsigned char* data, double num) {
                     {microseconds, 1000000});
 }
 
+// The offset of the TIFF header in the APP1 segment, after the Exif
+// identifier code.
+static const size_t kTiffHeaderOffset = 6;
+static const uint8_t kExifIdentifierCode[] = {'E', 'x', 'i', 'f', 0x0, 0x0};
+
+// The APP1 segment saved by libexif for a tag layout, with the offsets of the
+// values which change from shot to shot. An offset is 0 if the tag is not in
+// the segment.
+struct ExifApp1Template {
+  // See ExifUtils::GetLayoutKey().
+  std::string layout;
+  // The APP1 segment, without the thumbnail image which ends it.
+  std::vector<uint8_t> data;
+  size_t date_time;
+  size_t latitude_ref;
+  size_t latitude;
+  size_t longitude_ref;
+  size_t longitude;
+  size_t altitude_ref;
+  size_t altitude;
+  size_t gps_date_stamp;
+  size_t gps_time_stamp;
+  size_t orientation;
+  size_t thumbnail_length;
+};
+
+// The last template built. The tag layout only depends on the stream
+// configuration and on the capture settings, so that all the shots of a
+// session share it.
+static std::mutex gApp1TemplateLock;
+static std::shared_ptr<const ExifApp1Template> gApp1Template;
+
+static void SetLatitudeOrLongitude(unsigned char* ref, unsigned char* data,
+                                   double num, char positive, char negative) {
+  ref[0] = num >= 0 ? positive : negative;
+  ref[1] = '\0';
+  SetLatitudeOrLongitudeData(data, num >= 0 ? num : -num);
+}
+
+static void SetAltitude(unsigned char* ref, unsigned char* data,
+                        double altitude) {
+  *ref = altitude >= 0 ? 0 : 1;
+  exif_set_rational(data, EXIF_BYTE_ORDER_INTEL,
+                    {static_cast<ExifLong>(std::abs(altitude) * 1000), 1000});
+}
+
+static void SetGpsTimeStampData(unsigned char* data, const struct tm& t) {
+  exif_set_rational(data, EXIF_BYTE_ORDER_INTEL,
+                    {static_cast<ExifLong>(t.tm_hour), 1});
+  exif_set_rational(data + sizeof(ExifRational), EXIF_BYTE_ORDER_INTEL,
+                    {static_cast<ExifLong>(t.tm_min), 1});
+  exif_set_rational(data + 2 * sizeof(ExifRational), EXIF_BYTE_ORDER_INTEL,
+                    {static_cast<ExifLong>(t.tm_sec), 1});
+}
+
+static uint16_t GetExifOrientation(uint16_t orientation) {
+  /*
+   * Orientation value:
+   *  1      2      3      4      5          6          7          8
+   *
+   *  888888 888888     88 88     8888888888 88                 88 8888888888
+   *  88         88     88 88     88  88     88  88         88  88     88  88
+   *  8888     8888   8888 8888   88         8888888888 8888888888         88
+   *  88         88     88 88
+   *  88         88 888888 888888
+   */
+  switch (orientation) {
+    case 90:
+      return 6;
+    case 180:
+      return 3;
+    case 270:
+      return 8;
+    default:
+      return 1;
+  }
+}
+
+// Returns the offset in |app1| of the value of |tag| in the IFD at offset
+// |ifd| of the TIFF data, or 0 if the tag is not found.
+static size_t FindTagValue(const std::vector<uint8_t>& app1, size_t ifd,
+                           ExifTag tag) {
+  size_t pos = kTiffHeaderOffset + ifd;
+  if (ifd == 0 || pos + 2 > app1.size()) {
+    return 0;
+  }
+
+  ExifShort count = exif_get_short(&app1[pos], EXIF_BYTE_ORDER_INTEL);
+  for (ExifShort i = 0; i < count; ++i) {
+    size_t entry = pos + 2 + i * 12;
+    if (entry + 12 > app1.size()) {
+      return 0;
+    }
+    if (exif_get_short(&app1[entry], EXIF_BYTE_ORDER_INTEL) != tag) {
+      continue;
+    }
+
+    ExifFormat format = static_cast<ExifFormat>(
+        exif_get_short(&app1[entry + 2], EXIF_BYTE_ORDER_INTEL));
+    size_t size = exif_format_get_size(format) *
+                  exif_get_long(&app1[entry + 4], EXIF_BYTE_ORDER_INTEL);
+    size_t value = entry + 8;
+    if (size > 4) {
+      value = kTiffHeaderOffset +
+              exif_get_long(&app1[entry + 8], EXIF_BYTE_ORDER_INTEL);
+    }
+    return value + size <= app1.size() ? value : 0;
+  }
+  return 0;
+}
+
+// Returns the offset in the TIFF data of the IFD linked after the one at
+// offset |ifd|, or 0 if there is none.
+static size_t FindNextIfd(const std::vector<uint8_t>& app1, size_t ifd) {
+  size_t pos = kTiffHeaderOffset + ifd;
+  if (ifd == 0 || pos + 2 > app1.size()) {
+    return 0;
+  }
+  size_t next = pos + 2 +
+                exif_get_short(&app1[pos], EXIF_BYTE_ORDER_INTEL) * 12;
+  if (next + 4 > app1.size()) {
+    return 0;
+  }
+  return exif_get_long(&app1[next], EXIF_BYTE_ORDER_INTEL);
+}
+
 ExifUtils::ExifUtils()
     : yu12_buffer_(nullptr),
       yu12_width_(0),
       yu12_height_(0),
       thumbnail_width_(0),
       thumbnail_height_(0),
+      has_focal_length_(false),
+      focal_length_numerator_(0),
+      focal_length_denominator_(0),
+      has_latitude_(false),
+      latitude_(0),
+      has_longitude_(false),
+      longitude_(0),
+      has_altitude_(false),
+      altitude_(0),
+      has_gps_timestamp_(false),
+      gps_timestamp_(),
+      has_gps_processing_method_(false),
+      has_orientation_(false),
+      orientation_(0),
       exif_data_(nullptr),
       app1_buffer_(nullptr),
       app1_length_(0) {}
@@ -87,45 +230,16 @@ bool ExifUtils::Initialize(const uint8_t* buffer, uint16_t width,
   yu12_buffer_ = buffer;
   yu12_width_ = width;
   yu12_height_ = height;
-
-  exif_data_ = exif_data_new();
-  if (exif_data_ == nullptr) {
-    ALOGE("%s: allocate memory for exif_data_ failed", __FUNCTION__);
-    return false;
-  }
-  // Set the image options.
-  exif_data_set_option(exif_data_, EXIF_DATA_OPTION_FOLLOW_SPECIFICATION);
-  exif_data_set_data_type(exif_data_, EXIF_DATA_TYPE_COMPRESSED);
-  exif_data_set_byte_order(exif_data_, EXIF_BYTE_ORDER_INTEL);
-
-  // Set image width and length.
-  SetImageWidth(width);
-  SetImageLength(height);
-
   return true;
 }
 
 bool ExifUtils::SetMaker(const std::string& maker) {
-  size_t entrySize = maker.length() + 1;
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_0, EXIF_TAG_MAKE, EXIF_FORMAT_ASCII, entrySize, entrySize);
-  if (!entry) {
-    ALOGE("%s: Adding Make exif entry failed", __FUNCTION__);
-    return false;
-  }
-  memcpy(entry->data, maker.c_str(), entrySize);
+  maker_ = maker;
   return true;
 }
 
 bool ExifUtils::SetModel(const std::string& model) {
-  size_t entrySize = model.length() + 1;
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_0, EXIF_TAG_MODEL, EXIF_FORMAT_ASCII, entrySize, entrySize);
-  if (!entry) {
-    ALOGE("%s: Adding Model exif entry failed", __FUNCTION__);
-    return false;
-  }
-  memcpy(entry->data, model.c_str(), entrySize);
+  model_ = model;
   return true;
 }
 
@@ -139,164 +253,53 @@ bool ExifUtils::SetDateTime(const struct tm& t) {
     ALOGW("%s: Input time is invalid", __FUNCTION__);
     return false;
   }
-  std::unique_ptr<ExifEntry> entry =
-      AddVariableLengthEntry(EXIF_IFD_0, EXIF_TAG_DATE_TIME, EXIF_FORMAT_ASCII,
-                             sizeof(str), sizeof(str));
-  if (!entry) {
-    ALOGE("%s: Adding DateTime exif entry failed", __FUNCTION__);
-    return false;
-  }
-  memcpy(entry->data, str, sizeof(str));
+  date_time_ = str;
   return true;
 }
 
 bool ExifUtils::SetFocalLength(uint32_t numerator, uint32_t denominator) {
-  std::unique_ptr<ExifEntry> entry =
-      AddEntry(EXIF_IFD_EXIF, EXIF_TAG_FOCAL_LENGTH);
-  if (!entry) {
-    ALOGE("%s: Adding FocalLength exif entry failed", __FUNCTION__);
-    return false;
-  }
-  exif_set_rational(entry->data, EXIF_BYTE_ORDER_INTEL,
-                    {numerator, denominator});
+  has_focal_length_ = true;
+  focal_length_numerator_ = numerator;
+  focal_length_denominator_ = denominator;
   return true;
 }
 
 bool ExifUtils::SetGpsLatitude(double latitude) {
-  const ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE_REF);
-  std::unique_ptr<ExifEntry> refEntry =
-      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_ASCII, 2, 2);
-  if (!refEntry) {
-    ALOGE("%s: Adding GPSLatitudeRef exif entry failed", __FUNCTION__);
-    return false;
-  }
-  if (latitude >= 0) {
-    memcpy(refEntry->data, "N", sizeof("N"));
-  } else {
-    memcpy(refEntry->data, "S", sizeof("S"));
-    latitude *= -1;
-  }
-
-  const ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE);
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 3, 3 * sizeof(ExifRational));
-  if (!entry) {
-    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
-    ALOGE("%s: Adding GPSLatitude exif entry failed", __FUNCTION__);
-    return false;
-  }
-  SetLatitudeOrLongitudeData(entry->data, latitude);
-
+  has_latitude_ = true;
+  latitude_ = latitude;
   return true;
 }
 
 bool ExifUtils::SetGpsLongitude(double longitude) {
-  ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE_REF);
-  std::unique_ptr<ExifEntry> refEntry =
-      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_ASCII, 2, 2);
-  if (!refEntry) {
-    ALOGE("%s: Adding GPSLongitudeRef exif entry failed", __FUNCTION__);
-    return false;
-  }
-  if (longitude >= 0) {
-    memcpy(refEntry->data, "E", sizeof("E"));
-  } else {
-    memcpy(refEntry->data, "W", sizeof("W"));
-    longitude *= -1;
-  }
-
-  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE);
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 3, 3 * sizeof(ExifRational));
-  if (!entry) {
-    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
-    ALOGE("%s: Adding GPSLongitude exif entry failed", __FUNCTION__);
-    return false;
-  }
-  SetLatitudeOrLongitudeData(entry->data, longitude);
-
+  has_longitude_ = true;
+  longitude_ = longitude;
   return true;
 }
 
 bool ExifUtils::SetGpsAltitude(double altitude) {
-  ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE_REF);
-  std::unique_ptr<ExifEntry> refEntry =
-      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_BYTE, 1, 1);
-  if (!refEntry) {
-    ALOGE("%s: adding GPSAltitudeRef exif entry failed", __FUNCTION__);
-    return false;
-  }
-  if (altitude >= 0) {
-    *refEntry->data = 0;
-  } else {
-    *refEntry->data = 1;
-    altitude *= -1;
-  }
-
-  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE);
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 1, sizeof(ExifRational));
-  if (!entry) {
-    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
-    ALOGE("%s: Adding GPSAltitude exif entry failed", __FUNCTION__);
-    return false;
-  }
-  exif_set_rational(entry->data, EXIF_BYTE_ORDER_INTEL,
-                    {static_cast<ExifLong>(altitude * 1000), 1000});
-
+  has_altitude_ = true;
+  altitude_ = altitude;
   return true;
 }
 
 bool ExifUtils::SetGpsTimestamp(const struct tm& t) {
-  const ExifTag dateTag = static_cast<ExifTag>(EXIF_TAG_GPS_DATE_STAMP);
   const size_t kGpsDateStampSize = 11;
-  std::unique_ptr<ExifEntry> entry =
-      AddVariableLengthEntry(EXIF_IFD_GPS, dateTag, EXIF_FORMAT_ASCII,
-                             kGpsDateStampSize, kGpsDateStampSize);
-  if (!entry) {
-    ALOGE("%s: Adding GPSDateStamp exif entry failed", __FUNCTION__);
-    return false;
-  }
-  int result =
-      snprintf(reinterpret_cast<char*>(entry->data), kGpsDateStampSize,
-               "%04i:%02i:%02i", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+  char str[kGpsDateStampSize];
+  int result = snprintf(str, kGpsDateStampSize, "%04i:%02i:%02i",
+                        t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
   if (result != kGpsDateStampSize - 1) {
     ALOGW("%s: Input time is invalid", __FUNCTION__);
     return false;
   }
-
-  const ExifTag timeTag = static_cast<ExifTag>(EXIF_TAG_GPS_TIME_STAMP);
-  entry = AddVariableLengthEntry(EXIF_IFD_GPS, timeTag, EXIF_FORMAT_RATIONAL, 3,
-                                 3 * sizeof(ExifRational));
-  if (!entry) {
-    ALOGE("%s: Adding GPSTimeStamp exif entry failed", __FUNCTION__);
-    return false;
-  }
-  exif_set_rational(entry->data, EXIF_BYTE_ORDER_INTEL,
-                    {static_cast<ExifLong>(t.tm_hour), 1});
-  exif_set_rational(entry->data + sizeof(ExifRational), EXIF_BYTE_ORDER_INTEL,
-                    {static_cast<ExifLong>(t.tm_min), 1});
-  exif_set_rational(entry->data + 2 * sizeof(ExifRational),
-                    EXIF_BYTE_ORDER_INTEL,
-                    {static_cast<ExifLong>(t.tm_sec), 1});
-
+  has_gps_timestamp_ = true;
+  gps_timestamp_ = t;
+  gps_date_stamp_ = str;
   return true;
 }
 
 bool ExifUtils::SetGpsProcessingMethod(const std::string& method) {
-  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_PROCESSING_METHOD);
-  size_t size = sizeof(gExifAsciiPrefix) + method.length();
-  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
-      EXIF_IFD_GPS, tag, EXIF_FORMAT_UNDEFINED, size, size);
-  if (!entry) {
-    ALOGE("%s: Adding GPSProcessingMethod exif entry failed", __FUNCTION__);
-    return false;
-  }
-  memcpy(entry->data, gExifAsciiPrefix, sizeof(gExifAsciiPrefix));
-  // Since the exif format is undefined, NULL termination is not necessary.
-  memcpy(entry->data + sizeof(gExifAsciiPrefix), method.c_str(),
-         method.length());
-
+  has_gps_processing_method_ = true;
+  gps_processing_method_ = method;
   return true;
 }
 
@@ -311,56 +314,39 @@ bool ExifUtils::SetThumbnailSize(uint16_t width, uint16_t height) {
 }
 
 bool ExifUtils::SetOrientation(uint16_t orientation) {
-  std::unique_ptr<ExifEntry> entry = AddEntry(EXIF_IFD_0, EXIF_TAG_ORIENTATION);
-  if (!entry) {
-    ALOGE("%s: Adding Orientation exif entry failed", __FUNCTION__);
-    return false;
-  }
-  /*
-   * Orientation value:
-   *  1      2      3      4      5          6          7          8
-   *
-   *  888888 888888     88 88     8888888888 88                 88 8888888888
-   *  88         88     88 88     88  88     88  88         88  88     88  88
-   *  8888     8888   8888 8888   88         8888888888 8888888888         88
-   *  88         88     88 88
-   *  88         88 888888 888888
-   */
-  int value = 1;
-  switch (orientation) {
-    case 90:
-      value = 6;
-      break;
-    case 180:
-      value = 3;
-      break;
-    case 270:
-      value = 8;
-      break;
-    default:
-      break;
-  }
-  exif_set_short(entry->data, EXIF_BYTE_ORDER_INTEL, value);
+  has_orientation_ = true;
+  orientation_ = orientation;
   return true;
 }
 
 bool ExifUtils::GenerateApp1() {
   DestroyApp1();
-  if (thumbnail_width_ > 0 && thumbnail_height_ > 0) {
-    if (!GenerateThumbnail()) {
-      ALOGE("%s: Generate thumbnail image failed", __FUNCTION__);
-      return false;
+
+  std::string layout = GetLayoutKey();
+  std::shared_ptr<const ExifApp1Template> app1_template;
+  {
+    std::lock_guard l(gApp1TemplateLock);
+    if (gApp1Template && gApp1Template->layout == layout) {
+      app1_template = gApp1Template;
     }
-    exif_data_->data = const_cast<uint8_t*>(
-        static_cast<const uint8_t*>(compressor_.GetCompressedImagePtr()));
-    exif_data_->size = compressor_.GetCompressedImageSize();
   }
-  // Save the result into |app1_buffer_|.
-  exif_data_save_data(exif_data_, &app1_buffer_, &app1_length_);
-  if (!app1_length_) {
-    ALOGE("%s: Allocate memory for app1_buffer_ failed", __FUNCTION__);
-    return false;
+
+  if (app1_template) {
+    if (!GenerateApp1FromTemplate(*app1_template)) {
+      return false;
+    }
+  } else {
+    if (!GenerateApp1WithLibexif()) {
+      return false;
+    }
+    std::shared_ptr<const ExifApp1Template> created =
+        CreateApp1Template(layout, exif_data_->size);
+    if (created) {
+      std::lock_guard l(gApp1TemplateLock);
+      gApp1Template = created;
+    }
   }
+
   /*
    * The JPEG segment size is 16 bits in spec. The size of APP1 segment should
    * be smaller than 65533 because there are two bytes for segment size field.
@@ -383,6 +369,18 @@ void ExifUtils::Reset() {
   yu12_height_ = 0;
   thumbnail_width_ = 0;
   thumbnail_height_ = 0;
+  maker_.clear();
+  model_.clear();
+  date_time_.clear();
+  has_focal_length_ = false;
+  has_latitude_ = false;
+  has_longitude_ = false;
+  has_altitude_ = false;
+  has_gps_timestamp_ = false;
+  gps_date_stamp_.clear();
+  has_gps_processing_method_ = false;
+  gps_processing_method_.clear();
+  has_orientation_ = false;
   DestroyApp1();
   if (exif_data_) {
     /*
@@ -396,6 +394,212 @@ void ExifUtils::Reset() {
     exif_data_unref(exif_data_);
     exif_data_ = nullptr;
   }
+  compressor_.reset();
+}
+
+std::string ExifUtils::GetLayoutKey() const {
+  // Strings are prefixed with their length to keep the key unambiguous.
+  auto field = [](const std::string& value) {
+    return std::to_string(value.size()) + ":" + value + ";";
+  };
+
+  std::string key = std::to_string(yu12_width_) + "x" +
+                    std::to_string(yu12_height_) + ";";
+  key += !date_time_.empty() ? 'D' : '-';
+  key += has_latitude_ ? 'A' : '-';
+  key += has_longitude_ ? 'O' : '-';
+  key += has_altitude_ ? 'H' : '-';
+  key += has_gps_timestamp_ ? 'T' : '-';
+  key += has_orientation_ ? 'R' : '-';
+  key += thumbnail_width_ > 0 && thumbnail_height_ > 0 ? 'J' : '-';
+  key += ";";
+  if (has_focal_length_) {
+    key += std::to_string(focal_length_numerator_) + "/" +
+           std::to_string(focal_length_denominator_);
+  }
+  key += ";" + field(maker_) + field(model_);
+  if (has_gps_processing_method_) {
+    key += field(gps_processing_method_);
+  }
+  return key;
+}
+
+std::shared_ptr<const ExifApp1Template> ExifUtils::CreateApp1Template(
+    const std::string& layout, unsigned int thumbnail_size) const {
+  if (app1_length_ < kTiffHeaderOffset + 8 || thumbnail_size > app1_length_ ||
+      memcmp(app1_buffer_, kExifIdentifierCode, kTiffHeaderOffset) != 0) {
+    return nullptr;
+  }
+
+  auto app1_template = std::make_shared<ExifApp1Template>();
+  app1_template->layout = layout;
+  std::vector<uint8_t>& data = app1_template->data;
+  data.assign(app1_buffer_, app1_buffer_ + app1_length_);
+
+  size_t ifd0 =
+      exif_get_long(&data[kTiffHeaderOffset + 4], EXIF_BYTE_ORDER_INTEL);
+  size_t gps_ifd = 0;
+  size_t gps_pointer = FindTagValue(data, ifd0, EXIF_TAG_GPS_INFO_IFD_POINTER);
+  if (gps_pointer) {
+    gps_ifd = exif_get_long(&data[gps_pointer], EXIF_BYTE_ORDER_INTEL);
+  }
+
+  // A tag which is set must be found, or the layout is not understood.
+  bool found = true;
+  auto find = [&](size_t ifd, int tag, bool set) {
+    size_t value = set ? FindTagValue(data, ifd, static_cast<ExifTag>(tag)) : 0;
+    found &= !set || value;
+    return value;
+  };
+  app1_template->date_time = find(ifd0, EXIF_TAG_DATE_TIME,
+                                  !date_time_.empty());
+  app1_template->orientation = find(ifd0, EXIF_TAG_ORIENTATION,
+                                    has_orientation_);
+  app1_template->latitude_ref = find(gps_ifd, EXIF_TAG_GPS_LATITUDE_REF,
+                                     has_latitude_);
+  app1_template->latitude = find(gps_ifd, EXIF_TAG_GPS_LATITUDE,
+                                 has_latitude_);
+  app1_template->longitude_ref = find(gps_ifd, EXIF_TAG_GPS_LONGITUDE_REF,
+                                      has_longitude_);
+  app1_template->longitude = find(gps_ifd, EXIF_TAG_GPS_LONGITUDE,
+                                  has_longitude_);
+  app1_template->altitude_ref = find(gps_ifd, EXIF_TAG_GPS_ALTITUDE_REF,
+                                     has_altitude_);
+  app1_template->altitude = find(gps_ifd, EXIF_TAG_GPS_ALTITUDE,
+                                 has_altitude_);
+  app1_template->gps_date_stamp = find(gps_ifd, EXIF_TAG_GPS_DATE_STAMP,
+                                       has_gps_timestamp_);
+  app1_template->gps_time_stamp = find(gps_ifd, EXIF_TAG_GPS_TIME_STAMP,
+                                       has_gps_timestamp_);
+
+  // The thumbnail image must end the segment to be replaced.
+  size_t ifd1 = FindNextIfd(data, ifd0);
+  size_t thumbnail = find(ifd1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT,
+                          thumbnail_size > 0);
+  app1_template->thumbnail_length =
+      find(ifd1, EXIF_TAG_JPEG_INTERCHANGE_FORMAT_LENGTH, thumbnail_size > 0);
+  if (!found) {
+    ALOGW("%s: Unexpected APP1 layout, not cached", __FUNCTION__);
+    return nullptr;
+  }
+  if (thumbnail_size > 0 &&
+      kTiffHeaderOffset +
+              exif_get_long(&data[thumbnail], EXIF_BYTE_ORDER_INTEL) !=
+          app1_length_ - thumbnail_size) {
+    ALOGW("%s: Thumbnail does not end APP1, not cached", __FUNCTION__);
+    return nullptr;
+  }
+  data.resize(app1_length_ - thumbnail_size);
+
+  return app1_template;
+}
+
+bool ExifUtils::GenerateApp1FromTemplate(
+    const ExifApp1Template& app1_template) {
+  const void* thumbnail = nullptr;
+  size_t thumbnail_size = 0;
+  if (thumbnail_width_ > 0 && thumbnail_height_ > 0) {
+    if (!GenerateThumbnail()) {
+      ALOGE("%s: Generate thumbnail image failed", __FUNCTION__);
+      return false;
+    }
+    thumbnail = compressor_->GetCompressedImagePtr();
+    thumbnail_size = compressor_->GetCompressedImageSize();
+  }
+
+  size_t length = app1_template.data.size() + thumbnail_size;
+  // Allocated with malloc() like the buffers saved by libexif, see
+  // DestroyApp1().
+  app1_buffer_ = static_cast<uint8_t*>(malloc(length));
+  if (!app1_buffer_) {
+    ALOGE("%s: Allocate memory for app1_buffer_ failed", __FUNCTION__);
+    return false;
+  }
+  app1_length_ = length;
+  memcpy(app1_buffer_, app1_template.data.data(), app1_template.data.size());
+  if (thumbnail_size > 0) {
+    memcpy(app1_buffer_ + app1_template.data.size(), thumbnail,
+           thumbnail_size);
+    exif_set_long(app1_buffer_ + app1_template.thumbnail_length,
+                  EXIF_BYTE_ORDER_INTEL, thumbnail_size);
+  }
+
+  if (app1_template.date_time) {
+    memcpy(app1_buffer_ + app1_template.date_time, date_time_.c_str(),
+           date_time_.size() + 1);
+  }
+  if (app1_template.orientation) {
+    exif_set_short(app1_buffer_ + app1_template.orientation,
+                   EXIF_BYTE_ORDER_INTEL, GetExifOrientation(orientation_));
+  }
+  if (app1_template.latitude) {
+    SetLatitudeOrLongitude(app1_buffer_ + app1_template.latitude_ref,
+                           app1_buffer_ + app1_template.latitude, latitude_,
+                           'N', 'S');
+  }
+  if (app1_template.longitude) {
+    SetLatitudeOrLongitude(app1_buffer_ + app1_template.longitude_ref,
+                           app1_buffer_ + app1_template.longitude, longitude_,
+                           'E', 'W');
+  }
+  if (app1_template.altitude) {
+    SetAltitude(app1_buffer_ + app1_template.altitude_ref,
+                app1_buffer_ + app1_template.altitude, altitude_);
+  }
+  if (app1_template.gps_date_stamp) {
+    memcpy(app1_buffer_ + app1_template.gps_date_stamp,
+           gps_date_stamp_.c_str(), gps_date_stamp_.size() + 1);
+    SetGpsTimeStampData(app1_buffer_ + app1_template.gps_time_stamp,
+                        gps_timestamp_);
+  }
+  return true;
+}
+
+bool ExifUtils::GenerateApp1WithLibexif() {
+  exif_data_ = exif_data_new();
+  if (exif_data_ == nullptr) {
+    ALOGE("%s: allocate memory for exif_data_ failed", __FUNCTION__);
+    return false;
+  }
+  // Set the image options.
+  exif_data_set_option(exif_data_, EXIF_DATA_OPTION_FOLLOW_SPECIFICATION);
+  exif_data_set_data_type(exif_data_, EXIF_DATA_TYPE_COMPRESSED);
+  exif_data_set_byte_order(exif_data_, EXIF_BYTE_ORDER_INTEL);
+
+  // Set image width and length.
+  AddImageWidth(yu12_width_);
+  AddImageLength(yu12_height_);
+
+  if ((!maker_.empty() && !AddString(EXIF_IFD_0, EXIF_TAG_MAKE, maker_)) ||
+      (!model_.empty() && !AddString(EXIF_IFD_0, EXIF_TAG_MODEL, model_)) ||
+      (!date_time_.empty() &&
+       !AddString(EXIF_IFD_0, EXIF_TAG_DATE_TIME, date_time_)) ||
+      (has_focal_length_ && !AddFocalLength()) ||
+      (has_latitude_ && !AddGpsLatitude()) ||
+      (has_longitude_ && !AddGpsLongitude()) ||
+      (has_altitude_ && !AddGpsAltitude()) ||
+      (has_gps_timestamp_ && !AddGpsTimestamp()) ||
+      (has_gps_processing_method_ && !AddGpsProcessingMethod()) ||
+      (has_orientation_ && !AddOrientation())) {
+    return false;
+  }
+
+  if (thumbnail_width_ > 0 && thumbnail_height_ > 0) {
+    if (!GenerateThumbnail()) {
+      ALOGE("%s: Generate thumbnail image failed", __FUNCTION__);
+      return false;
+    }
+    exif_data_->data = const_cast<uint8_t*>(
+        static_cast<const uint8_t*>(compressor_->GetCompressedImagePtr()));
+    exif_data_->size = compressor_->GetCompressedImageSize();
+  }
+  // Save the result into |app1_buffer_|.
+  exif_data_save_data(exif_data_, &app1_buffer_, &app1_length_);
+  if (!app1_length_) {
+    ALOGE("%s: Allocate memory for app1_buffer_ failed", __FUNCTION__);
+    return false;
+  }
+  return true;
 }
 
 std::unique_ptr<ExifEntry> ExifUtils::AddVariableLengthEntry(
@@ -453,7 +657,7 @@ std::unique_ptr<ExifEntry> ExifUtils::AddEntry(ExifIfd ifd, ExifTag tag) {
   return entry;
 }
 
-bool ExifUtils::SetImageWidth(uint16_t width) {
+bool ExifUtils::AddImageWidth(uint16_t width) {
   std::unique_ptr<ExifEntry> entry = AddEntry(EXIF_IFD_0, EXIF_TAG_IMAGE_WIDTH);
   if (!entry) {
     ALOGE("%s: Adding ImageWidth exif entry failed", __FUNCTION__);
@@ -463,7 +667,7 @@ bool ExifUtils::SetImageWidth(uint16_t width) {
   return true;
 }
 
-bool ExifUtils::SetImageLength(uint16_t length) {
+bool ExifUtils::AddImageLength(uint16_t length) {
   std::unique_ptr<ExifEntry> entry =
       AddEntry(EXIF_IFD_0, EXIF_TAG_IMAGE_LENGTH);
   if (!entry) {
@@ -474,6 +678,143 @@ bool ExifUtils::SetImageLength(uint16_t length) {
   return true;
 }
 
+bool ExifUtils::AddString(ExifIfd ifd, ExifTag tag, const std::string& value) {
+  size_t entrySize = value.length() + 1;
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      ifd, tag, EXIF_FORMAT_ASCII, entrySize, entrySize);
+  if (!entry) {
+    ALOGE("%s: Adding %s exif entry failed", __FUNCTION__,
+          exif_tag_get_name(tag));
+    return false;
+  }
+  memcpy(entry->data, value.c_str(), entrySize);
+  return true;
+}
+
+bool ExifUtils::AddFocalLength() {
+  std::unique_ptr<ExifEntry> entry =
+      AddEntry(EXIF_IFD_EXIF, EXIF_TAG_FOCAL_LENGTH);
+  if (!entry) {
+    ALOGE("%s: Adding FocalLength exif entry failed", __FUNCTION__);
+    return false;
+  }
+  exif_set_rational(entry->data, EXIF_BYTE_ORDER_INTEL,
+                    {focal_length_numerator_, focal_length_denominator_});
+  return true;
+}
+
+bool ExifUtils::AddGpsLatitude() {
+  const ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE_REF);
+  std::unique_ptr<ExifEntry> refEntry =
+      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_ASCII, 2, 2);
+  if (!refEntry) {
+    ALOGE("%s: Adding GPSLatitudeRef exif entry failed", __FUNCTION__);
+    return false;
+  }
+
+  const ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_LATITUDE);
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 3, 3 * sizeof(ExifRational));
+  if (!entry) {
+    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
+    ALOGE("%s: Adding GPSLatitude exif entry failed", __FUNCTION__);
+    return false;
+  }
+  SetLatitudeOrLongitude(refEntry->data, entry->data, latitude_, 'N', 'S');
+
+  return true;
+}
+
+bool ExifUtils::AddGpsLongitude() {
+  ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE_REF);
+  std::unique_ptr<ExifEntry> refEntry =
+      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_ASCII, 2, 2);
+  if (!refEntry) {
+    ALOGE("%s: Adding GPSLongitudeRef exif entry failed", __FUNCTION__);
+    return false;
+  }
+
+  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_LONGITUDE);
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 3, 3 * sizeof(ExifRational));
+  if (!entry) {
+    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
+    ALOGE("%s: Adding GPSLongitude exif entry failed", __FUNCTION__);
+    return false;
+  }
+  SetLatitudeOrLongitude(refEntry->data, entry->data, longitude_, 'E', 'W');
+
+  return true;
+}
+
+bool ExifUtils::AddGpsAltitude() {
+  ExifTag refTag = static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE_REF);
+  std::unique_ptr<ExifEntry> refEntry =
+      AddVariableLengthEntry(EXIF_IFD_GPS, refTag, EXIF_FORMAT_BYTE, 1, 1);
+  if (!refEntry) {
+    ALOGE("%s: adding GPSAltitudeRef exif entry failed", __FUNCTION__);
+    return false;
+  }
+
+  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_ALTITUDE);
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      EXIF_IFD_GPS, tag, EXIF_FORMAT_RATIONAL, 1, sizeof(ExifRational));
+  if (!entry) {
+    exif_content_remove_entry(exif_data_->ifd[EXIF_IFD_GPS], refEntry.get());
+    ALOGE("%s: Adding GPSAltitude exif entry failed", __FUNCTION__);
+    return false;
+  }
+  SetAltitude(refEntry->data, entry->data, altitude_);
+
+  return true;
+}
+
+bool ExifUtils::AddGpsTimestamp() {
+  const ExifTag dateTag = static_cast<ExifTag>(EXIF_TAG_GPS_DATE_STAMP);
+  if (!AddString(EXIF_IFD_GPS, dateTag, gps_date_stamp_)) {
+    return false;
+  }
+
+  const ExifTag timeTag = static_cast<ExifTag>(EXIF_TAG_GPS_TIME_STAMP);
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      EXIF_IFD_GPS, timeTag, EXIF_FORMAT_RATIONAL, 3, 3 * sizeof(ExifRational));
+  if (!entry) {
+    ALOGE("%s: Adding GPSTimeStamp exif entry failed", __FUNCTION__);
+    return false;
+  }
+  SetGpsTimeStampData(entry->data, gps_timestamp_);
+
+  return true;
+}
+
+bool ExifUtils::AddGpsProcessingMethod() {
+  ExifTag tag = static_cast<ExifTag>(EXIF_TAG_GPS_PROCESSING_METHOD);
+  size_t size = sizeof(gExifAsciiPrefix) + gps_processing_method_.length();
+  std::unique_ptr<ExifEntry> entry = AddVariableLengthEntry(
+      EXIF_IFD_GPS, tag, EXIF_FORMAT_UNDEFINED, size, size);
+  if (!entry) {
+    ALOGE("%s: Adding GPSProcessingMethod exif entry failed", __FUNCTION__);
+    return false;
+  }
+  memcpy(entry->data, gExifAsciiPrefix, sizeof(gExifAsciiPrefix));
+  // Since the exif format is undefined, NULL termination is not necessary.
+  memcpy(entry->data + sizeof(gExifAsciiPrefix),
+         gps_processing_method_.c_str(), gps_processing_method_.length());
+
+  return true;
+}
+
+bool ExifUtils::AddOrientation() {
+  std::unique_ptr<ExifEntry> entry = AddEntry(EXIF_IFD_0, EXIF_TAG_ORIENTATION);
+  if (!entry) {
+    ALOGE("%s: Adding Orientation exif entry failed", __FUNCTION__);
+    return false;
+  }
+  exif_set_short(entry->data, EXIF_BYTE_ORDER_INTEL,
+                 GetExifOrientation(orientation_));
+  return true;
+}
+
 bool ExifUtils::GenerateThumbnail() {
   // Resize yuv image to |thumbnail_width_| x |thumbnail_height_|.
   std::vector<uint8_t> scaled_buffer;
@@ -483,7 +824,12 @@ bool ExifUtils::GenerateThumbnail() {
   }
 
   // Compress thumbnail to JPEG.
-  if (!compressor_.CompressImage(scaled_buffer.data(), thumbnail_width_,
+  if (!compressor_) {
+    compressor_ = JpegCompressorPool::GetInstance().Acquire(
+        thumbnail_width_, thumbnail_height_, thumbnail_jpeg_quality_);
+  }
+
+  if (!compressor_->CompressImage(scaled_buffer.data(), thumbnail_width_,
                                  thumbnail_height_, thumbnail_jpeg_quality_,
                                  NULL, 0)) {
     ALOGE("%s: Compress thumbnail failed", __FUNCTION__);
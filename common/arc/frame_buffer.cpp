@@ -22,8 +22,10 @@
 
 #include "frame_buffer.h"
 
+#include <stdlib.h>
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <utility>
 
 #include "image_processor.h"
@@ -55,10 +57,93 @@ int FrameBuffer::SetDataSize(size_t data_size) {
   return 0;
 }
 
-AllocatedFrameBuffer::AllocatedFrameBuffer(int buffer_size) {
-  buffer_.reset(new uint8_t[buffer_size]);
-  buffer_size_ = buffer_size;
-  data_ = buffer_.get();
+uint8_t* FrameBuffer::GetPlaneData(size_t plane) const {
+  return plane == 0 ? data_ : nullptr;
+}
+
+size_t FrameBuffer::GetPlaneDataSize(size_t plane) const {
+  return plane == 0 ? data_size_ : 0;
+}
+
+/* Alignment of the pool blocks, one cache line */
+static constexpr size_t kBlockAlignment = 64;
+
+/* Number of free blocks kept per size class */
+static constexpr size_t kMaxFreeBlocks = 4;
+
+FrameBufferPool::FrameBufferPool() {}
+
+FrameBufferPool::~FrameBufferPool() {
+  for (auto &it : free_blocks_) {
+    for (uint8_t *block : it.second)
+      free(block);
+  }
+}
+
+size_t FrameBufferPool::SizeClass(size_t size) {
+  if (size <= kBlockAlignment)
+    return kBlockAlignment;
+
+  /* Round up to an eighth of the enclosing power of two, so that the memory
+   * lost to the rounding stays below 12.5%.
+   */
+  size_t msb = 1;
+  while (msb <= (size - 1) / 2)
+    msb <<= 1;
+
+  size_t step = std::max(msb / 8, kBlockAlignment);
+
+  return (size + step - 1) / step * step;
+}
+
+uint8_t* FrameBufferPool::Acquire(size_t size, size_t* capacity) {
+  size_t size_class = SizeClass(size);
+
+  {
+    std::lock_guard l(lock_);
+
+    auto it = free_blocks_.find(size_class);
+    if (it != free_blocks_.end() && !it->second.empty()) {
+      uint8_t *block = it->second.back();
+      it->second.pop_back();
+      *capacity = size_class;
+      return block;
+    }
+  }
+
+  void *block = nullptr;
+  if (posix_memalign(&block, kBlockAlignment, size_class)) {
+    ALOGE("%s: Failed to allocate %zu bytes", __FUNCTION__, size_class);
+    return nullptr;
+  }
+
+  ALOGV("%s: allocated a new block of %zu bytes", __FUNCTION__, size_class);
+
+  *capacity = size_class;
+  return static_cast<uint8_t*>(block);
+}
+
+void FrameBufferPool::Release(uint8_t* block, size_t capacity) {
+  if (!block)
+    return;
+
+  std::lock_guard l(lock_);
+
+  std::vector<uint8_t*> &blocks = free_blocks_[capacity];
+  if (blocks.size() >= kMaxFreeBlocks) {
+    free(block);
+    return;
+  }
+
+  blocks.push_back(block);
+}
+
+AllocatedFrameBuffer::AllocatedFrameBuffer(
+    int buffer_size, std::shared_ptr<FrameBufferPool> pool)
+    : pool_(pool ? std::move(pool) : std::make_shared<FrameBufferPool>()) {
+  data_ = pool_->Acquire(buffer_size, &buffer_size_);
+  if (!data_)
+    buffer_size_ = 0;
 }
 
 AllocatedFrameBuffer::AllocatedFrameBuffer(uint8_t* buffer, int buffer_size) {
@@ -67,13 +152,26 @@ AllocatedFrameBuffer::AllocatedFrameBuffer(uint8_t* buffer, int buffer_size) {
   data_ = buffer;
 }
 
-AllocatedFrameBuffer::~AllocatedFrameBuffer() {}
+AllocatedFrameBuffer::~AllocatedFrameBuffer() {
+  if (pool_)
+    pool_->Release(data_, buffer_size_);
+}
 
 int AllocatedFrameBuffer::SetDataSize(size_t size) {
   if (size > buffer_size_) {
-    buffer_.reset(new uint8_t[size]);
-    buffer_size_ = size;
-    data_ = buffer_.get();
+    if (!pool_)
+      pool_ = std::make_shared<FrameBufferPool>();
+    else
+      pool_->Release(data_, buffer_size_);
+
+    /* The previous content is not preserved */
+    buffer_.reset();
+    data_ = pool_->Acquire(size, &buffer_size_);
+    if (!data_) {
+      buffer_size_ = 0;
+      data_size_ = 0;
+      return -ENOMEM;
+    }
   }
   data_size_ = size;
   return 0;
@@ -84,13 +182,29 @@ void AllocatedFrameBuffer::Reset() { memset(data_, 0, buffer_size_); }
 V4L2FrameBuffer::V4L2FrameBuffer(base::unique_fd fd, int buffer_size,
                                  uint32_t width, uint32_t height,
                                  uint32_t fourcc)
-    : fd_(std::move(fd)), is_mapped_(false) {
+    : is_mapped_(false) {
+  planes_.push_back({std::move(fd), static_cast<size_t>(buffer_size),
+                     nullptr, 0});
   buffer_size_ = buffer_size;
   width_ = width;
   height_ = height;
   fourcc_ = fourcc;
 }
 
+V4L2FrameBuffer::V4L2FrameBuffer(std::vector<base::unique_fd> fds,
+                                 const std::vector<uint32_t>& plane_sizes,
+                                 uint32_t width, uint32_t height,
+                                 uint32_t fourcc)
+    : is_mapped_(false) {
+  for (size_t i = 0; i < fds.size() && i < plane_sizes.size(); ++i) {
+    planes_.push_back({std::move(fds[i]), plane_sizes[i], nullptr, 0});
+    buffer_size_ += plane_sizes[i];
+  }
+  width_ = width;
+  height_ = height;
+  fourcc_ = fourcc;
+}
+
 V4L2FrameBuffer::~V4L2FrameBuffer() {
   if (Unmap()) {
     ALOGE("%s: Unmap failed", __FUNCTION__);
@@ -105,14 +219,20 @@ int V4L2FrameBuffer::Map() {
     return -EINVAL;
   }
 
-  void* addr = mmap(NULL, buffer_size_, PROT_READ, MAP_SHARED, fd_.get(), 0);
+  for (Plane& plane : planes_) {
+    void* addr = mmap(NULL, plane.buffer_size, PROT_READ, MAP_SHARED,
+                      plane.fd.get(), 0);
 
-  if (addr == MAP_FAILED) {
-    ALOGE("%s: mmap() failed: %s", __FUNCTION__,  strerror(errno));
-    return -EINVAL;
+    if (addr == MAP_FAILED) {
+      ALOGE("%s: mmap() failed: %s", __FUNCTION__,  strerror(errno));
+      UnmapLocked();
+      return -EINVAL;
+    }
+
+    plane.data = static_cast<uint8_t*>(addr);
   }
 
-  data_ = static_cast<uint8_t*>(addr);
+  data_ = planes_.empty() ? nullptr : planes_[0].data;
   is_mapped_ = true;
 
   return 0;
@@ -121,16 +241,72 @@ int V4L2FrameBuffer::Map() {
 int V4L2FrameBuffer::Unmap() {
   std::lock_guard l(lock_);
 
-  if (is_mapped_ && munmap(data_, buffer_size_)) {
-    ALOGE("%s: mummap() failed: %s", __FUNCTION__, strerror(errno));
+  int res = UnmapLocked();
+  is_mapped_ = false;
+
+  return res;
+}
+
+int V4L2FrameBuffer::UnmapLocked() {
+  int res = 0;
+
+  for (Plane& plane : planes_) {
+    if (plane.data && munmap(plane.data, plane.buffer_size)) {
+      ALOGE("%s: mummap() failed: %s", __FUNCTION__, strerror(errno));
+      res = -EINVAL;
+    }
+    plane.data = nullptr;
+  }
+  data_ = nullptr;
+
+  return res;
+}
+
+int V4L2FrameBuffer::SetDataSize(size_t data_size) {
+  if (planes_.size() != 1) {
+    ALOGE("%s: The bytes used by each of the %zu planes are needed",
+              __FUNCTION__, planes_.size());
     return -EINVAL;
   }
 
-  is_mapped_ = false;
+  return SetPlaneDataSizes({static_cast<uint32_t>(data_size)});
+}
+
+int V4L2FrameBuffer::SetPlaneDataSizes(const std::vector<uint32_t>& data_sizes) {
+  if (data_sizes.size() != planes_.size()) {
+    ALOGE("%s: Got the bytes used by %zu planes, the buffer has %zu",
+              __FUNCTION__, data_sizes.size(), planes_.size());
+    return -EINVAL;
+  }
+
+  size_t data_size = 0;
+  for (size_t i = 0; i < planes_.size(); ++i) {
+    if (data_sizes[i] > planes_[i].buffer_size) {
+      ALOGE("%s: Buffer overflow: Plane %zu only has %zu, but data needs %u",
+                __FUNCTION__, i, planes_[i].buffer_size, data_sizes[i]);
+      return -EINVAL;
+    }
+    data_size += data_sizes[i];
+  }
+
+  int res = FrameBuffer::SetDataSize(data_size);
+  if (res)
+    return res;
+
+  for (size_t i = 0; i < planes_.size(); ++i)
+    planes_[i].data_size = data_sizes[i];
 
   return 0;
 }
 
+uint8_t* V4L2FrameBuffer::GetPlaneData(size_t plane) const {
+  return plane < planes_.size() ? planes_[plane].data : nullptr;
+}
+
+size_t V4L2FrameBuffer::GetPlaneDataSize(size_t plane) const {
+  return plane < planes_.size() ? planes_[plane].data_size : 0;
+}
+
 GrallocFrameBuffer::GrallocFrameBuffer(buffer_handle_t buffer, uint32_t width,
                                        uint32_t height, uint32_t fourcc,
                                        uint32_t device_buffer_length,
@@ -202,6 +378,9 @@ int GrallocFrameBuffer::Map(hidl_handle acquire_fence) {
     buffer_size_ = ImageProcessor::GetConvertedSize(fourcc_, width_, height_);
 
     ALOGV("%s: calculated converted size: %zu", __FUNCTION__, buffer_size_);
+  } else if (fourcc_ == V4L2_PIX_FMT_JPEG) {
+    // BLOB buffers are as large as the locked region.
+    buffer_size_ = device_buffer_length_;
   }
 
   is_mapped_ = true;
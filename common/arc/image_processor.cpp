@@ -20,11 +20,17 @@
 
 #include "image_processor.h"
 
+#include <aidl/android/hardware/camera/device/CameraBlob.h>
 #include <errno.h>
 #include <libyuv.h>
+
+#include <algorithm>
+#include <functional>
+#include <future>
 #include <time.h>
 #include <utils/Log.h>
 
+#include "band_processor.h"
 #include "common_types.h"
 #include "exif_utils.h"
 #include "jpeg_compressor.h"
@@ -36,6 +42,9 @@ namespace common {
 namespace V1_0 {
 namespace arc {
 
+using aidl::android::hardware::camera::device::CameraBlob;
+using aidl::android::hardware::camera::device::CameraBlobId;
+
 /*
  * Formats have different names in different header files. Here is the mapping
  * table:
@@ -67,12 +76,27 @@ namespace arc {
  *                                 -> NV21 (apps)
  *                                 -> YV12 (apps)
  *                                 -> YU12 (video encoder)
+ *
+ * Direct Path, used when no scaling is needed:
+ * YUYV (from camera) -> NV21, ARGB, ABGR, RGB565
+ * MJPG (from camera) -> NV21
  */
 
 const std::vector<uint32_t> ImageProcessor::kSupportedFourCCs = {
     V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_MJPEG
 };
 
+const int ImageProcessor::kStripRows = 16;
+
+/*
+ * Run |function| over horizontal bands of |height| rows. Bands start on even
+ * rows by default so that they never split a 4:2:0 chroma row.
+ */
+static int RunInBands(int height, const BandProcessor::BandFunction& function,
+                      int alignment = 2) {
+  return BandProcessor::GetInstance().Run(height, alignment, function);
+}
+
 const int ImageProcessor::kRationalPrecision = 10000;
 
 const int ImageProcessor::DEFAULT_JPEG_QUALITY = 80;
@@ -131,15 +155,31 @@ bool ImageProcessor::SupportsConversion(uint32_t from_fourcc,
                                         uint32_t to_fourcc) {
   switch (from_fourcc) {
     case V4L2_PIX_FMT_YUYV:
-      return (to_fourcc == V4L2_PIX_FMT_YUV420);
+      return (to_fourcc == V4L2_PIX_FMT_YUV420 ||
+              SupportsDirectConversion(from_fourcc, to_fourcc));
     case V4L2_PIX_FMT_YUV420:
       return (
           to_fourcc == V4L2_PIX_FMT_YUV420 ||
           to_fourcc == V4L2_PIX_FMT_YVU420 || to_fourcc == V4L2_PIX_FMT_NV21 ||
           to_fourcc == V4L2_PIX_FMT_ARGB32 || to_fourcc == V4L2_PIX_FMT_ABGR32 ||
-          to_fourcc == V4L2_PIX_FMT_JPEG);
+          to_fourcc == V4L2_PIX_FMT_RGB565 || to_fourcc == V4L2_PIX_FMT_JPEG);
     case V4L2_PIX_FMT_MJPEG:
-      return (to_fourcc == V4L2_PIX_FMT_YUV420);
+      return (to_fourcc == V4L2_PIX_FMT_YUV420 ||
+              SupportsDirectConversion(from_fourcc, to_fourcc));
+    default:
+      return false;
+  }
+}
+
+bool ImageProcessor::SupportsDirectConversion(uint32_t from_fourcc,
+                                              uint32_t to_fourcc) {
+  switch (from_fourcc) {
+    case V4L2_PIX_FMT_YUYV:
+      return (
+          to_fourcc == V4L2_PIX_FMT_NV21 || to_fourcc == V4L2_PIX_FMT_ARGB32 ||
+          to_fourcc == V4L2_PIX_FMT_ABGR32 || to_fourcc == V4L2_PIX_FMT_RGB565);
+    case V4L2_PIX_FMT_MJPEG:
+      return (to_fourcc == V4L2_PIX_FMT_NV21);
     default:
       return false;
   }
@@ -174,22 +214,42 @@ int ImageProcessor::ConvertFormat(const CameraMetadata& metadata,
     switch (out_frame->GetFourcc()) {
       case V4L2_PIX_FMT_YUV420:  // YU12
       {
-        int res = libyuv::YUY2ToI420(
-            in_frame.GetData(),      /* src_yuy2 */
-            in_frame.GetWidth() * 2, /* src_stride_yuy2 */
-            out_frame->GetData(),    /* dst_y */
-            out_frame->GetWidth(),   /* dst_stride_y */
-            out_frame->GetData() +
-                out_frame->GetWidth() * out_frame->GetHeight(), /* dst_u */
-            out_frame->GetWidth() / 2, /* dst_stride_u */
-            out_frame->GetData() + out_frame->GetWidth() *
-                                       out_frame->GetHeight() * 5 /
-                                       4, /* dst_v */
-            out_frame->GetWidth() / 2,    /* dst_stride_v */
-            in_frame.GetWidth(), in_frame.GetHeight());
+        uint32_t width = out_frame->GetWidth();
+        uint8_t* dst_y = out_frame->GetData();
+        uint8_t* dst_u = dst_y + width * out_frame->GetHeight();
+        uint8_t* dst_v = dst_y + width * out_frame->GetHeight() * 5 / 4;
+
+        int res = RunInBands(in_frame.GetHeight(), [&](int row, int rows) {
+          return libyuv::YUY2ToI420(
+              in_frame.GetData() + row * in_frame.GetWidth() * 2, /* src_yuy2 */
+              in_frame.GetWidth() * 2,           /* src_stride_yuy2 */
+              dst_y + row * width, width,        /* dst_y */
+              dst_u + row / 2 * width / 2, width / 2, /* dst_u */
+              dst_v + row / 2 * width / 2, width / 2, /* dst_v */
+              in_frame.GetWidth(), rows);
+        });
         ALOGE_IF(res, "%s: YUY2ToI420() for YU12 returns %d", __FUNCTION__, res);
         return res ? -EINVAL : 0;
       }
+      case V4L2_PIX_FMT_ARGB32: {
+        int res = RunInBands(in_frame.GetHeight(), [&](int row, int rows) {
+          return libyuv::YUY2ToARGB(
+              in_frame.GetData() + row * in_frame.GetWidth() * 2, /* src_yuy2 */
+              in_frame.GetWidth() * 2,   /* src_stride_yuy2 */
+              out_frame->GetData() + row * out_frame->GetWidth() * 4,
+              out_frame->GetWidth() * 4, /* dst_stride_argb */
+              in_frame.GetWidth(), rows);
+        });
+        ALOGE_IF(res, "%s: YUY2ToARGB() returns %d", __FUNCTION__, res);
+        return res ? -EINVAL : 0;
+      }
+      case V4L2_PIX_FMT_NV21:
+      case V4L2_PIX_FMT_ABGR32:
+      case V4L2_PIX_FMT_RGB565: {
+        int res = YUYVToRGBOrNV21(in_frame, out_frame);
+        ALOGE_IF(res, "%s: YUYVToRGBOrNV21() returns %d", __FUNCTION__, res);
+        return res ? -EINVAL : 0;
+      }
       default:
         ALOGE("%s: Destination pixel format %s is unsupported "
                   "for YUYV source format.",
@@ -219,44 +279,26 @@ int ImageProcessor::ConvertFormat(const CameraMetadata& metadata,
       }
       case V4L2_PIX_FMT_NV21:  // NV21
       {
-        // TODO(henryhsu): Use libyuv::I420ToNV21.
         int res = YU12ToNV21(in_frame.GetData(), out_frame->GetData(),
                              in_frame.GetWidth(), in_frame.GetHeight());
         ALOGE_IF(res, "%s: YU12ToNV21() returns %d", __FUNCTION__, res);
         return res ? -EINVAL : 0;
       }
       case V4L2_PIX_FMT_ABGR32: {
-        int res = libyuv::I420ToABGR(
-            in_frame.GetData(),  /* src_y */
-            in_frame.GetWidth(), /* src_stride_y */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight(), /* src_u */
-            in_frame.GetWidth() / 2,                        /* src_stride_u */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight() * 5 / 4, /* src_v */
-            in_frame.GetWidth() / 2,   /* src_stride_v */
-            out_frame->GetData(),      /* dst_abgr */
-            out_frame->GetWidth() * 4, /* dst_stride_abgr */
-            in_frame.GetWidth(), in_frame.GetHeight());
+        int res = YU12ToRGB(in_frame, out_frame, libyuv::I420ToABGR, 4);
         ALOGE_IF(res, "%s: I420ToABGR() returns %d", __FUNCTION__, res);
         return res ? -EINVAL : 0;
       }
       case V4L2_PIX_FMT_ARGB32: {
-        int res = libyuv::I420ToARGB(
-            in_frame.GetData(),  /* src_y */
-            in_frame.GetWidth(), /* src_stride_y */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight(), /* src_u */
-            in_frame.GetWidth() / 2,                        /* src_stride_u */
-            in_frame.GetData() +
-                in_frame.GetWidth() * in_frame.GetHeight() * 5 / 4, /* src_v */
-            in_frame.GetWidth() / 2,   /* src_stride_v */
-            out_frame->GetData(),      /* dst_argb */
-            out_frame->GetWidth() * 4, /* dst_stride_argb */
-            in_frame.GetWidth(), in_frame.GetHeight());
+        int res = YU12ToRGB(in_frame, out_frame, libyuv::I420ToARGB, 4);
         ALOGE_IF(res, "%s: I420ToARGB() returns %d", __FUNCTION__, res);
         return res ? -EINVAL : 0;
       }
+      case V4L2_PIX_FMT_RGB565: {
+        int res = YU12ToRGB(in_frame, out_frame, libyuv::I420ToRGB565, 2);
+        ALOGE_IF(res, "%s: I420ToRGB565() returns %d", __FUNCTION__, res);
+        return res ? -EINVAL : 0;
+      }
       case V4L2_PIX_FMT_JPEG: {
         bool res = ConvertToJpeg(metadata, in_frame, out_frame);
         ALOGE_IF(!res, "%s: ConvertToJpeg() returns %d", __FUNCTION__, res);
@@ -289,6 +331,21 @@ int ImageProcessor::ConvertFormat(const CameraMetadata& metadata,
         ALOGE_IF(res, "%s: MJPEGToI420() returns %d", __FUNCTION__, res);
         return res ? -EINVAL : 0;
       }
+      case V4L2_PIX_FMT_NV21:  // NV21
+      {
+        int res = libyuv::MJPGToNV21(
+            in_frame.GetData(),     /* sample */
+            in_frame.GetDataSize(), /* sample_size */
+            out_frame->GetData(),   /* dst_y */
+            out_frame->GetWidth(),  /* dst_stride_y */
+            out_frame->GetData() +
+                out_frame->GetWidth() * out_frame->GetHeight(), /* dst_vu */
+            out_frame->GetWidth(), /* dst_stride_vu */
+            in_frame.GetWidth(), in_frame.GetHeight(), out_frame->GetWidth(),
+            out_frame->GetHeight());
+        ALOGE_IF(res, "%s: MJPGToNV21() returns %d", __FUNCTION__, res);
+        return res ? -EINVAL : 0;
+      }
       default:
         ALOGE("%s: Destination pixel format %s"
                   " is unsupported for MJPEG source format.",
@@ -322,19 +379,68 @@ int ImageProcessor::Scale(const FrameBuffer& in_frame, FrameBuffer* out_frame) {
             in_frame.GetWidth(), in_frame.GetHeight(),
             out_frame->GetWidth(), out_frame->GetHeight());
 
-  int ret = libyuv::I420Scale(
-      in_frame.GetData(), in_frame.GetWidth(),
-      in_frame.GetData() + in_frame.GetWidth() * in_frame.GetHeight(),
-      in_frame.GetWidth() / 2,
-      in_frame.GetData() + in_frame.GetWidth() * in_frame.GetHeight() * 5 / 4,
-      in_frame.GetWidth() / 2, in_frame.GetWidth(), in_frame.GetHeight(),
-      out_frame->GetData(), out_frame->GetWidth(),
-      out_frame->GetData() + out_frame->GetWidth() * out_frame->GetHeight(),
-      out_frame->GetWidth() / 2,
-      out_frame->GetData() +
-          out_frame->GetWidth() * out_frame->GetHeight() * 5 / 4,
-      out_frame->GetWidth() / 2, out_frame->GetWidth(), out_frame->GetHeight(),
-      libyuv::FilterMode::kFilterNone);
+  int src_stride = in_frame.GetWidth();
+  int src_width = in_frame.GetWidth();
+  int src_height = in_frame.GetHeight();
+  const uint8_t* src_y = in_frame.GetData();
+  const uint8_t* src_u = src_y + src_width * src_height;
+  const uint8_t* src_v = src_y + src_width * src_height * 5 / 4;
+
+  int dst_width = out_frame->GetWidth();
+  int dst_height = out_frame->GetHeight();
+  uint8_t* dst_y = out_frame->GetData();
+  uint8_t* dst_u = dst_y + dst_width * dst_height;
+  uint8_t* dst_v = dst_y + dst_width * dst_height * 5 / 4;
+
+  // Crop the center of the input to the output aspect ratio, so that the
+  // image is not stretched. Offsets and sizes are even to keep the chroma
+  // planes aligned.
+  int64_t src_ratio = static_cast<int64_t>(src_width) * dst_height;
+  int64_t dst_ratio = static_cast<int64_t>(dst_width) * src_height;
+  int crop_width = src_width;
+  int crop_height = src_height;
+  if (src_ratio > dst_ratio)
+    crop_width = static_cast<int>(dst_ratio / dst_height) & ~1;
+  else if (src_ratio < dst_ratio)
+    crop_height = static_cast<int>(src_ratio / dst_width) & ~1;
+
+  if (crop_width != src_width || crop_height != src_height) {
+    int left = (src_width - crop_width) / 2 & ~1;
+    int top = (src_height - crop_height) / 2 & ~1;
+
+    ALOGV("%s: Crop image to %dx%d at (%d, %d)", __FUNCTION__,
+              crop_width, crop_height, left, top);
+
+    src_y += top * src_stride + left;
+    src_u += top / 2 * src_stride / 2 + left / 2;
+    src_v += top / 2 * src_stride / 2 + left / 2;
+    src_width = crop_width;
+    src_height = crop_height;
+  }
+
+  // Each band of output rows is scaled from the matching band of input rows,
+  // rounded down to an even row to keep the chroma rows aligned. As no
+  // filtering is done, the result only differs from a whole frame scale by
+  // the sampling phase at band boundaries.
+  auto src_row = [&](int row) {
+    return static_cast<int>(
+        static_cast<int64_t>(row) * src_height / dst_height) & ~1;
+  };
+
+  int ret = RunInBands(dst_height, [&](int row, int rows) {
+    int first = src_row(row);
+    int last = (row + rows == dst_height) ? src_height : src_row(row + rows);
+
+    return libyuv::I420Scale(
+        src_y + first * src_stride, src_stride,
+        src_u + first / 2 * src_stride / 2, src_stride / 2,
+        src_v + first / 2 * src_stride / 2, src_stride / 2,
+        src_width, last - first,
+        dst_y + row * dst_width, dst_width,
+        dst_u + row / 2 * dst_width / 2, dst_width / 2,
+        dst_v + row / 2 * dst_width / 2, dst_width / 2,
+        dst_width, rows, libyuv::FilterMode::kFilterNone);
+  });
   ALOGE_IF(ret, "%s: I420Scale failed: %d", __FUNCTION__, ret);
   return ret;
 }
@@ -361,9 +467,104 @@ int ImageProcessor::YU12ToYV12(const void* yu12, void* yv12, int width,
   const uint8_t* v_src = src + width * height * 5 / 4;
   uint8_t* v_dst = dst + dst_stride_y * height;
 
-  return libyuv::I420Copy(src, width, u_src, width / 2, v_src, width / 2, dst,
-                          dst_stride_y, u_dst, dst_stride_uv, v_dst,
-                          dst_stride_uv, width, height);
+  return RunInBands(height, [&](int row, int rows) {
+    return libyuv::I420Copy(
+        src + row * width, width,
+        u_src + row / 2 * width / 2, width / 2,
+        v_src + row / 2 * width / 2, width / 2,
+        dst + row * dst_stride_y, dst_stride_y,
+        u_dst + row / 2 * dst_stride_uv, dst_stride_uv,
+        v_dst + row / 2 * dst_stride_uv, dst_stride_uv,
+        width, rows);
+  });
+}
+
+int ImageProcessor::YU12ToRGB(const FrameBuffer& in_frame,
+                              FrameBuffer* out_frame,
+                              I420ToRGBFunction convert, int bytes_per_pixel) {
+  int width = in_frame.GetWidth();
+  int height = in_frame.GetHeight();
+  const uint8_t* src_y = in_frame.GetData();
+  const uint8_t* src_u = src_y + width * height;
+  const uint8_t* src_v = src_y + width * height * 5 / 4;
+  int dst_stride = out_frame->GetWidth() * bytes_per_pixel;
+
+  return RunInBands(height, [&](int row, int rows) {
+    return convert(src_y + row * width, width,
+                   src_u + row / 2 * width / 2, width / 2,
+                   src_v + row / 2 * width / 2, width / 2,
+                   out_frame->GetData() + row * dst_stride, dst_stride,
+                   width, rows);
+  });
+}
+
+int ImageProcessor::YUYVToRGBOrNV21(const FrameBuffer& in_frame,
+                                    FrameBuffer* out_frame) {
+  // Bands are aligned on strips, each band thread using its own strip.
+  return RunInBands(in_frame.GetHeight(), [&](int band_row, int band_rows) {
+    return YUYVToRGBOrNV21Band(in_frame, out_frame, band_row, band_rows);
+  }, kStripRows);
+}
+
+int ImageProcessor::YUYVToRGBOrNV21Band(const FrameBuffer& in_frame,
+                                        FrameBuffer* out_frame,
+                                        int band_row, int band_rows) {
+  int width = in_frame.GetWidth();
+  int height = in_frame.GetHeight();
+
+  // The strip is reused by the following frames of the calling thread.
+  static thread_local std::vector<uint8_t> strip;
+  strip.resize(width * kStripRows * 3 / 2);
+
+  uint8_t* strip_y = strip.data();
+  uint8_t* strip_u = strip_y + width * kStripRows;
+  uint8_t* strip_v = strip_u + width / 2 * kStripRows / 2;
+
+  uint8_t* out_data = out_frame->GetData();
+  int band_end = band_row + band_rows;
+
+  for (int row = band_row; row < band_end; row += kStripRows) {
+    // |height| and |kStripRows| are even, so are |rows|.
+    int rows = std::min(kStripRows, band_end - row);
+
+    int res = libyuv::YUY2ToI420(
+        in_frame.GetData() + row * width * 2, width * 2,
+        strip_y, width, strip_u, width / 2, strip_v, width / 2, width, rows);
+    if (res) {
+      ALOGE("%s: YUY2ToI420() returns %d", __FUNCTION__, res);
+      return -EINVAL;
+    }
+
+    switch (out_frame->GetFourcc()) {
+      case V4L2_PIX_FMT_NV21:
+        res = libyuv::I420ToNV21(
+            strip_y, width, strip_u, width / 2, strip_v, width / 2,
+            out_data + row * width, width,                           /* dst_y */
+            out_data + width * height + row / 2 * width, width,     /* dst_vu */
+            width, rows);
+        break;
+      case V4L2_PIX_FMT_ABGR32:
+        res = libyuv::I420ToABGR(
+            strip_y, width, strip_u, width / 2, strip_v, width / 2,
+            out_data + row * width * 4, width * 4, width, rows);
+        break;
+      case V4L2_PIX_FMT_RGB565:
+        res = libyuv::I420ToRGB565(
+            strip_y, width, strip_u, width / 2, strip_v, width / 2,
+            out_data + row * width * 2, width * 2, width, rows);
+        break;
+      default:
+        return -EINVAL;
+    }
+
+    if (res) {
+      ALOGE("%s: strip conversion at row %d returns %d",
+                __FUNCTION__, row, res);
+      return -EINVAL;
+    }
+  }
+
+  return 0;
 }
 
 int ImageProcessor::YU12ToNV21(const void* yu12, void* nv21,
@@ -380,16 +581,17 @@ int ImageProcessor::YU12ToNV21(const void* yu12, void* nv21,
   const uint8_t* v_src = src + width * height * 5 / 4;
   uint8_t* vu_dst = dst + width * height;
 
-  memcpy(dst, src, width * height);
-
-  for (int i = 0; i < height / 2; i++) {
-    for (int j = 0; j < width / 2; j++) {
-      *vu_dst++ = *v_src++;
-      *vu_dst++ = *u_src++;
-    }
-  }
-
-  return 0;
+  // libyuv selects the NEON, SSE2 or AVX2 row kernels at runtime, and falls
+  // back to C rows when none is available.
+  return RunInBands(height, [&](int row, int rows) {
+    return libyuv::I420ToNV21(
+        src + row * width, width,                      /* src_y */
+        u_src + row / 2 * width / 2, width / 2,        /* src_u */
+        v_src + row / 2 * width / 2, width / 2,        /* src_v */
+        dst + row * width, width,                      /* dst_y */
+        vu_dst + row / 2 * width, width,               /* dst_vu */
+        width, rows);
+  });
 }
 
 bool ImageProcessor::ConvertToJpeg(const CameraMetadata& metadata,
@@ -414,34 +616,64 @@ bool ImageProcessor::ConvertToJpeg(const CameraMetadata& metadata,
     thumbnail_jpeg_quality = jpeg_quality;
   }
 
+  // The JPEG image is encoded in place in the BLOB buffer, whose last bytes
+  // are kept for the transport header read by the framework.
+  size_t buffer_size = out_frame->GetBufferSize();
+  if (buffer_size <= sizeof(CameraBlob)) {
+    ALOGE("%s: BLOB buffer is too small: %zu", __FUNCTION__, buffer_size);
+    return false;
+  }
+
   if (!utils.Initialize(in_frame.GetData(), in_frame.GetWidth(),
                         in_frame.GetHeight(), thumbnail_jpeg_quality)) {
     ALOGE("%s: ExifUtils initialization failed.", __FUNCTION__);
     return false;
   }
 
-  if (!SetExifTags(metadata, &utils)) {
-    ALOGE("%s: Setting Exif tags failed.", __FUNCTION__);
+  // The APP1 segment, with its thumbnail, is generated while the strips of
+  // the main image are encoded, and only waited for when they are stitched.
+  std::future<bool> app1 =
+      std::async(std::launch::async, GenerateApp1, std::cref(metadata), &utils);
+
+  size_t jpeg_size = 0;
+  if (!JpegCompressor::CompressImageInStrips(
+          in_frame.GetData(), in_frame.GetWidth(), in_frame.GetHeight(),
+          jpeg_quality,
+          [&](const void** app1Buffer, unsigned int* app1Size) {
+            if (!app1.get()) {
+              return false;
+            }
+            *app1Buffer = utils.GetApp1Buffer();
+            *app1Size = utils.GetApp1Length();
+            return true;
+          },
+          out_frame->GetData(), buffer_size - sizeof(CameraBlob),
+          &jpeg_size)) {
+    ALOGE("%s: JPEG image compression failed", __FUNCTION__);
     return false;
   }
 
-  if (!utils.GenerateApp1()) {
-    ALOGE("%s: Generating APP1 segment failed.", __FUNCTION__);
-    return false;
-  }
+  CameraBlob blob;
+  blob.blobId = CameraBlobId::JPEG;
+  blob.blobSizeBytes = jpeg_size;
+  memcpy(out_frame->GetData() + buffer_size - sizeof(CameraBlob), &blob,
+         sizeof(CameraBlob));
 
-  JpegCompressor compressor;
+  out_frame->SetDataSize(jpeg_size);
+  return true;
+}
 
-  if (!compressor.CompressImage(in_frame.GetData(), in_frame.GetWidth(),
-                                in_frame.GetHeight(), jpeg_quality,
-                                utils.GetApp1Buffer(), utils.GetApp1Length())) {
-    ALOGE("%s: JPEG image compression failed", __FUNCTION__);
+bool ImageProcessor::GenerateApp1(const CameraMetadata& metadata,
+                                  ExifUtils* utils) {
+  if (!SetExifTags(metadata, utils)) {
+    ALOGE("%s: Setting Exif tags failed.", __FUNCTION__);
     return false;
   }
 
-  size_t buffer_length = compressor.GetCompressedImageSize();
-  memcpy(out_frame->GetData(), compressor.GetCompressedImagePtr(),
-         buffer_length);
+  if (!utils->GenerateApp1()) {
+    ALOGE("%s: Generating APP1 segment failed.", __FUNCTION__);
+    return false;
+  }
   return true;
 }
 
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef INCLUDE_ARC_BAND_PROCESSOR_H_
+#define INCLUDE_ARC_BAND_PROCESSOR_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace arc {
+
+// BandProcessor splits an image operation into horizontal bands and runs them
+// on a fixed pool of worker threads, the calling thread processing the first
+// band. The number of bands of the process wide instance is read once from
+// the "vendor.camera.convert.bands" property and defaults to the number of
+// online cores. This class is thread-safe.
+class BandProcessor {
+ public:
+  // Band function, called with the first row of the band and its row count.
+  // Returns 0 on success.
+  using BandFunction = std::function<int(int row, int rows)>;
+
+  // Splits operations in at most |band_count| bands.
+  explicit BandProcessor(int band_count);
+  ~BandProcessor();
+
+  // Returns the process wide instance.
+  static BandProcessor& GetInstance();
+
+  // Splits |height| rows in bands whose first row and row count are multiples
+  // of |alignment|, except for the last band which gets the remaining rows.
+  // Returns once all bands have been processed, with the first non-zero
+  // result of |function|, or 0 on success.
+  int Run(int height, int alignment, const BandFunction& function);
+
+  int GetBandCount() const { return band_count_; }
+
+ private:
+  void WorkerThread();
+
+  // Maximum number of bands an operation is split in.
+  const int band_count_;
+
+  std::vector<std::thread> workers_;
+
+  // Pending bands, run by the workers.
+  std::queue<std::function<void()>> tasks_;
+
+  // Lock to guard |tasks_| and |active_|.
+  std::mutex lock_;
+  std::condition_variable cond_;
+  bool active_;
+};
+
+} // namespace arc
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
+
+#endif  // INCLUDE_ARC_BAND_PROCESSOR_H_
@@ -33,15 +33,21 @@ using ::android::hardware::camera::common::V1_0::helper::CameraMetadata;
 
 // CachedFrame contains a source FrameBuffer and a cached, converted
 // FrameBuffer. The incoming frames would be converted to YU12, the default
-// format of libyuv, to allow convenient processing.
+// format of libyuv, to allow convenient processing. The YU12 cache is only
+// built when an output can't be converted in a single pass from the source.
+// The intermediate buffers are kept between frames and taken from |pool|, so
+// a CachedFrame living as long as its stream does not allocate once the first
+// frames went through.
 class CachedFrame {
  public:
-  CachedFrame();
+  explicit CachedFrame(std::shared_ptr<FrameBufferPool> pool = nullptr);
   ~CachedFrame();
 
   // SetSource() doesn't take ownership of |frame|. The caller can only release
-  // |frame| after calling UnsetSource(). SetSource() immediately converts
-  // incoming frame into YU12. Return non-zero values if it encounters errors.
+  // |frame| after calling UnsetSource(). SetSource() converts incoming frame
+  // into YU12 only if it has to be rotated, otherwise the conversion is
+  // delayed to the first Convert() which needs it. Return non-zero values if
+  // it encounters errors.
   // If |rotate_degree| is 90 or 270, |frame| will be cropped, rotated by the
   // specified amount and scaled.
   // If |rotate_degree| is -1, |frame| will not be cropped, rotated, and scaled.
@@ -53,6 +59,7 @@ class CachedFrame {
   uint8_t* GetSourceBuffer() const;
   size_t GetSourceDataSize() const;
   uint32_t GetSourceFourCC() const;
+  // The cached buffer is only valid once a conversion needed it.
   uint8_t* GetCachedBuffer() const;
   uint32_t GetCachedFourCC() const;
 
@@ -87,13 +94,18 @@ class CachedFrame {
   const FrameBuffer* source_frame_;
   // const V4L2FrameBuffer* source_frame_;
 
+  // Memory of the intermediate buffers.
+  std::shared_ptr<FrameBufferPool> pool_;
+
   // Temporary buffer for cropped and rotated results.
-  std::unique_ptr<uint8_t[]> cropped_buffer_;
-  size_t cropped_buffer_capacity_;
+  std::unique_ptr<AllocatedFrameBuffer> cropped_buffer_;
 
   // Cache YU12 decoded results.
   std::unique_ptr<AllocatedFrameBuffer> yu12_frame_;
 
+  // Whether |yu12_frame_| holds the conversion of |source_frame_|.
+  bool yu12_valid_;
+
   // Temporary buffer for scaled results.
   std::unique_ptr<AllocatedFrameBuffer> scaled_frame_;
 };
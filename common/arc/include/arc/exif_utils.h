@@ -19,6 +19,7 @@
 #define INCLUDE_ARC_EXIF_UTILS_H_
 
 #include <cstddef>
+#include <ctime>
 #include <memory>
 #include <string>
 #include <utility>
@@ -34,10 +35,17 @@ namespace common {
 namespace V1_0 {
 namespace arc {
 
+struct ExifApp1Template;
+
 // ExifUtils can generate APP1 segment with tags which caller set. ExifUtils can
 // also add a thumbnail in the APP1 segment if thumbnail size is specified.
 // ExifUtils can be reused with different images by calling initialize().
 //
+// The tags are only recorded by the setters. The first generateApp1() builds
+// the segment with libexif and keeps it as a template; the next ones with the
+// same tag layout copy the template and patch the per-shot values (date and
+// time, GPS data, orientation and thumbnail) in place.
+//
 // Example of using this class :
 //  ExifUtils utils;
 //  utils.initialize(inputYU12Buffer, inputWidth, inputHeight,
@@ -62,40 +70,33 @@ class ExifUtils {
                   int quality);
 
   // Sets the manufacturer of camera.
-  // Returns false if memory allocation fails.
   bool SetMaker(const std::string& maker);
 
   // Sets the model number of camera.
-  // Returns false if memory allocation fails.
   bool SetModel(const std::string& model);
 
   // Sets the date and time of image last modified. It takes local time. The
   // name of the tag is DateTime in IFD0.
-  // Returns false if memory allocation fails.
+  // Returns false if |t| is invalid.
   bool SetDateTime(const struct tm& t);
 
   // Sets the focal length of lens used to take the image in millimeters.
-  // Returns false if memory allocation fails.
   bool SetFocalLength(uint32_t numerator, uint32_t denominator);
 
   // Sets the latitude with degrees minutes seconds format.
-  // Returns false if memory allocation fails.
   bool SetGpsLatitude(double latitude);
 
   // Sets the longitude with degrees minutes seconds format.
-  // Returns false if memory allocation fails.
   bool SetGpsLongitude(double longitude);
 
   // Sets the altitude in meters.
-  // Returns false if memory allocation fails.
   bool SetGpsAltitude(double altitude);
 
   // Sets GPS date stamp and time stamp (atomic clock). It takes UTC time.
-  // Returns false if memory allocation fails.
+  // Returns false if |t| is invalid.
   bool SetGpsTimestamp(const struct tm& t);
 
   // Sets GPS processing method.
-  // Returns false if memory allocation fails.
   bool SetGpsProcessingMethod(const std::string& method);
 
   // Since the size of APP1 segment is limited, it is recommended the
@@ -105,7 +106,6 @@ class ExifUtils {
   bool SetThumbnailSize(uint16_t width, uint16_t height);
 
   // Sets image orientation.
-  // Returns false if memory allocation fails.
   bool SetOrientation(uint16_t orientation);
 
   // Generates APP1 segment.
@@ -124,6 +124,23 @@ class ExifUtils {
   // Resets the pointers and memories.
   void Reset();
 
+  // Returns the key of the tag layout of the APP1 segment: the tags which are
+  // set and the values which are not patched in the template.
+  std::string GetLayoutKey() const;
+
+  // Builds the APP1 segment from |app1_template|, patched with the tags set.
+  // Returns false if memory allocation fails.
+  bool GenerateApp1FromTemplate(const ExifApp1Template& app1_template);
+
+  // Builds |exif_data_| from the tags set and saves it to |app1_buffer_|.
+  // Returns false if memory allocation fails.
+  bool GenerateApp1WithLibexif();
+
+  // Makes a template of |app1_buffer_|, which ends with a thumbnail image of
+  // |thumbnail_size| bytes. Returns nullptr if the segment can not be parsed.
+  std::shared_ptr<const ExifApp1Template> CreateApp1Template(
+      const std::string& layout, unsigned int thumbnail_size) const;
+
   // Adds a variable length tag to |exif_data_|. It will remove the original one
   // if the tag exists.
   // Returns the entry of the tag. The reference count of returned ExifEntry is
@@ -139,15 +156,20 @@ class ExifUtils {
   // ExifEntry.
   std::unique_ptr<ExifEntry> AddEntry(ExifIfd ifd, ExifTag tag);
 
-  // Sets the width (number of columes) of main image.
-  // Returns false if memory allocation fails.
-  bool SetImageWidth(uint16_t width);
-
-  // Sets the length (number of rows) of main image.
-  // Returns false if memory allocation fails.
-  bool SetImageLength(uint16_t length);
-
-  // Generates a thumbnail. Calls compressor_.getCompressedImagePtr() to get the
+  // The Add*() functions add the entries of the corresponding tags to
+  // |exif_data_|. They return false if memory allocation fails.
+  bool AddString(ExifIfd ifd, ExifTag tag, const std::string& value);
+  bool AddImageWidth(uint16_t width);
+  bool AddImageLength(uint16_t length);
+  bool AddFocalLength();
+  bool AddGpsLatitude();
+  bool AddGpsLongitude();
+  bool AddGpsAltitude();
+  bool AddGpsTimestamp();
+  bool AddGpsProcessingMethod();
+  bool AddOrientation();
+
+  // Generates a thumbnail. Calls compressor_->getCompressedImagePtr() to get the
   // result image.
   // Returns false if failed.
   bool GenerateThumbnail();
@@ -170,6 +192,28 @@ class ExifUtils {
   uint16_t thumbnail_width_;
   uint16_t thumbnail_height_;
 
+  // The tags set by the caller. Empty strings and unset flags mean that the
+  // tag is not written.
+  std::string maker_;
+  std::string model_;
+  std::string date_time_;
+  bool has_focal_length_;
+  uint32_t focal_length_numerator_;
+  uint32_t focal_length_denominator_;
+  bool has_latitude_;
+  double latitude_;
+  bool has_longitude_;
+  double longitude_;
+  bool has_altitude_;
+  double altitude_;
+  bool has_gps_timestamp_;
+  struct tm gps_timestamp_;
+  std::string gps_date_stamp_;
+  bool has_gps_processing_method_;
+  std::string gps_processing_method_;
+  bool has_orientation_;
+  uint16_t orientation_;
+
   // The Exif data (APP1). Owned by this class.
   ExifData* exif_data_;
   // The raw data of APP1 segment. It's allocated by ExifMem in |exif_data_| but
@@ -182,8 +226,9 @@ class ExifUtils {
   // 64KB.
   int thumbnail_jpeg_quality_;
 
-  // The YU12 to Jpeg compressor.
-  JpegCompressor compressor_;
+  // The YU12 to Jpeg compressor of the thumbnail, taken from the
+  // JpegCompressorPool while |exif_data_| refers to its result.
+  JpegCompressorPool::Handle compressor_;
 };
 
 } // namespace arc
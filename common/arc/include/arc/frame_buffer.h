@@ -20,9 +20,11 @@
 
 #include <stdint.h>
 
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 #include <hardware/gralloc.h>
@@ -60,6 +62,12 @@ class FrameBuffer {
   void SetFourcc(uint32_t fourcc) { fourcc_ = fourcc; }
   virtual int SetDataSize(size_t data_size);
 
+  // Planes stored in separate buffers, e.g. for V4L2_PIX_FMT_NV12M. A frame
+  // stored in a single buffer has one plane, which is the whole frame.
+  virtual size_t GetNumPlanes() const { return 1; }
+  virtual uint8_t* GetPlaneData(size_t plane) const;
+  virtual size_t GetPlaneDataSize(size_t plane) const;
+
  protected:
   uint8_t* data_;
 
@@ -77,11 +85,40 @@ class FrameBuffer {
   uint32_t fourcc_;
 };
 
+// FrameBufferPool recycles the memory of AllocatedFrameBuffer. Requested sizes
+// are rounded up to a size class so that frames of close resolutions share the
+// same blocks, and every block is aligned on a cache line. Blocks are only
+// freed when the pool is destroyed or when a size class holds too many of them.
+class FrameBufferPool {
+ public:
+  FrameBufferPool();
+  ~FrameBufferPool();
+
+  // Returns a block of at least |size| bytes and stores its actual size in
+  // |capacity|. Returns nullptr if the allocation fails.
+  uint8_t* Acquire(size_t size, size_t* capacity);
+
+  // Gives back a block previously returned by Acquire().
+  void Release(uint8_t* block, size_t capacity);
+
+  // Returns the size class used for a request of |size| bytes.
+  static size_t SizeClass(size_t size);
+
+ private:
+  // Free blocks, indexed by size class.
+  std::map<size_t, std::vector<uint8_t*>> free_blocks_;
+
+  // Lock to guard |free_blocks_|.
+  std::mutex lock_;
+};
+
 // AllocatedFrameBuffer is used for the buffer from hal malloc-ed. User should
-// be aware to manage the memory.
+// be aware to manage the memory. Unless the buffer is given at construction,
+// the memory comes from |pool|, or from a private pool if none is given.
 class AllocatedFrameBuffer : public FrameBuffer {
  public:
-  explicit AllocatedFrameBuffer(int buffer_size);
+  explicit AllocatedFrameBuffer(int buffer_size,
+                                std::shared_ptr<FrameBufferPool> pool = nullptr);
   explicit AllocatedFrameBuffer(uint8_t* buffer, int buffer_size);
   ~AllocatedFrameBuffer() override;
 
@@ -95,26 +132,52 @@ class AllocatedFrameBuffer : public FrameBuffer {
   void Reset();
 
  private:
+  // Buffer given at construction, if any.
   std::unique_ptr<uint8_t[]> buffer_;
+
+  // Pool |data_| comes from when |buffer_| is not set.
+  std::shared_ptr<FrameBufferPool> pool_;
 };
 
 // V4L2FrameBuffer is used for the buffer from V4L2CameraDevice. Maps the fd
-// in constructor. Unmaps and closes the fd in destructor.
+// in constructor. Unmaps and closes the fd in destructor. A multi-planar
+// buffer has one fd per plane, |data_| being its first plane.
 class V4L2FrameBuffer : public FrameBuffer {
  public:
   V4L2FrameBuffer(base::unique_fd fd, int buffer_size, uint32_t width,
                   uint32_t height, uint32_t fourcc);
+  V4L2FrameBuffer(std::vector<base::unique_fd> fds,
+                  const std::vector<uint32_t>& plane_sizes, uint32_t width,
+                  uint32_t height, uint32_t fourcc);
 
-  // Unmaps |data_| and closes |fd_|.
+  // Unmaps the planes and closes their fds.
   ~V4L2FrameBuffer();
 
   int Map() override;
   int Unmap() override;
-  int GetFd() const { return fd_.get(); }
+  int GetFd() const { return planes_[0].fd.get(); }
+
+  // Only valid for a single plane buffer, see SetPlaneDataSizes().
+  int SetDataSize(size_t data_size) override;
+  // Sets the bytes used in each plane, as reported by the driver.
+  int SetPlaneDataSizes(const std::vector<uint32_t>& data_sizes);
+  size_t GetNumPlanes() const override { return planes_.size(); }
+  uint8_t* GetPlaneData(size_t plane) const override;
+  size_t GetPlaneDataSize(size_t plane) const override;
 
  private:
-  // File descriptor of V4L2 frame buffer.
-  base::unique_fd fd_;
+  struct Plane {
+    // File descriptor of the V4L2 plane buffer.
+    base::unique_fd fd;
+    size_t buffer_size;
+    uint8_t* data;
+    size_t data_size;
+  };
+
+  // Unmaps the planes already mapped. Must be called with |lock_| held.
+  int UnmapLocked();
+
+  std::vector<Plane> planes_;
 
   bool is_mapped_;
 
@@ -58,6 +58,11 @@ struct ImageProcessor {
   // Return whether this class supports the provided conversion.
   static bool SupportsConversion(uint32_t from_fourcc, uint32_t to_fourcc);
 
+  // Return whether the provided conversion is done in a single pass, without
+  // going through a full YU12 intermediate frame.
+  static bool SupportsDirectConversion(uint32_t from_fourcc,
+                                       uint32_t to_fourcc);
+
   // Convert format from |in_frame.fourcc| to |out_frame->fourcc|. Caller should
   // fill |data|, |buffer_size|, |width|, and |height| of |out_frame|. The
   // function will fill |out_frame->data_size|. Return non-zero error code on
@@ -66,9 +71,10 @@ struct ImageProcessor {
                            const FrameBuffer& in_frame, FrameBuffer* out_frame);
 
   // Scale image size according to |in_frame| and |out_frame|. Only support
-  // V4L2_PIX_FMT_YUV420 format. Caller should fill |data|, |width|, |height|,
-  // and |buffer_size| of |out_frame|. The function will fill |data_size| and
-  // |fourcc| of |out_frame|.
+  // V4L2_PIX_FMT_YUV420 format. The center of |in_frame| is cropped to the
+  // aspect ratio of |out_frame| first. Caller should fill |data|, |width|,
+  // |height|, and |buffer_size| of |out_frame|. The function will fill
+  // |data_size| and |fourcc| of |out_frame|.
   static int Scale(const FrameBuffer& in_frame, FrameBuffer* out_frame);
 
 private:
@@ -80,17 +86,41 @@ private:
 
   static int YU12ToNV21(const void* yv12, void* nv21, int width, int height);
 
+  // libyuv I420To* converter to a packed RGB format.
+  using I420ToRGBFunction = int (*)(const uint8_t*, int, const uint8_t*, int,
+                                    const uint8_t*, int, uint8_t*, int, int,
+                                    int);
+
+  static int YU12ToRGB(const FrameBuffer& in_frame, FrameBuffer* out_frame,
+                       I420ToRGBFunction convert, int bytes_per_pixel);
+
+  // Convert a YUYV frame to NV21, ABGR32 or RGB565 through a YU12 strip of
+  // |kStripRows| rows, small enough to stay in cache.
+  static int YUYVToRGBOrNV21(const FrameBuffer& in_frame,
+                             FrameBuffer* out_frame);
+
+  // Convert the |band_rows| rows starting at |band_row| for YUYVToRGBOrNV21().
+  static int YUYVToRGBOrNV21Band(const FrameBuffer& in_frame,
+                                 FrameBuffer* out_frame,
+                                 int band_row, int band_rows);
+
   static bool ConvertToJpeg(const CameraMetadata& metadata,
                           const FrameBuffer& in_frame, FrameBuffer* out_frame);
 
   static bool SetExifTags(const CameraMetadata& metadata, ExifUtils* utils);
 
+  // Sets the Exif tags of |metadata| and generates the APP1 segment.
+  static bool GenerateApp1(const CameraMetadata& metadata, ExifUtils* utils);
+
   inline static size_t Align16(size_t value) { return (value + 15) & ~15; }
 
 private:
   /* Format from which the conversion is available*/
   static const std::vector<uint32_t> kSupportedFourCCs;
 
+  // Number of rows converted at once by YUYVToRGBOrNV21().
+  static const int kStripRows;
+
   // How precise the float-to-rational conversion for EXIF tags would be.
   static const int kRationalPrecision;
 
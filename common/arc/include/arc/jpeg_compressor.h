@@ -20,11 +20,16 @@
 
 // We must include cstdio before jpeglib.h. It is a requirement of libjpeg.
 #include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <jpeglib.h>
 
+#include "band_processor.h"
+
 namespace android {
 namespace hardware {
 namespace camera {
@@ -32,7 +37,9 @@ namespace common {
 namespace V1_0 {
 namespace arc {
 
-// Encapsulates a converter from YU12 to JPEG format. This class is not
+// Encapsulates a converter from YU12 to JPEG format. The libjpeg context is
+// kept for the whole life of the compressor, and its tables are only set up
+// again when the image size or the quality changes. This class is not
 // thread-safe.
 class JpegCompressor {
  public:
@@ -55,6 +62,29 @@ class JpegCompressor {
   // after calling CompressImage().
   size_t GetCompressedImageSize();
 
+  // Provides the APP1 segment of an image, see CompressImageInStrips().
+  // Returns false if the segment can not be produced.
+  using App1Source =
+      std::function<bool(const void** app1Buffer, unsigned int* app1Size)>;
+
+  // Same as CompressImage(), but the JPEG image is directly written to
+  // |output|, which can hold |outputSize| bytes. The image is split in
+  // horizontal strips of whole MCU rows which are encoded concurrently by the
+  // workers of |processor|, each one in its own part of |output|, then
+  // stitched back in place through restart markers. |app1Source| is only
+  // called once all the strips are encoded, so that the APP1 segment can be
+  // produced concurrently. |compressedSize| receives the size of the image.
+  // Returns false if the image does not fit.
+  static bool CompressImageInStrips(
+      const void* image, int width, int height, int quality,
+      const App1Source& app1Source, void* output, size_t outputSize,
+      size_t* compressedSize,
+      BandProcessor& processor = BandProcessor::GetInstance());
+
+  // Returns whether the context is set up for the given parameters.
+  bool IsConfiguredFor(int width, int height, int quality,
+                       bool restart = false) const;
+
  private:
   // InitDestination(), EmptyOutputBuffer() and TerminateDestination() are
   // callback functions to be passed into jpeg library.
@@ -63,23 +93,91 @@ class JpegCompressor {
   static void TerminateDestination(j_compress_ptr cinfo);
   static void OutputErrorMessage(j_common_ptr cinfo);
 
+  // Compresses the |height| rows of the given YU12 planes to |output|, which
+  // can hold |outputSize| bytes, as a standalone image with a restart marker
+  // after each MCU row if |restart| is set. Returns 0 on success, -ENOSPC if
+  // the image does not fit.
+  int CompressStrip(const uint8_t* yPlane, const uint8_t* uPlane,
+                    const uint8_t* vPlane, int width, int height, int quality,
+                    bool restart, JOCTET* output, size_t outputSize);
+
   // Returns false if errors occur.
-  bool Encode(const void* inYuv, int width, int height, int jpegQuality,
-              const void* app1Buffer, unsigned int app1Size);
+  bool Encode(const uint8_t* yPlane, const uint8_t* uPlane,
+              const uint8_t* vPlane, int width, int height, int jpegQuality,
+              bool restart, const void* app1Buffer, unsigned int app1Size);
   void SetJpegDestination(jpeg_compress_struct* cinfo);
-  void SetJpegCompressStruct(int width, int height, int quality,
+  void SetJpegCompressStruct(int width, int height, int quality, bool restart,
                              jpeg_compress_struct* cinfo);
+  // Sets up |cinfo_| for the given parameters, unless already done.
+  void Configure(int width, int height, int quality, bool restart);
   // Returns false if errors occur.
-  bool Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv);
+  bool Compress(jpeg_compress_struct* cinfo, const uint8_t* yPlane,
+                const uint8_t* uPlane, const uint8_t* vPlane);
 
   // The block size for encoded jpeg image buffer.
   static const int kBlockSize = 16384;
   // Process 16 lines of Y and 16 lines of U/V each time.
   // We must pass at least 16 scanlines according to libjpeg documentation.
   static const int kCompressBatchSize = 16;
+  // Room for the largest APP1 segment: its marker, the two bytes of its size
+  // field and at most 65533 bytes of data.
+  static const size_t kMaxApp1SegmentSize = 65537;
+
+  // The libjpeg context, and its error handler.
+  jpeg_compress_struct cinfo_;
+  jpeg_error_mgr jerr_;
 
-  // The buffer that holds the compressed result.
+  // Parameters |cinfo_| is set up for, 0 if none.
+  int configured_width_;
+  int configured_height_;
+  int configured_quality_;
+  bool configured_restart_;
+
+  // The buffer that holds the compressed result, or the overflow of
+  // |output_buffer_| when it is set.
   std::vector<JOCTET> result_buffer_;
+
+  // The caller buffer that holds the compressed result, if any.
+  JOCTET* output_buffer_;
+  size_t output_buffer_size_;
+
+  // Number of bytes written to |output_buffer_|.
+  size_t output_size_;
+
+  // Whether the compressed image did not fit in |output_buffer_|.
+  bool output_overflow_;
+};
+
+// JpegCompressorPool keeps the idle compressors so that their libjpeg context
+// and tables are reused by the following captures. A compressor is only used
+// by one owner at a time, so the main image and the thumbnail can be encoded
+// concurrently. This class is thread-safe.
+class JpegCompressorPool {
+ public:
+  // Gives the compressor back to the pool when destroyed.
+  using Handle =
+      std::unique_ptr<JpegCompressor, std::function<void(JpegCompressor*)>>;
+
+  // Returns the process wide instance.
+  static JpegCompressorPool& GetInstance();
+
+  // Returns an idle compressor, preferably one already set up for |width|x
+  // |height| at |quality|, with or without |restart| markers. A new compressor
+  // is created if none is idle.
+  Handle Acquire(int width, int height, int quality, bool restart = false);
+
+ private:
+  JpegCompressorPool() {}
+
+  void Release(JpegCompressor* compressor);
+
+  // Maximum number of idle compressors kept.
+  static const size_t kMaxIdleCompressors = 12;
+
+  std::vector<std::unique_ptr<JpegCompressor>> idle_;
+
+  // Lock to guard |idle_|.
+  std::mutex lock_;
 };
 
 } // namespace arc
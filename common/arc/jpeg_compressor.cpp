@@ -22,8 +22,15 @@
 #include <utils/Log.h>
 
 #include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <memory>
 
+#include "band_processor.h"
+
 namespace android {
 namespace hardware {
 namespace camera {
@@ -31,6 +38,10 @@ namespace common {
 namespace V1_0 {
 namespace arc {
 
+// JPEG markers, without their 0xFF prefix. RST0 and EOI come from jpeglib.h.
+static const JOCTET kMarkerSof0 = 0xC0;
+static const JOCTET kMarkerSos = 0xDA;
+
 // The destination manager that can access |result_buffer_| in JpegCompressor.
 struct destination_mgr {
  public:
@@ -38,9 +49,43 @@ struct destination_mgr {
   JpegCompressor* compressor;
 };
 
-JpegCompressor::JpegCompressor() {}
+JpegCompressor::JpegCompressor()
+    : configured_width_(0),
+      configured_height_(0),
+      configured_quality_(0),
+      configured_restart_(false),
+      output_buffer_(nullptr),
+      output_buffer_size_(0),
+      output_size_(0),
+      output_overflow_(false) {
+  cinfo_.err = jpeg_std_error(&jerr_);
+  // Override output_message() to print error log with ALOGE().
+  cinfo_.err->output_message = &OutputErrorMessage;
+  jpeg_create_compress(&cinfo_);
+  SetJpegDestination(&cinfo_);
+}
+
+JpegCompressor::~JpegCompressor() { jpeg_destroy_compress(&cinfo_); }
 
-JpegCompressor::~JpegCompressor() {}
+bool JpegCompressor::IsConfiguredFor(int width, int height, int quality,
+                                     bool restart) const {
+  return configured_width_ == width && configured_height_ == height &&
+         configured_quality_ == quality && configured_restart_ == restart;
+}
+
+void JpegCompressor::Configure(int width, int height, int quality,
+                               bool restart) {
+  if (IsConfiguredFor(width, height, quality, restart)) {
+    return;
+  }
+
+  SetJpegCompressStruct(width, height, quality, restart, &cinfo_);
+
+  configured_width_ = width;
+  configured_height_ = height;
+  configured_quality_ = quality;
+  configured_restart_ = restart;
+}
 
 bool JpegCompressor::CompressImage(const void* image, int width, int height,
                                    int quality, const void* app1Buffer,
@@ -50,8 +95,15 @@ bool JpegCompressor::CompressImage(const void* image, int width, int height,
     return false;
   }
 
+  const uint8_t* y_plane = static_cast<const uint8_t*>(image);
+  const uint8_t* u_plane = y_plane + width * height;
+  const uint8_t* v_plane = u_plane + width * height / 4;
+
+  output_buffer_ = nullptr;
+  output_buffer_size_ = 0;
   result_buffer_.clear();
-  if (!Encode(image, width, height, quality, app1Buffer, app1Size)) {
+  if (!Encode(y_plane, u_plane, v_plane, width, height, quality, false,
+              app1Buffer, app1Size)) {
     return false;
   }
   ALOGV("%s: Compressed JPEG: %d [%dx%d] -> %zu bytes",
@@ -61,16 +113,29 @@ bool JpegCompressor::CompressImage(const void* image, int width, int height,
 }
 
 const void* JpegCompressor::GetCompressedImagePtr() {
+  if (output_buffer_)
+    return output_buffer_;
+
   return result_buffer_.data();
 }
 
 size_t JpegCompressor::GetCompressedImageSize() {
+  if (output_buffer_)
+    return output_size_;
+
   return result_buffer_.size();
 }
 
 void JpegCompressor::InitDestination(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
+  JpegCompressor* compressor = dest->compressor;
+  if (compressor->output_buffer_) {
+    dest->mgr.next_output_byte = compressor->output_buffer_;
+    dest->mgr.free_in_buffer = compressor->output_buffer_size_;
+    return;
+  }
+
+  std::vector<JOCTET>& buffer = compressor->result_buffer_;
   buffer.resize(kBlockSize);
   dest->mgr.next_output_byte = &buffer[0];
   dest->mgr.free_in_buffer = buffer.size();
@@ -78,7 +143,18 @@ void JpegCompressor::InitDestination(j_compress_ptr cinfo) {
 
 boolean JpegCompressor::EmptyOutputBuffer(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
+  JpegCompressor* compressor = dest->compressor;
+  std::vector<JOCTET>& buffer = compressor->result_buffer_;
+  if (compressor->output_buffer_) {
+    // The caller buffer is full: let the encoder finish in a scratch block
+    // which is discarded, and report the failure once done.
+    compressor->output_overflow_ = true;
+    buffer.resize(kBlockSize);
+    dest->mgr.next_output_byte = &buffer[0];
+    dest->mgr.free_in_buffer = kBlockSize;
+    return true;
+  }
+
   size_t oldsize = buffer.size();
   buffer.resize(oldsize + kBlockSize);
   dest->mgr.next_output_byte = &buffer[oldsize];
@@ -88,7 +164,16 @@ boolean JpegCompressor::EmptyOutputBuffer(j_compress_ptr cinfo) {
 
 void JpegCompressor::TerminateDestination(j_compress_ptr cinfo) {
   destination_mgr* dest = reinterpret_cast<destination_mgr*>(cinfo->dest);
-  std::vector<JOCTET>& buffer = dest->compressor->result_buffer_;
+  JpegCompressor* compressor = dest->compressor;
+  if (compressor->output_buffer_) {
+    if (!compressor->output_overflow_) {
+      compressor->output_size_ =
+          compressor->output_buffer_size_ - dest->mgr.free_in_buffer;
+    }
+    return;
+  }
+
+  std::vector<JOCTET>& buffer = compressor->result_buffer_;
   buffer.resize(buffer.size() - dest->mgr.free_in_buffer);
 }
 
@@ -100,30 +185,25 @@ void JpegCompressor::OutputErrorMessage(j_common_ptr cinfo) {
   ALOGE("%s: %s", __FUNCTION__, buffer);
 }
 
-bool JpegCompressor::Encode(const void* inYuv, int width, int height,
-                            int jpegQuality, const void* app1Buffer,
-                            unsigned int app1Size) {
-  jpeg_compress_struct cinfo;
-  jpeg_error_mgr jerr;
-
-  cinfo.err = jpeg_std_error(&jerr);
-  // Override output_message() to print error log with ALOGE().
-  cinfo.err->output_message = &OutputErrorMessage;
-  jpeg_create_compress(&cinfo);
-  SetJpegDestination(&cinfo);
-
-  SetJpegCompressStruct(width, height, jpegQuality, &cinfo);
-  jpeg_start_compress(&cinfo, TRUE);
+bool JpegCompressor::Encode(const uint8_t* yPlane, const uint8_t* uPlane,
+                            const uint8_t* vPlane, int width, int height,
+                            int jpegQuality, bool restart,
+                            const void* app1Buffer, unsigned int app1Size) {
+  // The tables set up by a previous image are kept by libjpeg across
+  // compressions, and written again by jpeg_start_compress().
+  Configure(width, height, jpegQuality, restart);
+  jpeg_start_compress(&cinfo_, TRUE);
 
   if (app1Buffer != nullptr && app1Size > 0) {
-    jpeg_write_marker(&cinfo, JPEG_APP0 + 1,
+    jpeg_write_marker(&cinfo_, JPEG_APP0 + 1,
                       static_cast<const JOCTET*>(app1Buffer), app1Size);
   }
 
-  if (!Compress(&cinfo, static_cast<const uint8_t*>(inYuv))) {
+  if (!Compress(&cinfo_, yPlane, uPlane, vPlane)) {
+    jpeg_abort_compress(&cinfo_);
     return false;
   }
-  jpeg_finish_compress(&cinfo);
+  jpeg_finish_compress(&cinfo_);
   return true;
 }
 
@@ -139,6 +219,7 @@ void JpegCompressor::SetJpegDestination(jpeg_compress_struct* cinfo) {
 }
 
 void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
+                                           bool restart,
                                            jpeg_compress_struct* cinfo) {
   cinfo->image_width = width;
   cinfo->image_height = height;
@@ -146,6 +227,10 @@ void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
   cinfo->in_color_space = JCS_YCbCr;
   jpeg_set_defaults(cinfo);
 
+  // A restart marker after each MCU row makes rows independently encodable.
+  cinfo->restart_interval = 0;
+  cinfo->restart_in_rows = restart ? 1 : 0;
+
   jpeg_set_quality(cinfo, quality, TRUE);
   jpeg_set_colorspace(cinfo, JCS_YCbCr);
   cinfo->raw_data_in = TRUE;
@@ -161,17 +246,17 @@ void JpegCompressor::SetJpegCompressStruct(int width, int height, int quality,
   cinfo->comp_info[2].v_samp_factor = 1;
 }
 
-bool JpegCompressor::Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv) {
+bool JpegCompressor::Compress(jpeg_compress_struct* cinfo,
+                              const uint8_t* yPlane, const uint8_t* uPlane,
+                              const uint8_t* vPlane) {
   JSAMPROW y[kCompressBatchSize];
   JSAMPROW cb[kCompressBatchSize / 2];
   JSAMPROW cr[kCompressBatchSize / 2];
   JSAMPARRAY planes[3]{y, cb, cr};
 
-  size_t y_plane_size = cinfo->image_width * cinfo->image_height;
-  size_t uv_plane_size = y_plane_size / 4;
-  uint8_t* y_plane = const_cast<uint8_t*>(yuv);
-  uint8_t* u_plane = const_cast<uint8_t*>(yuv + y_plane_size);
-  uint8_t* v_plane = const_cast<uint8_t*>(yuv + y_plane_size + uv_plane_size);
+  uint8_t* y_plane = const_cast<uint8_t*>(yPlane);
+  uint8_t* u_plane = const_cast<uint8_t*>(uPlane);
+  uint8_t* v_plane = const_cast<uint8_t*>(vPlane);
   std::unique_ptr<uint8_t[]> empty(new uint8_t[cinfo->image_width]);
   memset(empty.get(), 0, cinfo->image_width);
 
@@ -205,6 +290,261 @@ bool JpegCompressor::Compress(jpeg_compress_struct* cinfo, const uint8_t* yuv) {
   return true;
 }
 
+int JpegCompressor::CompressStrip(const uint8_t* yPlane,
+                                  const uint8_t* uPlane,
+                                  const uint8_t* vPlane, int width,
+                                  int height, int quality, bool restart,
+                                  JOCTET* output, size_t outputSize) {
+  output_buffer_ = output;
+  output_buffer_size_ = outputSize;
+  output_size_ = 0;
+  output_overflow_ = false;
+
+  if (!Encode(yPlane, uPlane, vPlane, width, height, quality, restart,
+              nullptr, 0)) {
+    return -EINVAL;
+  }
+
+  return output_overflow_ ? -ENOSPC : 0;
+}
+
+// Finds the start of the entropy-coded data of a JPEG image, right after its
+// SOS segment, the offset of its SOF0 marker and the offset of the first
+// segment after the APPn segments which follow SOI. Returns false if the image
+// is not a baseline JPEG image.
+static bool FindScanData(const JOCTET* image, size_t imageSize,
+                         size_t* tables, size_t* sof, size_t* data) {
+  size_t pos = 2;  // Skip SOI.
+  *tables = 0;
+  *sof = 0;
+
+  while (pos + 4 <= imageSize) {
+    if (image[pos] != 0xFF) {
+      return false;
+    }
+
+    JOCTET marker = image[pos + 1];
+    size_t length = (image[pos + 2] << 8) | image[pos + 3];
+    if (!*tables && (marker < JPEG_APP0 || marker > JPEG_APP0 + 15)) {
+      *tables = pos;
+    }
+    if (marker == kMarkerSof0) {
+      *sof = pos;
+    } else if (marker == kMarkerSos) {
+      *data = pos + 2 + length;
+      return *sof != 0 && *data <= imageSize;
+    }
+
+    pos += 2 + length;
+  }
+
+  return false;
+}
+
+bool JpegCompressor::CompressImageInStrips(const void* image, int width,
+                                           int height, int quality,
+                                           const App1Source& app1Source,
+                                           void* output, size_t outputSize,
+                                           size_t* compressedSize,
+                                           BandProcessor& processor) {
+  if (width % 8 != 0 || height % 2 != 0) {
+    ALOGE("%s: Image size can not be handled: %dx%d", __FUNCTION__, width, height);
+    return false;
+  }
+
+  if (outputSize <= kMaxApp1SegmentSize) {
+    ALOGE("%s: Compressed JPEG does not fit in %zu bytes",
+              __FUNCTION__, outputSize);
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  const uint8_t* y_plane = static_cast<const uint8_t*>(image);
+  const uint8_t* u_plane = y_plane + width * height;
+  const uint8_t* v_plane = u_plane + width * height / 4;
+
+  // Each strip is a standalone image, encoded in a slice of |output| as large
+  // as its share of the rows. The first bytes are left for the APP1 segment,
+  // which is only inserted while stitching, at the place where libjpeg writes
+  // it.
+  JOCTET* out = static_cast<JOCTET*>(output);
+  JOCTET* slices = out + kMaxApp1SegmentSize;
+  size_t slices_size = outputSize - kMaxApp1SegmentSize;
+
+  std::mutex strips_lock;
+  std::map<int, JpegCompressorPool::Handle> strips;
+
+  auto compress_strip = [&](int row, int rows) {
+    // Restart markers are only needed to stitch several strips.
+    bool restart = rows != height;
+    size_t begin = slices_size * row / height;
+    size_t end = slices_size * (row + rows) / height;
+
+    JpegCompressorPool::Handle strip =
+        JpegCompressorPool::GetInstance().Acquire(width, rows, quality,
+                                                  restart);
+
+    int res = strip->CompressStrip(y_plane + row * width,
+                                   u_plane + row / 2 * width / 2,
+                                   v_plane + row / 2 * width / 2, width, rows,
+                                   quality, restart, slices + begin,
+                                   end - begin);
+    if (res) {
+      return res;
+    }
+
+    std::lock_guard l(strips_lock);
+    strips[row] = std::move(strip);
+    return 0;
+  };
+
+  int res = processor.Run(height, kCompressBatchSize, compress_strip);
+  if (res == -ENOSPC) {
+    // The details are not evenly spread across the strips: encode the image
+    // at once, so that it can use all the room.
+    ALOGV("%s: Strip does not fit in its slice, compressing at once",
+              __FUNCTION__);
+    strips.clear();
+    res = compress_strip(0, height);
+  }
+  if (res) {
+    ALOGE("%s: Strip compression failed", __FUNCTION__);
+    return false;
+  }
+
+  const void* app1_buffer = nullptr;
+  unsigned int app1_size = 0;
+  if (!app1Source(&app1_buffer, &app1_size)) {
+    ALOGE("%s: APP1 segment is not available", __FUNCTION__);
+    return false;
+  }
+  size_t app1_segment_size = app1_size ? app1_size + 4 : 0;
+  if (app1_segment_size > kMaxApp1SegmentSize) {
+    ALOGE("%s: The size of APP1 segment is too large", __FUNCTION__);
+    return false;
+  }
+
+  // The strips are moved down in place, in order. Dropping the headers and
+  // EOI of the strips frees more room than the APP1 segment and the restart
+  // markers between strips take, so no strip is overwritten before being
+  // moved.
+  const JpegCompressor* first = strips.begin()->second.get();
+  size_t tables, sof, data;
+  if (!FindScanData(first->output_buffer_, first->output_size_, &tables, &sof,
+                    &data)) {
+    ALOGE("%s: Invalid strip image", __FUNCTION__);
+    return false;
+  }
+
+  // The headers of the first strip are kept, with APP1 inserted after the
+  // JFIF segment and the SOF height patched to the full image height.
+  size_t size = 0;
+  memmove(out, first->output_buffer_, tables);
+  size = tables;
+  if (app1_size) {
+    out[size++] = 0xFF;
+    out[size++] = JPEG_APP0 + 1;
+    out[size++] = ((app1_size + 2) >> 8) & 0xFF;
+    out[size++] = (app1_size + 2) & 0xFF;
+    memcpy(out + size, app1_buffer, app1_size);
+    size += app1_size;
+  }
+  memmove(out + size, first->output_buffer_ + tables, data - tables);
+  sof += size - tables;
+  out[sof + 5] = (height >> 8) & 0xFF;
+  out[sof + 6] = height & 0xFF;
+  size += data - tables;
+
+  // The entropy-coded data of all strips is appended, with their restart
+  // markers renumbered and a restart marker between two strips. Bytes
+  // stuffing guarantees that 0xFF followed by RST0 to RST7 is a marker.
+  unsigned int restart = 0;
+  for (auto it = strips.begin(); it != strips.end(); ++it) {
+    const JpegCompressor* strip = it->second.get();
+    size_t strip_tables, strip_sof;
+    if (!FindScanData(strip->output_buffer_, strip->output_size_,
+                      &strip_tables, &strip_sof, &data) ||
+        strip->output_size_ < data + 2) {
+      ALOGE("%s: Invalid strip image", __FUNCTION__);
+      return false;
+    }
+
+    // The strip data, without EOI.
+    size_t strip_size = strip->output_size_ - 2 - data;
+
+    if (it != strips.begin()) {
+      out[size++] = 0xFF;
+      out[size++] = JPEG_RST0 + (restart++ & 7);
+    }
+
+    JOCTET* strip_data = out + size;
+    memmove(strip_data, strip->output_buffer_ + data, strip_size);
+    if (strips.size() > 1) {
+      for (size_t i = 0; i + 1 < strip_size; ++i) {
+        if (strip_data[i] == 0xFF && strip_data[i + 1] >= JPEG_RST0 &&
+            strip_data[i + 1] <= JPEG_RST0 + 7) {
+          strip_data[++i] = JPEG_RST0 + (restart++ & 7);
+        }
+      }
+    }
+    size += strip_size;
+  }
+
+  out[size++] = 0xFF;
+  out[size++] = JPEG_EOI;
+
+  ALOGV("%s: Compressed JPEG in %zu strips: [%dx%d] -> %zu bytes in %lld us",
+            __FUNCTION__, strips.size(), width, height, size,
+            static_cast<long long>(
+                std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count()));
+
+  *compressedSize = size;
+  return true;
+}
+
+JpegCompressorPool& JpegCompressorPool::GetInstance() {
+  static JpegCompressorPool instance;
+  return instance;
+}
+
+JpegCompressorPool::Handle JpegCompressorPool::Acquire(int width, int height,
+                                                       int quality,
+                                                       bool restart) {
+  auto release = [this](JpegCompressor* compressor) { Release(compressor); };
+
+  std::lock_guard l(lock_);
+
+  if (idle_.empty()) {
+    return Handle(new JpegCompressor(), release);
+  }
+
+  auto it = std::find_if(idle_.begin(), idle_.end(),
+                         [&](const std::unique_ptr<JpegCompressor>& c) {
+                           return c->IsConfiguredFor(width, height, quality,
+                                                     restart);
+                         });
+  if (it == idle_.end()) {
+    it = idle_.end() - 1;
+  }
+
+  Handle compressor((*it).release(), release);
+  idle_.erase(it);
+  return compressor;
+}
+
+void JpegCompressorPool::Release(JpegCompressor* compressor) {
+  std::lock_guard l(lock_);
+
+  if (idle_.size() >= kMaxIdleCompressors) {
+    delete compressor;
+    return;
+  }
+
+  idle_.emplace_back(compressor);
+}
+
 } // namespace arc
 } // namespace V1_0
 } // namespace common
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2024 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <jpeglib.h>
+
+#include "band_processor.h"
+#include "jpeg_compressor.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace arc {
+
+/* 8 MP frame, as produced by the largest sensor modes */
+static constexpr int kWidth = 3264;
+static constexpr int kHeight = 2448;
+static constexpr int kQuality = 95;
+static constexpr int kIterations = 5;
+
+/* Same upper bound as the process wide BandProcessor */
+static constexpr int kMaxBands = 8;
+
+/*
+ *  This method fills a YU12 frame with gradients and pseudo-random noise, so
+ *  that the details are not evenly spread across the strips.
+ */
+static std::vector<uint8_t> MakeFrame() {
+  std::vector<uint8_t> frame(kWidth * kHeight * 3 / 2);
+  uint8_t *y_plane = frame.data();
+  uint8_t *u_plane = y_plane + kWidth * kHeight;
+  uint8_t *v_plane = u_plane + kWidth * kHeight / 4;
+  uint32_t seed = 1;
+
+  for (int row = 0; row < kHeight; ++row) {
+    for (int col = 0; col < kWidth; ++col) {
+      seed = seed * 1103515245 + 12345;
+      int noise = row < kHeight / 2 ? (seed >> 16) % 64 : 0;
+      y_plane[row * kWidth + col] = (col * 255 / kWidth + noise) & 0xFF;
+    }
+  }
+
+  for (int row = 0; row < kHeight / 2; ++row) {
+    for (int col = 0; col < kWidth / 2; ++col) {
+      u_plane[row * kWidth / 2 + col] = row * 255 / (kHeight / 2);
+      v_plane[row * kWidth / 2 + col] = (row + col) & 0xFF;
+    }
+  }
+
+  return frame;
+}
+
+/*
+ *  This method encodes |frame| with at most |bands| strips, kIterations
+ *  times, and prints the encoding times.
+ *
+ *  @return the last JPEG image, empty on failure
+ */
+static std::vector<uint8_t> Encode(const std::vector<uint8_t> &frame,
+                                   int bands) {
+  BandProcessor processor(bands);
+  std::vector<uint8_t> output(frame.size() + 65537);
+  size_t size = 0;
+  long long total_us = 0;
+  long long best_us = 0;
+
+  auto no_app1 = [](const void **app1Buffer, unsigned int *app1Size) {
+    *app1Buffer = nullptr;
+    *app1Size = 0;
+    return true;
+  };
+
+  for (int i = 0; i < kIterations; ++i) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (!JpegCompressor::CompressImageInStrips(frame.data(), kWidth, kHeight,
+                                               kQuality, no_app1,
+                                               output.data(), output.size(),
+                                               &size, processor))
+      return {};
+
+    long long us = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+    total_us += us;
+    best_us = i ? std::min(best_us, us) : us;
+  }
+
+  printf("[%dx%d] in %d band(s): %zu bytes, best %lld us, mean %lld us\n",
+         kWidth, kHeight, bands, size, best_us, total_us / kIterations);
+
+  output.resize(size);
+  return output;
+}
+
+/*
+ *  This method decodes |image| to YCbCr, without any color conversion.
+ *
+ *  @return the decoded pixels, empty on failure
+ */
+static std::vector<uint8_t> Decode(const std::vector<uint8_t> &image) {
+  jpeg_decompress_struct cinfo;
+  jpeg_error_mgr jerr;
+  std::vector<uint8_t> pixels;
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, image.data(), image.size());
+
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    jpeg_destroy_decompress(&cinfo);
+    return pixels;
+  }
+
+  cinfo.out_color_space = JCS_YCbCr;
+  jpeg_start_decompress(&cinfo);
+
+  size_t row_size = cinfo.output_width * cinfo.output_components;
+  pixels.resize(row_size * cinfo.output_height);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = pixels.data() + cinfo.output_scanline * row_size;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  return pixels;
+}
+
+TEST(JpegCompressorBenchmark, StripsDecodeIdentical) {
+  /* At least two strips, so that the stitching is checked on any host */
+  int bands = std::clamp(static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)),
+                         2, kMaxBands);
+  std::vector<uint8_t> frame = MakeFrame();
+
+  std::vector<uint8_t> single = Encode(frame, 1);
+  std::vector<uint8_t> split = Encode(frame, bands);
+  ASSERT_FALSE(single.empty());
+  ASSERT_FALSE(split.empty());
+
+  std::vector<uint8_t> single_pixels = Decode(single);
+  std::vector<uint8_t> split_pixels = Decode(split);
+  ASSERT_EQ(single_pixels.size(),
+            static_cast<size_t>(kWidth) * kHeight * 3);
+  ASSERT_TRUE(single_pixels == split_pixels);
+}
+
+} // namespace arc
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
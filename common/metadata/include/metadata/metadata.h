@@ -41,8 +41,19 @@ class Metadata {
   int GetRequestTemplate(int template_type,
                          helper::CameraMetadata* template_metadata) const;
   int SetRequestSettings(const helper::CameraMetadata& metadata);
+  // The dynamic fields are updated in place: filling a |metadata| which
+  // already holds them, e.g. a copy of a result layout, does not allocate.
   int FillResultMetadata(helper::CameraMetadata* metadata);
 
+  // Precompute in |layout| the dynamic fields of all the components, sorted
+  // and preallocated so that they can be updated in place. The components
+  // are expected to fill the same tags with the same number of values for
+  // each result. The layout is kept by the caller, e.g. when the streams are
+  // configured, as the components are shared by the sessions of the device.
+  // The entries |layout| already holds, which the caller fills in each
+  // result too, are kept in the layout.
+  int CompileResultLayout(helper::CameraMetadata* layout);
+
  private:
   // The overall metadata is broken down into several distinct pieces.
   // Note: it is undefined behavior if multiple components share tags.
@@ -61,7 +61,9 @@ class V4L2ControlDelegate : public ControlDelegateInterface<TMetadata> {
       ALOGE("%s: Failed to convert metadata value to V4L2.", __FUNCTION__);
       return res;
     }
-    return device_->SetControl(control_id_, v4l2_value);
+    // Applied with the other controls of the request when the caller opened
+    // a control transaction on the device.
+    return device_->StageControl(control_id_, v4l2_value);
   };
 
  private:
@@ -20,6 +20,8 @@
 
 #include <utils/Log.h>
 
+#include <algorithm>
+
 #include "metadata.h"
 
 #include "metadata_common.h"
@@ -209,26 +211,71 @@ int Metadata::FillResultMetadata(helper::CameraMetadata* metadata) {
   }
 
   for (auto& component : components_) {
-    // Prevent components from potentially overriding others.
-    helper::CameraMetadata additional_metadata;
-    int res = component->PopulateDynamicFields(&additional_metadata);
+    int res = component->PopulateDynamicFields(metadata);
 
     if (res) {
       ALOGE("%s: Failed to get all dynamic result fields.", __FUNCTION__);
       return res;
     }
+  }
 
-    // Add it to the overall result.
-    if (!additional_metadata.isEmpty()) {
-      res = metadata->append(additional_metadata);
+  return 0;
+}
 
-      if (res != android::OK) {
-        ALOGE("%s: Failed to append all dynamic result fields.", __FUNCTION__);
-        return res;
-      }
+int Metadata::CompileResultLayout(helper::CameraMetadata* layout) {
+  ALOGV("%s: enter", __FUNCTION__);
+
+  if (!layout) {
+    ALOGE("%s: Can't fill null layout.", __FUNCTION__);
+    return -EINVAL;
+  }
+
+  // Fill a result once to find out its tags and their sizes.
+  helper::CameraMetadata dynamic(*layout);
+  for (auto& component : components_) {
+    int res = component->PopulateDynamicFields(&dynamic);
+
+    if (res) {
+      ALOGE("%s: Failed to get all dynamic result fields.", __FUNCTION__);
+      return res;
     }
   }
 
+  const camera_metadata_t* raw = dynamic.getAndLock();
+  size_t entry_count = get_camera_metadata_entry_count(raw);
+  size_t data_count = get_camera_metadata_data_count(raw);
+  size_t max_entry_data = 0;
+
+  for (size_t i = 0; i < entry_count; ++i) {
+    camera_metadata_ro_entry entry;
+    if (get_camera_metadata_ro_entry(raw, i, &entry) == 0)
+      max_entry_data = std::max(max_entry_data,
+          calculate_camera_metadata_entry_data_size(entry.type, entry.count));
+  }
+  dynamic.unlock(raw);
+
+  // helper::CameraMetadata::update() makes room for one more entry of the
+  // updated size before updating in place: the layout keeps that room.
+  helper::CameraMetadata compiled(entry_count + 1,
+                                  data_count + max_entry_data);
+
+  int res = compiled.append(dynamic);
+  if (res != android::OK) {
+    ALOGE("%s: Failed to append all dynamic result fields.", __FUNCTION__);
+    return res;
+  }
+
+  // Sorted, the entries are found by binary search.
+  res = compiled.sort();
+  if (res != android::OK) {
+    ALOGE("%s: Failed to sort the result layout.", __FUNCTION__);
+    return res;
+  }
+
+  layout->acquire(compiled);
+
+  ALOGV("%s: %zu entries, %zu bytes of data", __FUNCTION__, entry_count,
+        data_count);
   return 0;
 }
 
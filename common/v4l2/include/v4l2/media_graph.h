@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef V4L2_CAMERA_HAL_MEDIA_GRAPH_H_
+#define V4L2_CAMERA_HAL_MEDIA_GRAPH_H_
+
+#include <android-base/unique_fd.h>
+#include <linux/v4l2-subdev.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace v4l2 {
+
+/* The topology of a media device, walked once with MEDIA_IOC_G_TOPOLOGY.
+ * Each video node is mapped to the subdevs feeding it, whose fds are kept
+ * open. The active configuration of a subdev, as read from or applied by
+ * the driver, is remembered so that setting it again does not reach the
+ * driver.
+ */
+class MediaGraph {
+ public:
+  /* A subdev feeding a video node, and the pads of the link towards it. */
+  struct Subdev {
+    std::string path;
+    uint32_t sink_pad;
+    uint32_t source_pad;
+  };
+
+  /* The graph of |media_path|, walked on first use. nullptr on failure. */
+  static std::shared_ptr<MediaGraph> GetInstance(const std::string& media_path);
+
+  /* The subdevs upstream of |video_path|, the closest first. */
+  int GetUpstreamSubdevs(const std::string& video_path,
+                         std::vector<Subdev>* subdevs);
+
+  /* Set the compose rectangle of the sink pad of |subdev|, and the format
+   * of its source pad. Nothing is issued if already active.
+   */
+  int SetCompose(const Subdev& subdev, uint32_t width, uint32_t height);
+  int SetFormat(const Subdev& subdev, uint32_t width, uint32_t height,
+                uint32_t code);
+
+  /* Ask |subdev| for the compose rectangle it would apply for the given
+   * size, from its active sink format, without changing its configuration.
+   * The size is updated with the nearest one the hardware can output.
+   */
+  int TryCompose(const Subdev& subdev, uint32_t* width, uint32_t* height);
+
+  /* Forget the configuration of the subdevs, e.g. if another process may
+   * have changed it.
+   */
+  void InvalidateConfiguration();
+
+ private:
+  MediaGraph(const std::string& media_path);
+
+  int Walk();
+
+  /* Get the opened fd of the subdev at |path|, -1 on failure.
+   * Must be called with lock_ held.
+   */
+  int GetSubdevFdLocked(const std::string& path);
+
+  /* Opened subdev, and its active configuration. */
+  struct SubdevState {
+    base::unique_fd fd;
+    bool compose_valid;
+    v4l2_rect compose;
+    bool format_valid;
+    v4l2_mbus_framefmt format;
+  };
+
+  const std::string media_path_;
+  std::mutex lock_;
+  /* Upstream subdevs, indexed by video node device number. */
+  std::map<dev_t, std::vector<Subdev>> upstream_;
+  /* Subdev states, indexed by path. */
+  std::map<std::string, SubdevState> subdevs_;
+
+  /* disallow copy constructor */
+  MediaGraph(const MediaGraph&);
+  void operator=(const MediaGraph&);
+};
+
+} // namespace v4l2
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
+
+#endif  // V4L2_CAMERA_HAL_MEDIA_GRAPH_H_
@@ -41,8 +41,10 @@ typedef std::vector<StreamFormat> StreamFormats;
 class StreamFormat {
  public:
   StreamFormat(PixelFormat format, uint32_t width, uint32_t height,
-               uint32_t implementation_defined);
-  StreamFormat(uint32_t format, uint32_t width, uint32_t height);
+               uint32_t implementation_defined,
+               uint32_t type = V4L2_BUF_TYPE_VIDEO_CAPTURE);
+  StreamFormat(uint32_t format, uint32_t width, uint32_t height,
+               uint32_t type = V4L2_BUF_TYPE_VIDEO_CAPTURE);
   StreamFormat(const v4l2_format& format);
   virtual ~StreamFormat() = default;
 
@@ -54,6 +56,8 @@ class StreamFormat {
   inline uint32_t height() const { return height_; };
   inline int pixel_format() const { return V4L2ToHalPixelFormat(v4l2_pixel_format_); }
   inline uint32_t v4l2_pixel_format() const { return v4l2_pixel_format_; }
+  // Only known once the format is set, 1 until then.
+  inline uint32_t num_planes() const { return num_planes_; }
 
   bool operator==(const StreamFormat& other) const;
   bool operator!=(const StreamFormat& other) const;
@@ -64,6 +68,9 @@ class StreamFormat {
                                        uint32_t implementation_defined = 0);
   // Returns -1 for unrecognized.
   static int V4L2ToHalPixelFormat(uint32_t v4l2_pixel_format);
+  // Returns the single buffer equivalent of a format whose planes are stored
+  // in separate buffers (e.g. NV12 for NV12M), the format itself otherwise.
+  static uint32_t ContiguousPixelFormat(uint32_t v4l2_pixel_format);
 
   static int V4L2ToHalPixelFormat(const std::set<uint32_t> v4l2_pixel_formats,
                                   std::set<PixelFormat> *hal_pixel_format);
@@ -84,6 +91,7 @@ class StreamFormat {
   uint32_t v4l2_pixel_format_;
   uint32_t width_;
   uint32_t height_;
+  uint32_t num_planes_;
 
   static const std::vector<uint32_t> kSupportedFourCCs;
 };
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef V4L2_CAMERA_HAL_V4L2_CAPABILITY_CACHE_H_
+#define V4L2_CAMERA_HAL_V4L2_CAPABILITY_CACHE_H_
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "stream_format.h"
+#include "v4l2_wrapper.h"
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace v4l2 {
+
+/* What a V4L2 node can capture, and the identity of its driver. */
+struct V4L2Capabilities {
+  std::string driver;
+  std::string card;
+  std::string bus_info;
+  uint32_t version;
+  uint32_t buffer_type;
+  /* The pixel formats, and each of their frame sizes. */
+  std::set<uint32_t> formats;
+  StreamFormats supported_formats;
+  /* Min and max frame durations in ns of each supported format, {0, 0} if
+   * the driver does not report them.
+   */
+  std::vector<std::array<int64_t, 2>> frame_durations;
+
+  /* The frame durations of |format|, nullptr if it is not supported. */
+  const std::array<int64_t, 2>* FrameDurations(const StreamFormat& format) const;
+};
+
+/* Enumerating the formats and frame sizes of a node takes many ioctls, so it
+ * is done once per node and the result is shared by all the streams. The
+ * capabilities can also be persisted to survive a restart of the provider.
+ * An entry is only reused while the driver identity reported by QUERYCAP is
+ * unchanged.
+ */
+class V4L2CapabilityCache {
+ public:
+  static V4L2CapabilityCache& GetInstance();
+
+  /* Directory where the capabilities are persisted, empty (the default) to
+   * only keep them in memory.
+   */
+  void SetPersistentDir(const std::string& dir);
+
+  /* Get the capabilities of |device|, which must be connected. They are
+   * enumerated through |device| when not cached yet.
+   */
+  int GetCapabilities(const std::shared_ptr<V4L2Wrapper>& device,
+                      std::shared_ptr<const V4L2Capabilities>* capabilities);
+
+  /* Forget the capabilities of |device_path|, e.g. on hot unplug. */
+  void Invalidate(const std::string& device_path);
+
+ private:
+  V4L2CapabilityCache() = default;
+
+  static bool SameIdentity(const V4L2Capabilities& a,
+                           const V4L2Capabilities& b);
+  static int Enumerate(const std::shared_ptr<V4L2Wrapper>& device,
+                       V4L2Capabilities* capabilities);
+
+  /* Persistence, must be called with lock_ held. */
+  std::string PersistentPathLocked(const std::string& device_path,
+                                   const V4L2Capabilities& identity);
+  int LoadLocked(const std::string& path, V4L2Capabilities* capabilities);
+  int StoreLocked(const std::string& path,
+                  const V4L2Capabilities& capabilities);
+
+  std::mutex lock_;
+  std::string persistent_dir_;
+  /* Capabilities, indexed by device path. */
+  std::map<std::string, std::shared_ptr<const V4L2Capabilities>> entries_;
+
+  /* disallow copy constructor */
+  V4L2CapabilityCache(const V4L2CapabilityCache&);
+  void operator=(const V4L2CapabilityCache&);
+};
+
+} // namespace v4l2
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
+
+#endif  // V4L2_CAMERA_HAL_V4L2_CAPABILITY_CACHE_H_
@@ -19,9 +19,12 @@
 #define V4L2_CAMERA_HAL_V4L2_WRAPPER_H_
 
 #include <android-base/unique_fd.h>
+#include <atomic>
+#include <map>
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "stream_format.h"
 
@@ -40,6 +43,8 @@ class V4L2Wrapper {
 
   virtual const std::string getDevicePath() const;
   static int IsV4L2VideoDevice(int fd, v4l2_capability *cap);
+  /* The capabilities of the device node described by |cap|. */
+  static uint32_t GetDeviceCaps(const v4l2_capability& cap);
 
   // Helper class to ensure all opened connections are closed.
   class Connection {
@@ -79,6 +84,22 @@ class V4L2Wrapper {
                          int32_t desired,
                          int32_t* result = nullptr);
 
+  /* Control transactions. The controls staged between BeginControls() and
+   * CommitControls() are set with one S_EXT_CTRLS per control class. Controls
+   * whose value did not change since they were last set are skipped. When
+   * media requests are enabled, they are stored in the request of the next
+   * queued buffer instead, to be applied with its frame.
+   * Outside of a transaction, StageControl() behaves like SetControl().
+   */
+  virtual void BeginControls();
+  virtual int StageControl(uint32_t control_id, int32_t desired);
+  virtual int CommitControls();
+
+  /* Device identity and capabilities, queried when connecting. */
+  virtual int GetCapability(v4l2_capability* cap);
+  /* The buffer type of the device, multi-planar when supported. */
+  virtual uint32_t GetBufferType();
+
   /* Manage format. */
   virtual int GetFormats(std::set<uint32_t>* v4l2_formats);
   virtual int GetSupportedFormats(const std::set<uint32_t>& v4l2_formats,
@@ -92,13 +113,48 @@ class V4L2Wrapper {
                                           std::array<int64_t, 2>* duration_range);
 
   virtual int SetFormat(const StreamFormat& resolved_format);
-  /* Request/release userspace buffer mode via VIDIOC_REQBUFS. */
+  /* The format the driver would set for |desired|, through TRY_FMT. */
+  virtual int TryFormat(const StreamFormat& desired, StreamFormat* result);
+  /* Program the frame interval through S_PARM. The duration is in ns, the
+   * one chosen by the driver is returned in |applied|.
+   */
+  virtual int SetFrameDuration(int64_t duration, int64_t* applied = nullptr);
+  /* Request/release userspace buffer mode via VIDIOC_REQBUFS.
+   * |memory| is either V4L2_MEMORY_MMAP or V4L2_MEMORY_DMABUF.
+   */
   virtual int RequestBuffers(uint32_t num_buffers, uint32_t *num_done,
-                                                        uint32_t *buffer_size);
+                             uint32_t *buffer_size,
+                             uint32_t memory = V4L2_MEMORY_MMAP);
   virtual int ExportBuffer(uint32_t index, int32_t *fd);
+  /* Export plane |plane| of a multi-planar buffer. */
+  virtual int ExportBuffer(uint32_t index, uint32_t plane, int32_t *fd);
+  /* Size of each plane of the buffers, known once the format is set. */
+  virtual std::vector<uint32_t> GetPlaneSizes();
+  /* Bytes per line of each plane, chosen by the driver with the format. */
+  virtual std::vector<uint32_t> GetPlaneStrides();
 
   virtual int EnqueueRequest(uint32_t index);
-  virtual int DequeueRequest(uint32_t *index);
+  /* Queue an imported dma-buf, only valid in V4L2_MEMORY_DMABUF mode. */
+  virtual int EnqueueDmabufRequest(uint32_t index, int dmabuf_fd,
+                                   uint32_t length);
+  /* |timestamp| is the capture time of the frame, CLOCK_BOOTTIME in ns.
+   * |plane_bytesused| gets the bytes used in each plane of the buffer.
+   */
+  virtual int DequeueRequest(uint32_t *index, int64_t *timestamp = nullptr,
+                             std::vector<uint32_t> *plane_bytesused = nullptr);
+
+  /* Media request API. Once enabled, each buffer is queued through its own
+   * media request, allocated from the media device at |media_path|. The
+   * controls committed to the request of a buffer are applied to its frame.
+   * Must be called after RequestBuffers().
+   */
+  virtual int EnableRequests(const std::string& media_path);
+  virtual bool RequestsEnabled();
+
+  /* Block until a filled buffer can be dequeued or |wakeup_fd| is signaled.
+   * |wakeup_fd| is expected to be an eventfd, it is drained on wake up.
+   */
+  virtual int WaitForBuffer(int wakeup_fd, int timeout_ms = -1);
 
  private:
   /* Connect or disconnect to the device. Access by creating/destroying
@@ -107,12 +163,70 @@ class V4L2Wrapper {
   int Connect();
   void Disconnect();
 
+  /* Ioctls of different domains can be issued concurrently. */
+  struct LockDomain {
+    std::mutex lock;
+    std::atomic<uint64_t> contentions{0};
+  };
+
   /* Perform an ioctl call in a thread-safe fashion. */
   template <typename T>
   int ioctlLocked(int request, T data);
+  /* The lock domain of |request|, nullptr if the kernel serializes it. */
+  LockDomain* GetLockDomain(uint32_t request);
 
   inline bool Connected() { return device_fd_.get() >= 0; }
 
+  /* Build the descriptor of each buffer allocated by REQBUFS. */
+  int InitBufferDescriptors(uint32_t num_buffers);
+  /* Queue buffer |index|, backed by |dmabuf_fd| in DMABUF mode.
+   * Must be called with buffer_lock_ held.
+   */
+  int QueueBufferLocked(uint32_t index, int dmabuf_fd, uint32_t length);
+
+  /* Set the |count| controls of |controls|, which belong to the same class,
+   * with one S_EXT_CTRLS. Must be called with controls_lock_ held.
+   */
+  int SetControlClassLocked(v4l2_ext_control* controls, uint32_t count);
+
+  /* Subscribe to the change events of |control_id|, so that its value can
+   * be cached. Returns false for volatile controls, which are never cached.
+   * Must be called with controls_lock_ held.
+   */
+  bool SubscribeControlLocked(uint32_t control_id);
+  /* Apply the pending control change events to the caches.
+   * Must be called with controls_lock_ held.
+   */
+  void DrainControlEventsLocked();
+  /* Whether |control_id| is known to be set to |desired| already.
+   * Must be called with controls_lock_ held.
+   */
+  bool CanSkipControlLocked(uint32_t control_id, int32_t desired);
+
+  /* Store the controls committed since the previous queued buffer in media
+   * request |request_fd|. Must be called with buffer_lock_ held.
+   */
+  int StoreRequestControls(int request_fd);
+
+  /* Last value set for a control, and the value the driver applied. */
+  struct ShadowControl {
+    int32_t desired;
+    int32_t applied;
+  };
+
+  /* Release the media requests and the media device. */
+  void DisableRequests();
+
+  /* Descriptor of a driver buffer, and whether the driver owns it. The
+   * planes of a multi-planar buffer are described by |planes|, which is
+   * pointed to by |descriptor| once copied.
+   */
+  struct BufferSlot {
+    v4l2_buffer descriptor;
+    std::vector<v4l2_plane> planes;
+    bool queued;
+  };
+
 private:
   /* The camera device path. For example, /dev/video0. */
   const std::string device_path_;
@@ -120,16 +234,60 @@ private:
   base::unique_fd device_fd_;
   /* Whether or not the device supports the extended control query. */
   bool extended_query_supported_;
+  /* Capabilities reported by QUERYCAP when connecting. */
+  v4l2_capability capability_;
+  /* The buffer type of the device, multi-planar when supported. */
+  uint32_t buffer_type_;
   /* The format this device is set up for. */
   std::shared_ptr<StreamFormat> format_;
-  /* Lock protecting use of the device. */
-  std::mutex device_lock_;
+  /* Lock domain of the format, buffer allocation and stream state ioctls. */
+  LockDomain state_domain_;
+  /* Lock domain of the control ioctls. */
+  LockDomain control_domain_;
+  /* Lock protecting the control transaction and the shadow values. */
+  std::mutex controls_lock_;
+  bool in_transaction_;
+  /* Controls staged in the current transaction, ordered by id and thus
+   * grouped by class.
+   */
+  std::map<uint32_t, int32_t> staged_controls_;
+  /* Controls committed for the frame of the next queued buffer, when media
+   * requests are enabled.
+   */
+  std::map<uint32_t, int32_t> request_controls_;
+  /* Values of the controls set since the device was opened. */
+  std::map<uint32_t, ShadowControl> control_shadow_;
+  /* Current values of the controls whose changes are reported by events. */
+  std::map<uint32_t, int32_t> control_cache_;
+  /* Whether a control can be cached: it is not volatile, and subscribing to
+   * its change events succeeded.
+   */
+  std::map<uint32_t, bool> control_subscriptions_;
   /* Lock protecting connecting/disconnecting the device. */
   std::mutex connection_lock_;
   /* Reference count connections. */
   int connection_count_;
 
   uint32_t buffer_size_;
+  /* Size of each plane of the buffers, buffer_size_ being their sum. */
+  std::vector<uint32_t> plane_sizes_;
+  /* Bytes per line of each plane of the buffers. */
+  std::vector<uint32_t> plane_strides_;
+  /* The memory type requested through REQBUFS. */
+  uint32_t memory_;
+  /* The buffers allocated by REQBUFS, indexed by buffer index. Their state
+   * is tracked here so that queuing a buffer does not need a QUERYBUF.
+   */
+  std::vector<BufferSlot> buffer_slots_;
+  /* Lock protecting buffer_slots_, taken before the lock domains. */
+  std::mutex buffer_lock_;
+  /* Whether the buffers support media requests, reported by REQBUFS. */
+  bool supports_requests_;
+  /* The media device the requests are allocated from, and the media
+   * request of each buffer. Protected by buffer_lock_.
+   */
+  base::unique_fd media_fd_;
+  std::vector<base::unique_fd> requests_;
 
   friend class Connection;
 
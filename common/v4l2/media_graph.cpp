@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.camera.common@1.0-v4l2.stm32mpu"
+// #define LOG_NDEBUG 0
+
+#include "utils/Log.h"
+
+#include "media_graph.h"
+
+#include <fcntl.h>
+#include <linux/media.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <fstream>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace v4l2 {
+
+/* Bound on the length of a pipeline, in case the graph has a loop. */
+static const int kMaxPipelineDepth = 16;
+
+/* Device node of a character device, from its sysfs uevent. */
+static std::string DevicePath(uint32_t major, uint32_t minor) {
+  std::ifstream uevent("/sys/dev/char/" + std::to_string(major) + ":" +
+                       std::to_string(minor) + "/uevent");
+  std::string line;
+
+  while (std::getline(uevent, line)) {
+    if (line.compare(0, 8, "DEVNAME=") == 0)
+      return "/dev/" + line.substr(8);
+  }
+
+  return "";
+}
+
+std::shared_ptr<MediaGraph> MediaGraph::GetInstance(
+                                              const std::string& media_path) {
+  static std::mutex instances_lock;
+  static std::map<std::string, std::shared_ptr<MediaGraph>> instances;
+
+  std::lock_guard lock(instances_lock);
+
+  auto it = instances.find(media_path);
+  if (it != instances.end())
+    return it->second;
+
+  std::shared_ptr<MediaGraph> graph(new MediaGraph(media_path));
+  if (graph->Walk())
+    return nullptr;
+
+  instances[media_path] = graph;
+  return graph;
+}
+
+MediaGraph::MediaGraph(const std::string& media_path)
+    : media_path_(media_path) {}
+
+/*
+ *  This method walks the topology of the media device, and records for each
+ *  video node the subdevs linked upstream of it through enabled links.
+ *
+ *  @return 0 on success, -ENODEV otherwise
+ *
+ */
+int MediaGraph::Walk() {
+  base::unique_fd fd(TEMP_FAILURE_RETRY(open(media_path_.c_str(), O_RDWR)));
+  if (fd.get() < 0) {
+    ALOGE("%s: cannot open %s: %s", __FUNCTION__, media_path_.c_str(),
+              strerror(errno));
+    return -ENODEV;
+  }
+
+  /* The first call returns the number of elements, the second fills them. */
+  media_v2_topology topology;
+  memset(&topology, 0, sizeof(topology));
+  if (TEMP_FAILURE_RETRY(ioctl(fd.get(), MEDIA_IOC_G_TOPOLOGY, &topology))) {
+    ALOGE("%s: G_TOPOLOGY failed: %s", __FUNCTION__, strerror(errno));
+    return -ENODEV;
+  }
+
+  std::vector<media_v2_entity> entities(topology.num_entities);
+  std::vector<media_v2_interface> interfaces(topology.num_interfaces);
+  std::vector<media_v2_pad> pads(topology.num_pads);
+  std::vector<media_v2_link> links(topology.num_links);
+
+  topology.ptr_entities = reinterpret_cast<uintptr_t>(entities.data());
+  topology.ptr_interfaces = reinterpret_cast<uintptr_t>(interfaces.data());
+  topology.ptr_pads = reinterpret_cast<uintptr_t>(pads.data());
+  topology.ptr_links = reinterpret_cast<uintptr_t>(links.data());
+  if (TEMP_FAILURE_RETRY(ioctl(fd.get(), MEDIA_IOC_G_TOPOLOGY, &topology))) {
+    ALOGE("%s: G_TOPOLOGY failed: %s", __FUNCTION__, strerror(errno));
+    return -ENODEV;
+  }
+
+  /* Pad indexes are only reported by recent kernels. Otherwise they follow
+   * the order of the pad ids of their entity.
+   */
+  media_device_info info;
+  memset(&info, 0, sizeof(info));
+  bool has_pad_index =
+      TEMP_FAILURE_RETRY(ioctl(fd.get(), MEDIA_IOC_DEVICE_INFO, &info)) == 0 &&
+      MEDIA_V2_PAD_HAS_INDEX(info.media_version);
+
+  std::map<uint32_t, std::vector<media_v2_pad>> entity_pads;
+  for (const media_v2_pad& pad : pads)
+    entity_pads[pad.entity_id].push_back(pad);
+
+  std::map<uint32_t, const media_v2_pad*> pads_by_id;
+  for (auto& [entity, list] : entity_pads) {
+    std::sort(list.begin(), list.end(),
+              [](const media_v2_pad& a, const media_v2_pad& b) {
+                return a.id < b.id;
+              });
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (!has_pad_index)
+        list[i].index = i;
+      pads_by_id[list[i].id] = &list[i];
+    }
+  }
+
+  /* Device nodes of the entities, through the interface links. */
+  std::map<uint32_t, const media_v2_interface*> interfaces_by_id;
+  for (const media_v2_interface& interface : interfaces)
+    interfaces_by_id[interface.id] = &interface;
+
+  std::map<uint32_t, const media_v2_interface*> entity_interfaces;
+  for (const media_v2_link& link : links) {
+    if ((link.flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_INTERFACE_LINK)
+      continue;
+
+    auto it = interfaces_by_id.find(link.source_id);
+    if (it != interfaces_by_id.end())
+      entity_interfaces[link.sink_id] = it->second;
+  }
+
+  /* The enabled data link feeding a sink pad of |entity_id|, if any. */
+  auto upstream_link = [&](uint32_t entity_id) -> const media_v2_link* {
+    for (const media_v2_link& link : links) {
+      if ((link.flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK ||
+          !(link.flags & MEDIA_LNK_FL_ENABLED))
+        continue;
+
+      auto sink = pads_by_id.find(link.sink_id);
+      if (sink != pads_by_id.end() && sink->second->entity_id == entity_id)
+        return &link;
+    }
+    return nullptr;
+  };
+
+  for (const auto& [entity_id, interface] : entity_interfaces) {
+    if (interface->intf_type != MEDIA_INTF_T_V4L_VIDEO)
+      continue;
+
+    std::vector<Subdev> chain;
+    uint32_t current = entity_id;
+
+    for (int depth = 0; depth < kMaxPipelineDepth; ++depth) {
+      const media_v2_link* link = upstream_link(current);
+      if (link == nullptr)
+        break;
+
+      auto source = pads_by_id.find(link->source_id);
+      if (source == pads_by_id.end())
+        break;
+
+      current = source->second->entity_id;
+
+      auto subdev_interface = entity_interfaces.find(current);
+      if (subdev_interface == entity_interfaces.end() ||
+          subdev_interface->second->intf_type != MEDIA_INTF_T_V4L_SUBDEV)
+        continue;
+
+      Subdev subdev;
+      subdev.path = DevicePath(subdev_interface->second->devnode.major,
+                               subdev_interface->second->devnode.minor);
+      subdev.source_pad = source->second->index;
+
+      /* The sink pad being fed, or the first one. */
+      const media_v2_link* sink_link = upstream_link(current);
+      subdev.sink_pad = sink_link ? pads_by_id[sink_link->sink_id]->index : 0;
+      if (sink_link == nullptr) {
+        for (const media_v2_pad& pad : entity_pads[current]) {
+          if (pad.flags & MEDIA_PAD_FL_SINK) {
+            subdev.sink_pad = pad.index;
+            break;
+          }
+        }
+      }
+
+      if (subdev.path.empty()) {
+        ALOGW("%s: no device node for subdev entity %u", __FUNCTION__,
+                  current);
+        continue;
+      }
+
+      chain.push_back(subdev);
+    }
+
+    upstream_[makedev(interface->devnode.major, interface->devnode.minor)] =
+        std::move(chain);
+  }
+
+  ALOGI("%s: %s: %u entities, %zu video nodes", __FUNCTION__,
+            media_path_.c_str(), topology.num_entities, upstream_.size());
+
+  return 0;
+}
+
+int MediaGraph::GetUpstreamSubdevs(const std::string& video_path,
+                                   std::vector<Subdev>* subdevs) {
+  struct stat st;
+
+  if (stat(video_path.c_str(), &st) || !S_ISCHR(st.st_mode)) {
+    ALOGE("%s: %s is not a device node", __FUNCTION__, video_path.c_str());
+    return -ENODEV;
+  }
+
+  std::lock_guard lock(lock_);
+
+  auto it = upstream_.find(st.st_rdev);
+  if (it == upstream_.end() || it->second.empty()) {
+    ALOGE("%s: no subdev upstream of %s in %s", __FUNCTION__,
+              video_path.c_str(), media_path_.c_str());
+    return -ENOENT;
+  }
+
+  *subdevs = it->second;
+  return 0;
+}
+
+int MediaGraph::GetSubdevFdLocked(const std::string& path) {
+  SubdevState& state = subdevs_[path];
+
+  if (state.fd.get() < 0) {
+    state.fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDWR)));
+    state.compose_valid = false;
+    state.format_valid = false;
+    if (state.fd.get() < 0) {
+      ALOGE("%s: cannot open v4l2 sub-device %s: %s", __FUNCTION__,
+                path.c_str(), strerror(errno));
+      subdevs_.erase(path);
+      return -1;
+    }
+  }
+
+  return state.fd.get();
+}
+
+int MediaGraph::SetCompose(const Subdev& subdev, uint32_t width,
+                           uint32_t height) {
+  std::lock_guard lock(lock_);
+
+  int fd = GetSubdevFdLocked(subdev.path);
+  if (fd < 0)
+    return -ENODEV;
+
+  SubdevState& state = subdevs_[subdev.path];
+  v4l2_subdev_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.pad = subdev.sink_pad;
+  sel.target = V4L2_SEL_TGT_COMPOSE;
+  sel.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+
+  /* Start from the active rectangle if it is not known yet */
+  if (!state.compose_valid &&
+      TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_G_SELECTION, &sel)) == 0) {
+    state.compose = sel.r;
+    state.compose_valid = true;
+  }
+
+  if (state.compose_valid && state.compose.left == 0 &&
+      state.compose.top == 0 && state.compose.width == width &&
+      state.compose.height == height) {
+    ALOGV("%s: %s compose already %ux%u", __FUNCTION__, subdev.path.c_str(),
+              width, height);
+    return 0;
+  }
+
+  sel.r.left = 0;
+  sel.r.top = 0;
+  sel.r.width = width;
+  sel.r.height = height;
+
+  /* The source format may be reset by a new compose rectangle. */
+  state.compose_valid = false;
+  state.format_valid = false;
+
+  if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_S_SELECTION, &sel))) {
+    int err = errno;
+    ALOGE("%s: SUBDEV_S_SELECTION failed: %s", __FUNCTION__, strerror(err));
+    return -err;
+  }
+
+  /* Remember what the driver applied, which may differ from the request */
+  if (sel.r.width != width || sel.r.height != height)
+    ALOGW("%s: %s compose %ux%u adjusted to %ux%u", __FUNCTION__,
+              subdev.path.c_str(), width, height, sel.r.width, sel.r.height);
+
+  state.compose = sel.r;
+  state.compose_valid = true;
+
+  return 0;
+}
+
+int MediaGraph::SetFormat(const Subdev& subdev, uint32_t width,
+                          uint32_t height, uint32_t code) {
+  std::lock_guard lock(lock_);
+
+  int fd = GetSubdevFdLocked(subdev.path);
+  if (fd < 0)
+    return -ENODEV;
+
+  SubdevState& state = subdevs_[subdev.path];
+  v4l2_subdev_format new_format;
+  memset(&new_format, 0, sizeof(new_format));
+  new_format.pad = subdev.source_pad;
+  new_format.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+
+  /* Start from the active format if it is not known yet */
+  if (!state.format_valid) {
+    if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_G_FMT, &new_format))) {
+      int err = errno;
+      ALOGE("%s: SUBDEV_G_FMT failed: %s", __FUNCTION__, strerror(err));
+      return -err;
+    }
+
+    state.format = new_format.format;
+    state.format_valid = true;
+  }
+
+  if (state.format.width == width && state.format.height == height &&
+      state.format.code == code) {
+    ALOGV("%s: %s format already %ux%u 0x%x", __FUNCTION__,
+              subdev.path.c_str(), width, height, code);
+    return 0;
+  }
+
+  new_format.format = state.format;
+  state.format_valid = false;
+
+  new_format.format.width = width;
+  new_format.format.height = height;
+  new_format.format.code = code;
+  if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_S_FMT, &new_format))) {
+    int err = errno;
+    ALOGE("%s: SUBDEV_S_FMT failed: %s", __FUNCTION__, strerror(err));
+    return -err;
+  }
+
+  /* Remember what the driver applied, which may differ from the request */
+  if (new_format.format.width != width || new_format.format.height != height ||
+      new_format.format.code != code)
+    ALOGW("%s: %s format %ux%u 0x%x adjusted to %ux%u 0x%x", __FUNCTION__,
+              subdev.path.c_str(), width, height, code,
+              new_format.format.width, new_format.format.height,
+              new_format.format.code);
+
+  state.format = new_format.format;
+  state.format_valid = true;
+
+  return 0;
+}
+
+int MediaGraph::TryCompose(const Subdev& subdev, uint32_t* width,
+                           uint32_t* height) {
+  std::lock_guard lock(lock_);
+
+  int fd = GetSubdevFdLocked(subdev.path);
+  if (fd < 0)
+    return -ENODEV;
+
+  /* The try compose rectangle is bounded by the try sink format, start
+   * from the active one.
+   */
+  v4l2_subdev_format sink_format;
+  memset(&sink_format, 0, sizeof(sink_format));
+  sink_format.pad = subdev.sink_pad;
+  sink_format.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+  if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_G_FMT, &sink_format))) {
+    int err = errno;
+    ALOGE("%s: SUBDEV_G_FMT failed: %s", __FUNCTION__, strerror(err));
+    return -err;
+  }
+
+  sink_format.which = V4L2_SUBDEV_FORMAT_TRY;
+  if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_S_FMT, &sink_format))) {
+    int err = errno;
+    ALOGE("%s: SUBDEV_S_FMT (try) failed: %s", __FUNCTION__, strerror(err));
+    return -err;
+  }
+
+  v4l2_subdev_selection sel;
+  memset(&sel, 0, sizeof(sel));
+  sel.pad = subdev.sink_pad;
+  sel.target = V4L2_SEL_TGT_COMPOSE;
+  sel.which = V4L2_SUBDEV_FORMAT_TRY;
+  sel.r.width = *width;
+  sel.r.height = *height;
+  if (TEMP_FAILURE_RETRY(ioctl(fd, VIDIOC_SUBDEV_S_SELECTION, &sel))) {
+    int err = errno;
+    ALOGV("%s: SUBDEV_S_SELECTION (try) failed: %s", __FUNCTION__,
+              strerror(err));
+    return -err;
+  }
+
+  *width = sel.r.width;
+  *height = sel.r.height;
+
+  return 0;
+}
+
+void MediaGraph::InvalidateConfiguration() {
+  std::lock_guard lock(lock_);
+
+  for (auto& [path, state] : subdevs_) {
+    state.compose_valid = false;
+    state.format_valid = false;
+  }
+}
+
+} // namespace v4l2
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
@@ -30,33 +30,51 @@ namespace V1_0 {
 namespace v4l2 {
 
 StreamFormat::StreamFormat(PixelFormat format, uint32_t width, uint32_t height,
-                           uint32_t implementation_defined)
-    // TODO(b/30000211): multiplanar support.
-    : type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+                           uint32_t implementation_defined, uint32_t type)
+    : type_(type),
       v4l2_pixel_format_(HalToV4L2PixelFormat(format, implementation_defined)),
       width_(width),
-      height_(height) {}
+      height_(height),
+      num_planes_(1) {}
 
-StreamFormat::StreamFormat(uint32_t format, uint32_t width, uint32_t height)
-    // TODO(b/30000211): multiplanar support.
-    : type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+StreamFormat::StreamFormat(uint32_t format, uint32_t width, uint32_t height,
+                           uint32_t type)
+    : type_(type),
       v4l2_pixel_format_(format),
       width_(width),
-      height_(height) {}
+      height_(height),
+      num_planes_(1) {}
 
 StreamFormat::StreamFormat(const v4l2_format& format)
-    : type_(format.type),
-      // TODO(b/30000211): multiplanar support.
-      v4l2_pixel_format_(format.fmt.pix.pixelformat),
-      width_(format.fmt.pix.width),
-      height_(format.fmt.pix.height) {}
+    : type_(format.type) {
+  if (V4L2_TYPE_IS_MULTIPLANAR(type_)) {
+    v4l2_pixel_format_ = format.fmt.pix_mp.pixelformat;
+    width_ = format.fmt.pix_mp.width;
+    height_ = format.fmt.pix_mp.height;
+    num_planes_ = format.fmt.pix_mp.num_planes;
+  } else {
+    v4l2_pixel_format_ = format.fmt.pix.pixelformat;
+    width_ = format.fmt.pix.width;
+    height_ = format.fmt.pix.height;
+    num_planes_ = 1;
+  }
+}
 
 void StreamFormat::FillFormatRequest(v4l2_format* format) const {
   memset(format, 0, sizeof(*format));
   format->type = type_;
-  format->fmt.pix.pixelformat = v4l2_pixel_format_;
-  format->fmt.pix.width = width_;
-  format->fmt.pix.height = height_;
+
+  /* The driver fills in the number of planes and their layout. */
+  if (V4L2_TYPE_IS_MULTIPLANAR(type_)) {
+    format->fmt.pix_mp.pixelformat = v4l2_pixel_format_;
+    format->fmt.pix_mp.width = width_;
+    format->fmt.pix_mp.height = height_;
+    format->fmt.pix_mp.field = V4L2_FIELD_ANY;
+  } else {
+    format->fmt.pix.pixelformat = v4l2_pixel_format_;
+    format->fmt.pix.width = width_;
+    format->fmt.pix.height = height_;
+  }
 }
 
 bool StreamFormat::operator==(const StreamFormat& other) const {
@@ -71,11 +89,31 @@ bool StreamFormat::operator!=(const StreamFormat& other) const {
   return !(*this == other);
 }
 
+uint32_t StreamFormat::ContiguousPixelFormat(uint32_t v4l2_pixel_format) {
+  switch (v4l2_pixel_format) {
+    case V4L2_PIX_FMT_NV12M:
+      return V4L2_PIX_FMT_NV12;
+    case V4L2_PIX_FMT_NV21M:
+      return V4L2_PIX_FMT_NV21;
+    case V4L2_PIX_FMT_NV16M:
+      return V4L2_PIX_FMT_NV16;
+    case V4L2_PIX_FMT_NV61M:
+      return V4L2_PIX_FMT_NV61;
+    case V4L2_PIX_FMT_YUV420M:
+      return V4L2_PIX_FMT_YUV420;
+    case V4L2_PIX_FMT_YVU420M:
+      return V4L2_PIX_FMT_YVU420;
+    default:
+      return v4l2_pixel_format;
+  }
+}
+
 int StreamFormat::V4L2ToHalPixelFormat(uint32_t v4l2_pixel_format) {
   PixelFormat res;
 
-  // Translate V4L2 format to HAL format.
-  switch (v4l2_pixel_format) {
+  // Translate V4L2 format to HAL format. Formats whose planes are stored in
+  // separate buffers translate like their contiguous equivalent.
+  switch (ContiguousPixelFormat(v4l2_pixel_format)) {
     case V4L2_PIX_FMT_ABGR32:
       res = PixelFormat::RGBA_8888;
       break;
@@ -165,7 +203,9 @@ int StreamFormat::V4L2ToHalPixelFormat(
 }
 
 /* Helper functiont to find a matching StreamFormat in the given
- * formats array.
+ * formats array. A format with the same layout but whose planes are stored
+ * in separate buffers (e.g. NV21M for NV21) matches if there is no exact
+ * match.
  *
  * @param formats: the StreamFormat array where to search for the corresponding
  *                 format
@@ -180,16 +220,27 @@ int StreamFormat::V4L2ToHalPixelFormat(
 int StreamFormat::FindMatchingFormat(const StreamFormats& formats,
                                      uint32_t v4l2_pixel_format, uint32_t width,
                                      uint32_t height) {
+  int contiguous_match = -1;
+
   for (size_t i = 0; i < formats.size(); ++i) {
     const StreamFormat& format = formats[i];
 
-    if (format.v4l2_pixel_format() == v4l2_pixel_format &&
-            format.width() == width && format.height() == height) {
+    if (format.width() != width || format.height() != height) {
+      continue;
+    }
+
+    if (format.v4l2_pixel_format() == v4l2_pixel_format) {
       return i;
     }
+
+    if (contiguous_match < 0 &&
+        ContiguousPixelFormat(format.v4l2_pixel_format()) ==
+            ContiguousPixelFormat(v4l2_pixel_format)) {
+      contiguous_match = i;
+    }
   }
 
-  return -1;
+  return contiguous_match;
 }
 
 /* Helper function to find a format based on its resolution in the given formats
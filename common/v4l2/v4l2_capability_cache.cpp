@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2019 STMicroelectronics
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.camera.common@1.0-v4l2.stm32mpu"
+// #define LOG_NDEBUG 0
+
+#include "utils/Log.h"
+
+#include "v4l2_capability_cache.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace android {
+namespace hardware {
+namespace camera {
+namespace common {
+namespace V1_0 {
+namespace v4l2 {
+
+/* Bump when the layout of the persisted file changes. */
+static const char kFileMagic[] = "v4l2-capabilities";
+static const int kFileVersion = 2;
+
+const std::array<int64_t, 2>* V4L2Capabilities::FrameDurations(
+                                          const StreamFormat& format) const {
+  for (size_t i = 0; i < supported_formats.size(); ++i) {
+    const StreamFormat& supported = supported_formats[i];
+
+    if (supported.v4l2_pixel_format() == format.v4l2_pixel_format() &&
+        supported.width() == format.width() &&
+        supported.height() == format.height()) {
+      return &frame_durations[i];
+    }
+  }
+
+  return nullptr;
+}
+
+V4L2CapabilityCache& V4L2CapabilityCache::GetInstance() {
+  static V4L2CapabilityCache instance;
+  return instance;
+}
+
+void V4L2CapabilityCache::SetPersistentDir(const std::string& dir) {
+  std::lock_guard lock(lock_);
+  persistent_dir_ = dir;
+}
+
+void V4L2CapabilityCache::Invalidate(const std::string& device_path) {
+  std::lock_guard lock(lock_);
+  entries_.erase(device_path);
+}
+
+bool V4L2CapabilityCache::SameIdentity(const V4L2Capabilities& a,
+                                       const V4L2Capabilities& b) {
+  return a.driver == b.driver && a.card == b.card &&
+         a.bus_info == b.bus_info && a.version == b.version &&
+         a.buffer_type == b.buffer_type;
+}
+
+/*
+ *  This method looks up the capabilities of a connected device: first in
+ *  memory, then in the persistent directory, and enumerates them through
+ *  the device as a last resort.
+ *
+ *  @return 0 on success, or the error of the device
+ *
+ */
+int V4L2CapabilityCache::GetCapabilities(
+    const std::shared_ptr<V4L2Wrapper>& device,
+    std::shared_ptr<const V4L2Capabilities>* capabilities) {
+  v4l2_capability cap;
+
+  int res = device->GetCapability(&cap);
+  if (res)
+    return res;
+
+  auto entry = std::make_shared<V4L2Capabilities>();
+  entry->driver = reinterpret_cast<const char*>(cap.driver);
+  entry->card = reinterpret_cast<const char*>(cap.card);
+  entry->bus_info = reinterpret_cast<const char*>(cap.bus_info);
+  entry->version = cap.version;
+  entry->buffer_type = device->GetBufferType();
+
+  const std::string device_path = device->getDevicePath();
+  std::lock_guard lock(lock_);
+
+  auto it = entries_.find(device_path);
+  if (it != entries_.end()) {
+    if (SameIdentity(*it->second, *entry)) {
+      *capabilities = it->second;
+      return 0;
+    }
+
+    /* Another device was plugged at the same path */
+    ALOGI("%s: %s changed from %s to %s", __FUNCTION__, device_path.c_str(),
+              it->second->bus_info.c_str(), entry->bus_info.c_str());
+    entries_.erase(it);
+  }
+
+  std::string path = PersistentPathLocked(device_path, *entry);
+  if (!path.empty() && LoadLocked(path, entry.get()) == 0) {
+    ALOGI("%s: %s capabilities loaded from %s", __FUNCTION__,
+              device_path.c_str(), path.c_str());
+  } else {
+    res = Enumerate(device, entry.get());
+    if (res)
+      return res;
+
+    if (!path.empty() && StoreLocked(path, *entry))
+      ALOGW("%s: cannot persist %s capabilities to %s", __FUNCTION__,
+                device_path.c_str(), path.c_str());
+  }
+
+  entries_[device_path] = entry;
+  *capabilities = entry;
+
+  return 0;
+}
+
+int V4L2CapabilityCache::Enumerate(const std::shared_ptr<V4L2Wrapper>& device,
+                                   V4L2Capabilities* capabilities) {
+  capabilities->formats.clear();
+  capabilities->supported_formats.clear();
+  capabilities->frame_durations.clear();
+
+  int res = device->GetFormats(&capabilities->formats);
+  if (res) {
+    ALOGE("%s: failed to get formats: %d", __FUNCTION__, res);
+    return res;
+  }
+
+  res = device->GetSupportedFormats(capabilities->formats,
+                                    &capabilities->supported_formats);
+  if (res) {
+    ALOGE("%s: failed to get supported formats: %d", __FUNCTION__, res);
+    return res;
+  }
+
+  /* Not all drivers report frame intervals, the format is usable anyway. */
+  for (const StreamFormat& format : capabilities->supported_formats) {
+    std::array<int64_t, 2> durations = {0, 0};
+    std::array<int32_t, 2> size = {static_cast<int32_t>(format.width()),
+                                   static_cast<int32_t>(format.height())};
+
+    if (device->GetFormatFrameDurationRange(format.v4l2_pixel_format(), size,
+                                            &durations))
+      durations = {0, 0};
+
+    capabilities->frame_durations.push_back(durations);
+  }
+
+  return 0;
+}
+
+std::string V4L2CapabilityCache::PersistentPathLocked(
+                                          const std::string& device_path,
+                                          const V4L2Capabilities& identity) {
+  if (persistent_dir_.empty())
+    return "";
+
+  /* The file is keyed by driver name and version, the node name telling
+   * apart the nodes of the same driver.
+   */
+  std::string name = identity.driver + "-" + std::to_string(identity.version) +
+                     "-" + device_path.substr(device_path.rfind('/') + 1);
+  for (char& c : name) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_')
+      c = '_';
+  }
+
+  return persistent_dir_ + "/" + name + ".caps";
+}
+
+/*
+ *  This method reads persisted capabilities. |capabilities| holds the
+ *  identity of the device, which the file must match.
+ *
+ *  @return 0 on success
+ *          -ENOENT if there is no file
+ *          -EINVAL if the file is stale or malformed
+ *
+ */
+int V4L2CapabilityCache::LoadLocked(const std::string& path,
+                                    V4L2Capabilities* capabilities) {
+  std::ifstream file(path);
+  if (!file.is_open())
+    return -ENOENT;
+
+  std::string magic;
+  int version = 0;
+  std::string line;
+
+  if (!std::getline(file, line) ||
+      !(std::istringstream(line) >> magic >> version) ||
+      magic != kFileMagic || version != kFileVersion) {
+    ALOGW("%s: %s has an unknown layout", __FUNCTION__, path.c_str());
+    return -EINVAL;
+  }
+
+  V4L2Capabilities stored;
+  stored.version = 0;
+  stored.buffer_type = 0;
+
+  while (std::getline(file, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+
+    /* Identity strings may contain spaces, they end the line. */
+    std::string value;
+    if (key == "driver" || key == "card" || key == "bus_info") {
+      fields >> std::ws;
+      std::getline(fields, value);
+    }
+
+    bool valid = true;
+    if (key == "driver") {
+      stored.driver = value;
+    } else if (key == "card") {
+      stored.card = value;
+    } else if (key == "bus_info") {
+      stored.bus_info = value;
+    } else if (key == "version") {
+      valid = static_cast<bool>(fields >> stored.version);
+    } else if (key == "buffer_type") {
+      valid = static_cast<bool>(fields >> stored.buffer_type);
+    } else if (key == "format") {
+      uint32_t format;
+      valid = static_cast<bool>(fields >> format);
+      if (valid)
+        stored.formats.insert(format);
+    } else if (key == "size") {
+      uint32_t format, width, height;
+      std::array<int64_t, 2> durations;
+      valid = static_cast<bool>(fields >> format >> width >> height >>
+                                durations[0] >> durations[1]);
+      if (valid) {
+        stored.supported_formats.emplace_back(format, width, height,
+                                              capabilities->buffer_type);
+        stored.frame_durations.push_back(durations);
+      }
+    } else {
+      valid = false;
+    }
+
+    if (!valid) {
+      ALOGW("%s: %s is malformed: '%s'", __FUNCTION__, path.c_str(),
+                line.c_str());
+      return -EINVAL;
+    }
+  }
+
+  if (!SameIdentity(stored, *capabilities)) {
+    ALOGI("%s: %s is stale", __FUNCTION__, path.c_str());
+    return -EINVAL;
+  }
+
+  capabilities->formats = std::move(stored.formats);
+  capabilities->supported_formats = std::move(stored.supported_formats);
+  capabilities->frame_durations = std::move(stored.frame_durations);
+
+  return 0;
+}
+
+/*
+ *  This method persists capabilities. The file is written aside and then
+ *  renamed, so that a reader never sees it partially written.
+ *
+ *  @return 0 on success, -EIO otherwise
+ *
+ */
+int V4L2CapabilityCache::StoreLocked(const std::string& path,
+                                     const V4L2Capabilities& capabilities) {
+  if (mkdir(persistent_dir_.c_str(), 0770) && errno != EEXIST)
+    return -EIO;
+
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    if (!file.is_open())
+      return -EIO;
+
+    file << kFileMagic << " " << kFileVersion << "\n"
+         << "driver " << capabilities.driver << "\n"
+         << "card " << capabilities.card << "\n"
+         << "bus_info " << capabilities.bus_info << "\n"
+         << "version " << capabilities.version << "\n"
+         << "buffer_type " << capabilities.buffer_type << "\n";
+
+    for (uint32_t format : capabilities.formats)
+      file << "format " << format << "\n";
+
+    for (size_t i = 0; i < capabilities.supported_formats.size(); ++i) {
+      const StreamFormat& format = capabilities.supported_formats[i];
+      const std::array<int64_t, 2>& durations = capabilities.frame_durations[i];
+
+      file << "size " << format.v4l2_pixel_format() << " " << format.width()
+           << " " << format.height() << " " << durations[0] << " "
+           << durations[1] << "\n";
+    }
+
+    file.flush();
+    if (!file.good()) {
+      unlink(tmp_path.c_str());
+      return -EIO;
+    }
+  }
+
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    unlink(tmp_path.c_str());
+    return -EIO;
+  }
+
+  return 0;
+}
+
+} // namespace v4l2
+} // namespace V1_0
+} // namespace common
+} // namespace camera
+} // namespace hardware
+} // namespace android
@@ -22,7 +22,13 @@
 
 #include "v4l2_wrapper.h"
 
+#include <inttypes.h>
+#include <linux/media.h>
+#include <poll.h>
 #include <sys/mman.h>
+#include <time.h>
+
+#include <numeric>
 
 namespace android {
 namespace hardware {
@@ -47,7 +53,12 @@ const int32_t kStandardSizes[][2] = {
 
 V4L2Wrapper::V4L2Wrapper(const std::string device_path)
     : device_path_(std::move(device_path)),
-      connection_count_(0) {}
+      buffer_type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+      in_transaction_(false),
+      connection_count_(0),
+      buffer_size_(0),
+      memory_(V4L2_MEMORY_MMAP),
+      supports_requests_(false) {}
 
 V4L2Wrapper::~V4L2Wrapper() {}
 
@@ -56,7 +67,8 @@ int V4L2Wrapper::IsV4L2VideoDevice(int fd, v4l2_capability *cap) {
     ALOGE("%s: VIDIOC_QUERY_CAP fail: %s", __FUNCTION__, strerror(errno));
     return -errno;
   }
-  if (!(cap->capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+  if (!(GetDeviceCaps(*cap) &
+        (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
     ALOGE("%s: device is not a V4L2 video capture device", __FUNCTION__);
     return -ENODEV;
   }
@@ -64,6 +76,14 @@ int V4L2Wrapper::IsV4L2VideoDevice(int fd, v4l2_capability *cap) {
   return 0;
 }
 
+uint32_t V4L2Wrapper::GetDeviceCaps(const v4l2_capability& cap) {
+  /* The capabilities of the opened node, not of the whole physical device. */
+  if (cap.capabilities & V4L2_CAP_DEVICE_CAPS)
+    return cap.device_caps;
+
+  return cap.capabilities;
+}
+
 const std::string V4L2Wrapper::getDevicePath() const {
   return device_path_;
 }
@@ -92,6 +112,18 @@ int V4L2Wrapper::Connect() {
   device_fd_.reset(fd);
   ++connection_count_;
 
+  /* The multi-planar API is preferred when available: it also describes
+   * single buffer formats, and gives access to the formats whose planes are
+   * stored in separate buffers.
+   */
+  memset(&capability_, 0, sizeof(capability_));
+  if (IsV4L2VideoDevice(device_fd_.get(), &capability_) == 0 &&
+      (GetDeviceCaps(capability_) & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+    buffer_type_ = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  } else {
+    buffer_type_ = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  }
+
   /* Check if this connection has the extended control query capability. */
   v4l2_query_ext_ctrl query;
   query.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
@@ -125,15 +157,69 @@ void V4L2Wrapper::Disconnect() {
     return;
   }
 
+  ALOGI("%s: %s ioctl lock contentions: state %" PRIu64 ", controls %" PRIu64,
+        __FUNCTION__, device_path_.c_str(),
+        state_domain_.contentions.load(std::memory_order_relaxed),
+        control_domain_.contentions.load(std::memory_order_relaxed));
+  state_domain_.contentions = 0;
+  control_domain_.contentions = 0;
+
   device_fd_.reset(-1);  // Includes close().
   format_.reset();
+
+  {
+    std::lock_guard controls_lock(controls_lock_);
+    control_shadow_.clear();
+    request_controls_.clear();
+    /* Event subscriptions end with the file handle. */
+    control_cache_.clear();
+    control_subscriptions_.clear();
+  }
+
+  DisableRequests();
+
+  std::lock_guard buffer_lock(buffer_lock_);
+  buffer_slots_.clear();
+}
+
+/* The buffer queue ioctls (QUERYBUF, QBUF, DQBUF, EXPBUF) are serialized by
+ * the videobuf2 queue lock in the kernel, so they are not locked here. This
+ * lets the capture thread dequeue while buffers are queued or controls set.
+ */
+V4L2Wrapper::LockDomain* V4L2Wrapper::GetLockDomain(uint32_t request) {
+  switch (request) {
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+    case VIDIOC_EXPBUF:
+      return nullptr;
+    case VIDIOC_QUERYCTRL:
+    case VIDIOC_QUERY_EXT_CTRL:
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL:
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_DQEVENT:
+      return &control_domain_;
+    default:
+      return &state_domain_;
+  }
 }
 
 /* Helper function. Should be used instead of ioctl throughout this class. */
 template <typename T>
 int V4L2Wrapper::ioctlLocked(int request, T data) {
   /* Potentially called so many times logging entry is a bad idea. */
-  std::lock_guard lock(device_lock_);
+  LockDomain* domain = GetLockDomain(static_cast<uint32_t>(request));
+  std::unique_lock<std::mutex> lock;
+  if (domain) {
+    lock = std::unique_lock(domain->lock, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      domain->contentions.fetch_add(1, std::memory_order_relaxed);
+      lock.lock();
+    }
+  }
 
   if (!Connected()) {
     ALOGE("%s: Device %s not connected.", __FUNCTION__, device_path_.c_str());
@@ -174,6 +260,17 @@ int V4L2Wrapper::StreamOff() {
     return -ENODEV;
   }
 
+  /* STREAMOFF returns all the queued buffers to the user, and completes
+   * their requests.
+   */
+  {
+    std::lock_guard lock(buffer_lock_);
+    for (BufferSlot& slot : buffer_slots_)
+      slot.queued = false;
+    for (base::unique_fd& request : requests_)
+      TEMP_FAILURE_RETRY(ioctl(request.get(), MEDIA_REQUEST_IOC_REINIT));
+  }
+
   ALOGV("%s: Stream turned off.", __FUNCTION__);
 
   return 0;
@@ -248,6 +345,21 @@ int V4L2Wrapper::QueryControl(uint32_t control_id,
 }
 
 int V4L2Wrapper::GetControl(uint32_t control_id, int32_t* value) {
+  std::lock_guard lock(controls_lock_);
+
+  /* Values are served from the cache until the driver reports a change,
+   * so the pending changes are applied first.
+   */
+  DrainControlEventsLocked();
+  auto cached = control_cache_.find(control_id);
+  if (cached != control_cache_.end()) {
+    *value = cached->second;
+    return 0;
+  }
+
+  /* Subscribe before reading, so that no change is missed in between. */
+  bool cacheable = SubscribeControlLocked(control_id);
+
   /* For extended controls (any control class other than "user"),
    * G_EXT_CTRL must be used instead of G_CTRL.
    */
@@ -276,12 +388,79 @@ int V4L2Wrapper::GetControl(uint32_t control_id, int32_t* value) {
     }
     *value = control.value;
   }
+
+  if (cacheable)
+    control_cache_[control_id] = *value;
+
   return 0;
 }
 
+bool V4L2Wrapper::SubscribeControlLocked(uint32_t control_id) {
+  auto subscription = control_subscriptions_.find(control_id);
+  if (subscription != control_subscriptions_.end())
+    return subscription->second;
+
+  /* Volatile controls, e.g. a gain computed by the sensor, change without
+   * any event: they are always read from the device.
+   */
+  v4l2_query_ext_ctrl query;
+  if (QueryControl(control_id, &query) == 0 &&
+      (query.flags & V4L2_CTRL_FLAG_VOLATILE)) {
+    control_subscriptions_[control_id] = false;
+    return false;
+  }
+
+  v4l2_event_subscription sub;
+  memset(&sub, 0, sizeof(sub));
+  sub.type = V4L2_EVENT_CTRL;
+  sub.id = control_id;
+
+  bool subscribed = ioctlLocked(VIDIOC_SUBSCRIBE_EVENT, &sub) == 0;
+  if (!subscribed) {
+    ALOGV("%s: control %u changes are not reported (%s), it is not cached",
+              __FUNCTION__, control_id, strerror(errno));
+  }
+
+  control_subscriptions_[control_id] = subscribed;
+  return subscribed;
+}
+
+void V4L2Wrapper::DrainControlEventsLocked() {
+  /* The shadow values depend on the events too, whatever is cached */
+  if (!Connected())
+    return;
+
+  struct pollfd fds;
+  memset(&fds, 0, sizeof(fds));
+  fds.fd = device_fd_.get();
+  fds.events = POLLPRI;
+  if (TEMP_FAILURE_RETRY(poll(&fds, 1, 0)) <= 0 || !(fds.revents & POLLPRI))
+    return;
+
+  v4l2_event event;
+  memset(&event, 0, sizeof(event));
+  while (ioctlLocked(VIDIOC_DQEVENT, &event) == 0) {
+    if (event.type == V4L2_EVENT_CTRL &&
+        (event.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE)) {
+      /* The value was changed by the driver or another file handle, the
+       * value last set by this one is not current anymore.
+       */
+      control_shadow_.erase(event.id);
+      if (event.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64)
+        control_cache_.erase(event.id);
+      else
+        control_cache_[event.id] = event.u.ctrl.value;
+    }
+
+    if (!event.pending)
+      break;
+  }
+}
+
 int V4L2Wrapper::SetControl(uint32_t control_id,
                             int32_t desired,
                             int32_t* result) {
+  std::lock_guard lock(controls_lock_);
   int32_t result_value = 0;
 
   /* TODO(b/29334616): When async, this may need to check if the stream
@@ -291,22 +470,22 @@ int V4L2Wrapper::SetControl(uint32_t control_id,
    * For extended controls (any control class other than "user"),
    * S_EXT_CTRL must be used instead of S_CTRL.
    */
-  if (V4L2_CTRL_ID2CLASS(control_id) != V4L2_CTRL_CLASS_USER) {
+  DrainControlEventsLocked();
+
+  auto shadow = control_shadow_.find(control_id);
+  if (CanSkipControlLocked(control_id, desired)) {
+    /* Already set, the driver keeps the value. */
+    result_value = shadow->second.applied;
+  } else if (V4L2_CTRL_ID2CLASS(control_id) != V4L2_CTRL_CLASS_USER) {
     v4l2_ext_control control;
-    v4l2_ext_controls controls;
     memset(&control, 0, sizeof(control));
-    memset(&controls, 0, sizeof(controls));
 
     control.id = control_id;
     control.value = desired;
-    controls.ctrl_class = V4L2_CTRL_ID2CLASS(control_id);
-    controls.count = 1;
-    controls.controls = &control;
 
-    if (ioctlLocked(VIDIOC_S_EXT_CTRLS, &controls) < 0) {
-      ALOGE("%s: S_EXT_CTRLS fails: %s", __FUNCTION__, strerror(errno));
-      return -ENODEV;
-    }
+    int res = SetControlClassLocked(&control, 1);
+    if (res)
+      return res;
 
     result_value = control.value;
   } else {
@@ -314,10 +493,15 @@ int V4L2Wrapper::SetControl(uint32_t control_id,
 
     if (ioctlLocked(VIDIOC_S_CTRL, &control) < 0) {
       ALOGE("%s: S_CTRL fails: %s", __FUNCTION__, strerror(errno));
+      control_shadow_.erase(control_id);
+      control_cache_.erase(control_id);
       return -ENODEV;
     }
 
     result_value = control.value;
+    control_shadow_[control_id] = {desired, result_value};
+    if (control_cache_.count(control_id))
+      control_cache_[control_id] = result_value;
   }
 
   /* If the caller wants to know the result, pass it back. */
@@ -327,6 +511,255 @@ int V4L2Wrapper::SetControl(uint32_t control_id,
   return 0;
 }
 
+/*
+ *  This method tells whether setting |control_id| to |desired| can be
+ *  skipped: the value last set is still current. Only the subscribed
+ *  controls qualify, the changes of the others not being reported. They are
+ *  subscribed here on their first set. The pending events must have been
+ *  applied first, see DrainControlEventsLocked().
+ *
+ *  @return true if the control is already set to |desired|
+ *
+ */
+bool V4L2Wrapper::CanSkipControlLocked(uint32_t control_id, int32_t desired) {
+  if (!SubscribeControlLocked(control_id))
+    return false;
+
+  auto shadow = control_shadow_.find(control_id);
+  return shadow != control_shadow_.end() && shadow->second.desired == desired;
+}
+
+int V4L2Wrapper::SetControlClassLocked(v4l2_ext_control* controls,
+                                       uint32_t count) {
+  std::vector<int32_t> desired(count);
+  for (uint32_t i = 0; i < count; ++i)
+    desired[i] = controls[i].value;
+
+  v4l2_ext_controls ext_controls;
+  memset(&ext_controls, 0, sizeof(ext_controls));
+  ext_controls.ctrl_class = V4L2_CTRL_ID2CLASS(controls[0].id);
+  ext_controls.count = count;
+  ext_controls.controls = controls;
+
+  if (ioctlLocked(VIDIOC_S_EXT_CTRLS, &ext_controls) < 0) {
+    ALOGE("%s: S_EXT_CTRLS fails for class 0x%x: %s", __FUNCTION__,
+              ext_controls.ctrl_class, strerror(errno));
+    /* Part of the controls may have been set, forget their values. */
+    for (uint32_t i = 0; i < count; ++i) {
+      control_shadow_.erase(controls[i].id);
+      control_cache_.erase(controls[i].id);
+    }
+    return -ENODEV;
+  }
+
+  /* Changes made through this file handle raise no event for it. */
+  for (uint32_t i = 0; i < count; ++i) {
+    control_shadow_[controls[i].id] = {desired[i], controls[i].value};
+    if (control_cache_.count(controls[i].id))
+      control_cache_[controls[i].id] = controls[i].value;
+  }
+
+  return 0;
+}
+
+void V4L2Wrapper::BeginControls() {
+  std::lock_guard lock(controls_lock_);
+
+  in_transaction_ = true;
+  staged_controls_.clear();
+}
+
+int V4L2Wrapper::StageControl(uint32_t control_id, int32_t desired) {
+  {
+    std::lock_guard lock(controls_lock_);
+    if (in_transaction_) {
+      staged_controls_[control_id] = desired;
+      return 0;
+    }
+  }
+
+  return SetControl(control_id, desired);
+}
+
+/*
+ *  This method sets the controls staged since BeginControls(), skipping the
+ *  ones already set to the same value. All the classes are attempted even if
+ *  one of them fails. When media requests are enabled, the controls are
+ *  stored in the request of the next queued buffer instead.
+ *
+ *  @return 0 on success
+ *          -ENODEV if a class of controls could not be set
+ *
+ */
+int V4L2Wrapper::CommitControls() {
+  bool requests = RequestsEnabled();
+
+  std::lock_guard lock(controls_lock_);
+  std::vector<v4l2_ext_control> controls;
+  int res = 0;
+
+  in_transaction_ = false;
+
+  /* With media requests, the controls go with the next queued buffer. */
+  if (requests) {
+    for (const auto& [control_id, desired] : staged_controls_)
+      request_controls_[control_id] = desired;
+    staged_controls_.clear();
+    return 0;
+  }
+
+  DrainControlEventsLocked();
+
+  for (const auto& [control_id, desired] : staged_controls_) {
+    if (CanSkipControlLocked(control_id, desired))
+      continue;
+
+    v4l2_ext_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = control_id;
+    control.value = desired;
+    controls.push_back(control);
+  }
+  staged_controls_.clear();
+
+  /* Staged controls are sorted by id, so each class is contiguous. */
+  for (size_t first = 0; first < controls.size();) {
+    size_t last = first + 1;
+    while (last < controls.size() &&
+           V4L2_CTRL_ID2CLASS(controls[last].id) ==
+               V4L2_CTRL_ID2CLASS(controls[first].id))
+      ++last;
+
+    if (SetControlClassLocked(&controls[first], last - first))
+      res = -ENODEV;
+
+    first = last;
+  }
+
+  ALOGV("%s: %zu controls set", __FUNCTION__, controls.size());
+  return res;
+}
+
+/*
+ *  This method stores the controls committed since the previous queued
+ *  buffer in the media request |request_fd|. All the controls are set with
+ *  one S_EXT_CTRLS, and none is skipped: they only apply to the frame of the
+ *  request.
+ *
+ *  @return 0 on success
+ *          -ENODEV if the controls could not be stored
+ *
+ */
+int V4L2Wrapper::StoreRequestControls(int request_fd) {
+  std::lock_guard lock(controls_lock_);
+  std::vector<v4l2_ext_control> controls;
+
+  for (const auto& [control_id, desired] : request_controls_) {
+    v4l2_ext_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = control_id;
+    control.value = desired;
+    controls.push_back(control);
+  }
+  request_controls_.clear();
+
+  if (controls.empty())
+    return 0;
+
+  v4l2_ext_controls ext_controls;
+  memset(&ext_controls, 0, sizeof(ext_controls));
+  ext_controls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+  ext_controls.request_fd = request_fd;
+  ext_controls.count = controls.size();
+  ext_controls.controls = controls.data();
+
+  if (ioctlLocked(VIDIOC_S_EXT_CTRLS, &ext_controls) < 0) {
+    ALOGE("%s: S_EXT_CTRLS fails for request %d: %s", __FUNCTION__,
+              request_fd, strerror(errno));
+    return -ENODEV;
+  }
+
+  /* The values set by the previous requests are not current anymore. */
+  for (const v4l2_ext_control& control : controls) {
+    control_shadow_.erase(control.id);
+    control_cache_.erase(control.id);
+  }
+
+  return 0;
+}
+
+/*
+ *  This method allocates one media request per buffer requested through
+ *  REQBUFS.
+ *
+ *  @return 0 on success
+ *          -EINVAL if the buffers do not support requests
+ *          -ENODEV if the media device or the requests are not available
+ *
+ */
+int V4L2Wrapper::EnableRequests(const std::string& media_path) {
+  if (!supports_requests_) {
+    ALOGE("%s: %s buffers do not support requests",
+              __FUNCTION__, device_path_.c_str());
+    return -EINVAL;
+  }
+
+  DisableRequests();
+
+  std::lock_guard lock(buffer_lock_);
+  int fd = TEMP_FAILURE_RETRY(open(media_path.c_str(), O_RDWR));
+  if (fd < 0) {
+    ALOGE("%s: failed to open %s (%s)",
+              __FUNCTION__, media_path.c_str(), strerror(errno));
+    return -ENODEV;
+  }
+  media_fd_.reset(fd);
+
+  for (size_t i = 0; i < buffer_slots_.size(); ++i) {
+    int request_fd = -1;
+    if (TEMP_FAILURE_RETRY(ioctl(media_fd_.get(), MEDIA_IOC_REQUEST_ALLOC,
+                                 &request_fd)) < 0) {
+      ALOGE("%s: MEDIA_IOC_REQUEST_ALLOC fails: %s",
+                __FUNCTION__, strerror(errno));
+      requests_.clear();
+      media_fd_.reset(-1);
+      return -ENODEV;
+    }
+    requests_.emplace_back(request_fd);
+  }
+
+  ALOGI("%s: %s queues %zu buffers through media requests",
+            __FUNCTION__, device_path_.c_str(), requests_.size());
+  return 0;
+}
+
+void V4L2Wrapper::DisableRequests() {
+  std::lock_guard lock(buffer_lock_);
+
+  requests_.clear();
+  media_fd_.reset(-1);
+}
+
+bool V4L2Wrapper::RequestsEnabled() {
+  std::lock_guard lock(buffer_lock_);
+
+  return !requests_.empty();
+}
+
+int V4L2Wrapper::GetCapability(v4l2_capability* cap) {
+  if (!Connected()) {
+    ALOGE("%s: device is not connected", __FUNCTION__);
+    return -ENODEV;
+  }
+
+  *cap = capability_;
+  return 0;
+}
+
+uint32_t V4L2Wrapper::GetBufferType() {
+  return buffer_type_;
+}
+
 int V4L2Wrapper::GetSupportedFormats(const std::set<uint32_t>& v4l2_formats,
                                                        StreamFormats *formats) {
   ALOGV("%s: enter", __FUNCTION__);
@@ -342,7 +775,8 @@ int V4L2Wrapper::GetSupportedFormats(const std::set<uint32_t>& v4l2_formats,
     }
 
     for (auto frame_size : frame_sizes) {
-      formats->emplace_back(v4l2_format, frame_size[0], frame_size[1]);
+      formats->emplace_back(v4l2_format, frame_size[0], frame_size[1],
+                            buffer_type_);
     }
   }
 
@@ -355,8 +789,7 @@ int V4L2Wrapper::GetFormats(std::set<uint32_t>* v4l2_formats) {
   v4l2_fmtdesc format_query;
 
   memset(&format_query, 0, sizeof(format_query));
-  // TODO(b/30000211): multiplanar support.
-  format_query.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format_query.type = buffer_type_;
 
   while (ioctlLocked(VIDIOC_ENUM_FMT, &format_query) >= 0) {
     v4l2_formats->insert(format_query.pixelformat);
@@ -440,6 +873,13 @@ int V4L2Wrapper::GetFormatFrameSizes(uint32_t v4l2_format,
   return 0;
 }
 
+// Converts a clock_gettime() reading to ns.
+inline int64_t clockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 // Converts a v4l2_fract with units of seconds to an int64_t with units of ns.
 inline int64_t fractToNs(const v4l2_fract& fract) {
   return (1000000000LL * fract.numerator) / fract.denominator;
@@ -489,9 +929,75 @@ int V4L2Wrapper::GetFormatFrameDurationRange(
   return 0;
 }
 
+int V4L2Wrapper::TryFormat(const StreamFormat& desired,
+                           StreamFormat* result) {
+  StreamFormat device_format(desired.v4l2_pixel_format(), desired.width(),
+                             desired.height(), buffer_type_);
+  v4l2_format try_format;
+
+  device_format.FillFormatRequest(&try_format);
+
+  if (ioctlLocked(VIDIOC_TRY_FMT, &try_format) < 0) {
+    ALOGV("%s: TRY_FMT failed: %s", __FUNCTION__, strerror(errno));
+    return -ENODEV;
+  }
+
+  *result = StreamFormat(try_format);
+  return 0;
+}
+
+/*
+ *  This method sets the capture frame interval.
+ *
+ *  @return 0 on success
+ *          -EOPNOTSUPP if the driver has no frame interval control
+ *          -ENODEV if unexptected error occured
+ *
+ */
+int V4L2Wrapper::SetFrameDuration(int64_t duration, int64_t* applied) {
+  v4l2_streamparm parm;
+
+  memset(&parm, 0, sizeof(parm));
+  parm.type = buffer_type_;
+
+  if (ioctlLocked(VIDIOC_G_PARM, &parm) < 0 ||
+      !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+    ALOGV("%s: frame interval not supported", __FUNCTION__);
+    return -EOPNOTSUPP;
+  }
+
+  /* Durations are expressed in us, which is precise enough for the driver. */
+  uint32_t numerator = static_cast<uint32_t>(duration / 1000);
+  uint32_t denominator = 1000000;
+  uint32_t divisor = std::gcd(numerator, denominator);
+  if (divisor == 0) {
+    ALOGE("%s: invalid duration %" PRId64, __FUNCTION__, duration);
+    return -EINVAL;
+  }
+
+  parm.parm.capture.timeperframe.numerator = numerator / divisor;
+  parm.parm.capture.timeperframe.denominator = denominator / divisor;
+
+  if (ioctlLocked(VIDIOC_S_PARM, &parm) < 0) {
+    ALOGE("%s: S_PARM failed: %s", __FUNCTION__, strerror(errno));
+    return -ENODEV;
+  }
+
+  if (applied && parm.parm.capture.timeperframe.denominator)
+    *applied = fractToNs(parm.parm.capture.timeperframe);
+
+  return 0;
+}
+
 int V4L2Wrapper::SetFormat(const StreamFormat& resolved_format) {
   ALOGV("%s: enter", __FUNCTION__);
-  if (format_ && resolved_format == *format_) {
+
+  // The format is requested with the buffer type of the device.
+  StreamFormat device_format(resolved_format.v4l2_pixel_format(),
+                             resolved_format.width(),
+                             resolved_format.height(), buffer_type_);
+
+  if (format_ && device_format == *format_) {
     ALOGV("%s: Already in correct format, skipping format setting.", __FUNCTION__);
     return 0;
   }
@@ -499,7 +1005,7 @@ int V4L2Wrapper::SetFormat(const StreamFormat& resolved_format) {
   // Set the camera to the new format.
   v4l2_format new_format;
 
-  resolved_format.FillFormatRequest(&new_format);
+  device_format.FillFormatRequest(&new_format);
 
   // TODO(b/29334616): When async, this will need to check if the stream
   // is on, and if so, lock it off while setting format.
@@ -509,23 +1015,46 @@ int V4L2Wrapper::SetFormat(const StreamFormat& resolved_format) {
   }
 
   // Check that the driver actually set to the requested values.
-  if (resolved_format != new_format) {
+  if (device_format != new_format) {
     ALOGE("%s: Device doesn't support desired stream config.", __FUNCTION__);
     return -EINVAL;
   }
 
   // Keep track of our new format.
   format_.reset(new StreamFormat(new_format));
-  buffer_size_ = new_format.fmt.pix.sizeimage;
+
+  plane_sizes_.clear();
+  plane_strides_.clear();
+  if (V4L2_TYPE_IS_MULTIPLANAR(buffer_type_)) {
+    for (uint32_t i = 0; i < new_format.fmt.pix_mp.num_planes; ++i) {
+      plane_sizes_.push_back(new_format.fmt.pix_mp.plane_fmt[i].sizeimage);
+      plane_strides_.push_back(
+          new_format.fmt.pix_mp.plane_fmt[i].bytesperline);
+    }
+  } else {
+    plane_sizes_.push_back(new_format.fmt.pix.sizeimage);
+    plane_strides_.push_back(new_format.fmt.pix.bytesperline);
+  }
+
+  buffer_size_ = 0;
+  for (uint32_t plane_size : plane_sizes_)
+    buffer_size_ += plane_size;
 
   return 0;
 }
 
-int V4L2Wrapper::RequestBuffers(uint32_t num_requested, uint32_t *num_done, uint32_t *buffer_size) {
+int V4L2Wrapper::RequestBuffers(uint32_t num_requested, uint32_t *num_done,
+                                uint32_t *buffer_size, uint32_t memory) {
   v4l2_requestbuffers req_buffers;
   int res = 0;
 
-  ALOGV("%s: requesting %d buffers", __FUNCTION__, num_requested);
+  ALOGV("%s: requesting %d buffers (memory %d)",
+            __FUNCTION__, num_requested, memory);
+
+  if (memory != V4L2_MEMORY_MMAP && memory != V4L2_MEMORY_DMABUF) {
+    ALOGE("%s: unsupported memory type %d", __FUNCTION__, memory);
+    return -EINVAL;
+  }
 
   if (!format_) {
     ALOGE("%s: requesting buffer but no format was set", __FUNCTION__);
@@ -535,7 +1064,7 @@ int V4L2Wrapper::RequestBuffers(uint32_t num_requested, uint32_t *num_done, uint
   /* Request new buffers */
   memset(&req_buffers, 0, sizeof(req_buffers));
   req_buffers.type = format_->type();
-  req_buffers.memory = V4L2_MEMORY_MMAP;
+  req_buffers.memory = memory;
   req_buffers.count = num_requested;
 
   res = ioctlLocked(VIDIOC_REQBUFS, &req_buffers);
@@ -552,6 +1081,17 @@ int V4L2Wrapper::RequestBuffers(uint32_t num_requested, uint32_t *num_done, uint
     return -ENODEV;
   }
 
+  memory_ = memory;
+  supports_requests_ =
+      (req_buffers.capabilities & V4L2_BUF_CAP_SUPPORTS_REQUESTS) != 0;
+
+  /* The requests were allocated for the previous buffers. */
+  DisableRequests();
+
+  res = InitBufferDescriptors(req_buffers.count);
+  if (res)
+    return res;
+
   if (num_done) {
     *num_done = req_buffers.count;
   }
@@ -564,6 +1104,10 @@ int V4L2Wrapper::RequestBuffers(uint32_t num_requested, uint32_t *num_done, uint
 }
 
 int V4L2Wrapper::ExportBuffer(uint32_t index, int32_t *fd) {
+  return ExportBuffer(index, 0, fd);
+}
+
+int V4L2Wrapper::ExportBuffer(uint32_t index, uint32_t plane, int32_t *fd) {
   struct v4l2_exportbuffer expbuf;
 
   if (!format_) {
@@ -571,9 +1115,15 @@ int V4L2Wrapper::ExportBuffer(uint32_t index, int32_t *fd) {
     return -EPERM;
   }
 
+  if (plane >= plane_sizes_.size()) {
+    ALOGE("%s: invalid plane %u", __FUNCTION__, plane);
+    return -EINVAL;
+  }
+
   memset(&expbuf, 0, sizeof(expbuf));
   expbuf.type = format_->type();
   expbuf.index = index;
+  expbuf.plane = plane;
 
   int res = ioctlLocked(VIDIOC_EXPBUF, &expbuf);
 
@@ -589,53 +1139,176 @@ int V4L2Wrapper::ExportBuffer(uint32_t index, int32_t *fd) {
   return 0;
 }
 
+std::vector<uint32_t> V4L2Wrapper::GetPlaneSizes() {
+  return plane_sizes_;
+}
+
+std::vector<uint32_t> V4L2Wrapper::GetPlaneStrides() {
+  return plane_strides_;
+}
+
 /*
+ *  This method queries the driver once for each buffer allocated by REQBUFS
+ *  and keeps the result, which is reused every time the buffer is queued.
  *
  */
-int V4L2Wrapper::EnqueueRequest(uint32_t index) {
-  if (!format_) {
-    ALOGE("%s: Stream format must be set before enqueuing buffers.", __FUNCTION__);
-    return -ENODEV;
-  }
+int V4L2Wrapper::InitBufferDescriptors(uint32_t num_buffers) {
+  std::lock_guard lock(buffer_lock_);
+
+  buffer_slots_.assign(num_buffers, BufferSlot());
+  for (uint32_t i = 0; i < num_buffers; ++i) {
+    v4l2_buffer& device_buffer = buffer_slots_[i].descriptor;
+
+    memset(&device_buffer, 0, sizeof(device_buffer));
+    device_buffer.type = format_->type();
+    device_buffer.memory = memory_;
+    device_buffer.index = i;
+    buffer_slots_[i].queued = false;
+
+    /* Multi-planar buffers describe their planes in a separate array. */
+    std::vector<v4l2_plane>& planes = buffer_slots_[i].planes;
+    if (V4L2_TYPE_IS_MULTIPLANAR(device_buffer.type)) {
+      planes.assign(plane_sizes_.size(), v4l2_plane());
+      device_buffer.m.planes = planes.data();
+      device_buffer.length = planes.size();
+    }
 
-  /* Set up a v4l2 buffer struct. */
-  v4l2_buffer device_buffer;
+    /* Imported buffers are described when they are queued. */
+    if (memory_ == V4L2_MEMORY_DMABUF)
+      continue;
 
-  memset(&device_buffer, 0, sizeof(device_buffer));
-  device_buffer.type = format_->type();
-  device_buffer.index = index;
+    if (ioctlLocked(VIDIOC_QUERYBUF, &device_buffer) < 0) {
+      ALOGE("%s: QUERYBUF fails: %s", __FUNCTION__, strerror(errno));
+      buffer_slots_.clear();
+      return -ENODEV;
+    }
+  }
 
-  /* Use QUERYBUF to ensure our buffer/device is in good shape,
-   * and fill out remaining fields.
-   */
-  if (ioctlLocked(VIDIOC_QUERYBUF, &device_buffer) < 0) {
-    ALOGE("%s: QUERYBUF fails: %s", __FUNCTION__, strerror(errno));
-    return -ENODEV;
+  return 0;
+}
+
+int V4L2Wrapper::QueueBufferLocked(uint32_t index, int dmabuf_fd,
+                                   uint32_t length) {
+  if (index >= buffer_slots_.size()) {
+    ALOGE("%s: invalid buffer index %u", __FUNCTION__, index);
+    return -EINVAL;
   }
 
-  if (device_buffer.flags & V4L2_BUF_FLAG_QUEUED) {
+  BufferSlot& slot = buffer_slots_[index];
+  if (slot.queued) {
     ALOGE("%s: buffer already queued", __FUNCTION__);
     return -EAGAIN;
   }
 
+  /* QBUF updates the structure it is given, keep the descriptor intact. */
+  v4l2_buffer device_buffer = slot.descriptor;
+  std::vector<v4l2_plane> planes = slot.planes;
+  if (V4L2_TYPE_IS_MULTIPLANAR(device_buffer.type))
+    device_buffer.m.planes = planes.data();
+
+  if (memory_ == V4L2_MEMORY_DMABUF) {
+    if (V4L2_TYPE_IS_MULTIPLANAR(device_buffer.type)) {
+      /* A single dma-buf can only back a single plane format. */
+      if (planes.size() != 1) {
+        ALOGE("%s: cannot import a %zu planes buffer", __FUNCTION__,
+                  planes.size());
+        return -EINVAL;
+      }
+      planes[0].m.fd = dmabuf_fd;
+      planes[0].length = length;
+    } else {
+      device_buffer.m.fd = dmabuf_fd;
+      device_buffer.length = length;
+    }
+  }
+
+  int request_fd = index < requests_.size() ? requests_[index].get() : -1;
+  if (request_fd >= 0) {
+    /* The controls of this frame are bound to its request. */
+    int res = StoreRequestControls(request_fd);
+    if (res)
+      return res;
+
+    device_buffer.flags |= V4L2_BUF_FLAG_REQUEST_FD;
+    device_buffer.request_fd = request_fd;
+  }
+
   /* Pass the buffer to the camera. */
   if (ioctlLocked(VIDIOC_QBUF, &device_buffer) < 0) {
     ALOGE("%s: QBUF fails: %s", __FUNCTION__, strerror(errno));
     return -ENODEV;
   }
 
+  /* With requests, the buffer only reaches the driver with its request. */
+  if (request_fd >= 0 &&
+      TEMP_FAILURE_RETRY(ioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE)) < 0) {
+    ALOGE("%s: MEDIA_REQUEST_IOC_QUEUE fails: %s", __FUNCTION__,
+              strerror(errno));
+    TEMP_FAILURE_RETRY(ioctl(request_fd, MEDIA_REQUEST_IOC_REINIT));
+    return -ENODEV;
+  }
+
+  slot.queued = true;
   return 0;
 }
 
 /*
- *  This method asks to the V4L2 driver for a completed capture buffer.
+ *  This method queues a buffer allocated by the driver.
  *
  *  @return 0 on success
+ *          -EINVAL if the index is not a requested buffer
+ *          -EAGAIN if the buffer is already queued
+ *          -ENODEV if unexptected error occured
+ *
+ */
+int V4L2Wrapper::EnqueueRequest(uint32_t index) {
+  if (!format_) {
+    ALOGE("%s: Stream format must be set before enqueuing buffers.", __FUNCTION__);
+    return -ENODEV;
+  }
+
+  std::lock_guard lock(buffer_lock_);
+  return QueueBufferLocked(index, -1, 0);
+}
+
+/*
+ *  This method queues a buffer allocated outside of the driver. The driver
+ *  directly writes the captured frame into |dmabuf_fd|.
+ *
+ *  @return 0 on success
+ *          -EINVAL if the buffers were not requested in DMABUF mode
+ *          -EAGAIN if the buffer is already queued
+ *          -ENODEV if unexptected error occured
+ *
+ */
+int V4L2Wrapper::EnqueueDmabufRequest(uint32_t index, int dmabuf_fd,
+                                      uint32_t length) {
+  if (!format_) {
+    ALOGE("%s: Stream format must be set before enqueuing buffers.", __FUNCTION__);
+    return -ENODEV;
+  }
+
+  if (memory_ != V4L2_MEMORY_DMABUF) {
+    ALOGE("%s: buffers were not requested in DMABUF mode", __FUNCTION__);
+    return -EINVAL;
+  }
+
+  std::lock_guard lock(buffer_lock_);
+  return QueueBufferLocked(index, dmabuf_fd, length);
+}
+
+/*
+ *  This method asks to the V4L2 driver for a completed capture buffer.
+ *  |timestamp| receives the time the driver captured the frame, converted to
+ *  CLOCK_BOOTTIME.
+ *
+ *  @return the number of bytes used in the buffer on success
  *          -EAGAIN if no buffer were available
  *          -ENODEV if unexptected error occured
  *
  */
-int V4L2Wrapper::DequeueRequest(uint32_t *index) {
+int V4L2Wrapper::DequeueRequest(uint32_t *index, int64_t *timestamp,
+                                std::vector<uint32_t> *plane_bytesused) {
   if (!format_) {
     ALOGV("%s: Format not set, so stream can't be on, so no buffers available "
             "for dequeueing", __FUNCTION__);
@@ -643,10 +1316,17 @@ int V4L2Wrapper::DequeueRequest(uint32_t *index) {
   }
 
   v4l2_buffer device_buffer;
+  v4l2_plane planes[VIDEO_MAX_PLANES];
 
   memset(&device_buffer, 0, sizeof(device_buffer));
   device_buffer.type = format_->type();
-  device_buffer.memory = V4L2_MEMORY_MMAP;
+  device_buffer.memory = memory_;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR(device_buffer.type)) {
+    memset(planes, 0, sizeof(planes));
+    device_buffer.m.planes = planes;
+    device_buffer.length = VIDEO_MAX_PLANES;
+  }
 
   int res = ioctlLocked(VIDIOC_DQBUF, &device_buffer);
 
@@ -661,13 +1341,103 @@ int V4L2Wrapper::DequeueRequest(uint32_t *index) {
     }
   }
 
+  {
+    std::lock_guard lock(buffer_lock_);
+    if (device_buffer.index < buffer_slots_.size())
+      buffer_slots_[device_buffer.index].queued = false;
+
+    /* The request is completed with its buffer, it can be reused. */
+    if (device_buffer.index < requests_.size() &&
+        TEMP_FAILURE_RETRY(ioctl(requests_[device_buffer.index].get(),
+                                 MEDIA_REQUEST_IOC_REINIT)) < 0) {
+      ALOGE("%s: MEDIA_REQUEST_IOC_REINIT fails: %s", __FUNCTION__,
+                strerror(errno));
+    }
+  }
+
   if (index != nullptr) {
     *index = device_buffer.index;
   }
 
+  if (timestamp != nullptr) {
+    *timestamp = device_buffer.timestamp.tv_sec * 1000000000LL +
+                 device_buffer.timestamp.tv_usec * 1000LL;
+
+    /* The drivers timestamp with CLOCK_MONOTONIC, which does not count the
+     * time spent in suspend. The offset is sampled at dequeue, which is close
+     * enough to the capture since no suspend can occur while streaming.
+     */
+    if ((device_buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+            V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+      *timestamp += clockNs(CLOCK_BOOTTIME) - clockNs(CLOCK_MONOTONIC);
+    } else {
+      /* No usable timestamp from the driver. */
+      *timestamp = clockNs(CLOCK_BOOTTIME);
+    }
+  }
+
+  if (V4L2_TYPE_IS_MULTIPLANAR(device_buffer.type)) {
+    uint32_t bytesused = 0;
+    if (plane_bytesused != nullptr)
+      plane_bytesused->clear();
+
+    for (uint32_t i = 0; i < device_buffer.length; ++i) {
+      bytesused += planes[i].bytesused;
+      if (plane_bytesused != nullptr)
+        plane_bytesused->push_back(planes[i].bytesused);
+    }
+
+    return bytesused;
+  }
+
+  if (plane_bytesused != nullptr)
+    *plane_bytesused = {device_buffer.bytesused};
+
   return device_buffer.bytesused;
 }
 
+/*
+ *  This method waits for the V4L2 driver to have a completed capture buffer
+ *  available, without polling DQBUF.
+ *
+ *  @return 0 if a buffer can be dequeued (or the device reported an error,
+ *            which will be returned by the next DQBUF)
+ *          -EINTR if woken up through |wakeup_fd|
+ *          -EAGAIN if |timeout_ms| elapsed
+ *          -ENODEV if unexptected error occured
+ *
+ */
+int V4L2Wrapper::WaitForBuffer(int wakeup_fd, int timeout_ms) {
+  if (!Connected()) {
+    ALOGE("%s: Device %s not connected.", __FUNCTION__, device_path_.c_str());
+    return -ENODEV;
+  }
+
+  struct pollfd fds[2];
+  memset(fds, 0, sizeof(fds));
+  fds[0].fd = device_fd_.get();
+  fds[0].events = POLLIN;
+  fds[1].fd = wakeup_fd;
+  fds[1].events = POLLIN;
+
+  int res = TEMP_FAILURE_RETRY(poll(fds, wakeup_fd >= 0 ? 2 : 1, timeout_ms));
+  if (res < 0) {
+    ALOGE("%s: poll fails: %s", __FUNCTION__, strerror(errno));
+    return -ENODEV;
+  }
+
+  if (res == 0)
+    return -EAGAIN;
+
+  if (wakeup_fd >= 0 && (fds[1].revents & POLLIN)) {
+    uint64_t count;
+    TEMP_FAILURE_RETRY(read(wakeup_fd, &count, sizeof(count)));
+    return -EINTR;
+  }
+
+  return 0;
+}
+
 } // v4l2
 } // V1_0
 } // common
@@ -82,6 +82,12 @@ public:
 
 private:
   Status initialize();
+  void updateMinFrameDurations(CameraMetadataHelper *metadata);
+  void updateTargetFpsRanges(CameraMetadataHelper *metadata,
+                             const std::vector<int64_t> &durations);
+  void updateStallDurations(CameraMetadataHelper *metadata,
+                            const std::vector<int64_t> &durations);
+  void updatePartialResultCount(CameraMetadataHelper *metadata);
 
 private:
   V4l2CameraConfig config_;
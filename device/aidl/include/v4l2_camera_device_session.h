@@ -19,12 +19,18 @@
 
 #include <aidl/android/hardware/camera/common/Status.h>
 #include <aidl/android/hardware/camera/device/BnCameraDeviceSession.h>
+#include <aidl/android/hardware/camera/device/CameraBlob.h>
 #include <aidl/android/hardware/camera/device/ICameraDeviceCallback.h>
 
 #include <fmq/AidlMessageQueue.h>
 #include <cutils/properties.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 
 #include <metadata/metadata.h>
@@ -50,10 +56,12 @@ using aidl::android::hardware::common::fmq::SynchronizedReadWrite;
 using aidl::android::hardware::camera::common::Status;
 using aidl::android::hardware::camera::device::BnCameraDeviceSession;
 using aidl::android::hardware::camera::device::BufferCache;
+using aidl::android::hardware::camera::device::CameraBlob;
 using aidl::android::hardware::camera::device::ErrorCode;
 using aidl::android::hardware::camera::device::CameraMetadata;
 using aidl::android::hardware::camera::device::CameraOfflineSessionInfo;
 using aidl::android::hardware::camera::device::CaptureRequest;
+using aidl::android::hardware::camera::device::CaptureResult;
 using aidl::android::hardware::camera::device::HalStream;
 using aidl::android::hardware::camera::device::ICameraDeviceCallback;
 using aidl::android::hardware::camera::device::ICameraOfflineSession;
@@ -144,6 +152,81 @@ private:
 
   Status findBestStreamConfiguration(
       const Stream &stream, V4l2StreamConfig &res);
+  int32_t getJpegMaxSize(const Stream &stream);
+
+  /* A capture request accepted by processCaptureRequest(), waiting for its
+   * settings to be applied and its buffers to be queued to the driver.
+   */
+  struct PendingRequest {
+    int32_t frame_number;
+    std::shared_ptr<helper::CameraMetadata> settings;
+    /* The settings completed with the result metadata, for the streams */
+    std::shared_ptr<const helper::CameraMetadata> stream_settings;
+    std::vector<StreamBuffer> buffers;
+    /* When the request was accepted, CLOCK_MONOTONIC */
+    int64_t intake_time;
+  };
+
+  /* A buffer completed by its stream, not sent to the framework yet */
+  struct CompletedBuffer {
+    StreamBuffer buffer;
+    bool error;
+  };
+
+  /* A request whose buffers are queued to the driver. Its shutter and final
+   * result metadata are sent when its first buffer is captured, in frame
+   * order. With several partial results, the keys derived from the request
+   * are sent beforehand, as soon as it is applied.
+   */
+  struct InFlightRequest {
+    std::shared_ptr<helper::CameraMetadata> early_result;
+    std::shared_ptr<helper::CameraMetadata> result;
+    int64_t exposure_time = 0;
+    int64_t intake_time = 0;
+    bool result_valid = true;
+    bool early_sent = false;
+    bool failed = false;
+    bool error_sent = false;
+    bool shutter_sent = false;
+    int64_t timestamp = 0;
+    size_t pending_buffers = 0;
+    std::vector<CompletedBuffer> completed;
+  };
+
+  /* What is sent for a frame by the result thread in one batch */
+  struct FrameResult {
+    int32_t frame_number;
+    bool request_error;
+    bool request_failed;
+    bool shutter;
+    int64_t timestamp;
+    int64_t exposure_time;
+    /* Partial results, nullptr if not sent */
+    std::shared_ptr<helper::CameraMetadata> early_metadata;
+    std::shared_ptr<helper::CameraMetadata> metadata;
+    bool result_error;
+    /* Whether this is the first partial result of the frame */
+    bool first_partial;
+    int64_t intake_time;
+    std::vector<CompletedBuffer> buffers;
+  };
+
+  /* The settings last applied by the request thread, and the result
+   * metadata filled for them.
+   */
+  struct AppliedSettings {
+    std::shared_ptr<helper::CameraMetadata> settings;
+    std::shared_ptr<const helper::CameraMetadata> stream_settings;
+    std::shared_ptr<helper::CameraMetadata> early_result;
+    std::shared_ptr<helper::CameraMetadata> result;
+  };
+
+  /* Time from the intake of the requests to their first partial result */
+  struct PartialResultStats {
+    uint32_t count = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+  };
 
   void updateBufferCaches(const std::vector<BufferCache> &caches_to_remove);
   Status processOneCaptureRequest(const CaptureRequest &request);
@@ -151,14 +234,34 @@ private:
   Status processCaptureRequestMetadata(
       const CaptureRequest &request,
       std::shared_ptr<helper::CameraMetadata> &metadata);
-  Status processCaptureRequestEnqueue(
-      const CaptureRequest &request,
-      const std::shared_ptr<const helper::CameraMetadata> &settings);
-
-  void processCaptureMetadataResult(
-      int32_t frame_number, const helper::CameraMetadata &settings);
-
-  void processCaptureRequestError(const CaptureRequest &request, ErrorCode e);
+  std::shared_ptr<helper::CameraMetadata> acquireResultMetadata();
+  Status processCaptureRequestSettings(PendingRequest &pending,
+                                       InFlightRequest *request);
+  Status processCaptureRequestEnqueue(PendingRequest &pending,
+                                      size_t *num_queued);
+
+  void writeResultMetadata(const helper::CameraMetadata &metadata,
+                           CaptureResult *result);
+  void sendBufferResult(int32_t frame_number, StreamBuffer &&sb);
+
+  void processCaptureRequestError(int32_t frame_number, ErrorCode e);
+
+  /* Request pipeline */
+  void requestThread();
+  void processPendingRequest(PendingRequest &pending);
+  void failBuffersLocked(InFlightRequest *request,
+                         std::vector<StreamBuffer> &buffers, size_t first);
+  void completeBuffer(const V4l2Stream::TrackedStreamBuffer &tsb, bool error);
+  void resultThread();
+  void collectFrameResultsLocked(std::vector<FrameResult> *results);
+  FrameResult &getFrameResult(std::vector<FrameResult> *results,
+                              int32_t frame_number);
+  void updatePartialResultStats(int64_t intake_time);
+  bool hasIncompleteFramesLocked(const std::vector<FrameResult> &results);
+  void sendFrameResults(std::vector<FrameResult> &results);
+  void drainPipeline();
+  void failPendingRequestsLocked();
+  void stopPipeline();
 
   void ISPThread();
 
@@ -169,6 +272,21 @@ private:
   std::shared_ptr<Metadata> metadata_;
   std::shared_ptr<StaticProperties> static_info_;
   std::vector<uint8_t> previous_settings_;
+  /* Repeating requests: while their settings do not change, the requests
+   * share the ones validated for the first of them, which the request thread
+   * recognizes as already applied.
+   */
+  bool request_fast_path_;
+  std::shared_ptr<helper::CameraMetadata> last_request_settings_;
+  AppliedSettings applied_settings_;
+  /* The result metadata layout compiled for the configured streams, and the
+   * result metadata filled from it for the frames in the pipeline.
+   */
+  helper::CameraMetadata result_layout_;
+  /* Index of the timestamp in the layout, -1 if none */
+  ssize_t result_timestamp_index_;
+  std::mutex result_layout_mutex_;
+  std::vector<std::shared_ptr<helper::CameraMetadata>> result_pool_;
   std::unique_ptr<MetadataQueue> request_metadata_queue_;
   std::unique_ptr<MetadataQueue> result_metadata_queue_;
   std::unique_ptr<const CameraMetadataHelper> default_settings_[
@@ -180,6 +298,37 @@ private:
   std::condition_variable isp_cond_;
   std::mutex isp_mutex_;
 
+  /* Request pipeline: intake and validation on the binder thread, settings
+   * and driver enqueue on the request thread, capture and conversion on the
+   * stream threads, then results sent by the result thread. At most
+   * pipeline_depth_ requests are pending, being processed by the request
+   * thread or in flight.
+   */
+  uint32_t pipeline_depth_;
+  /* ANDROID_REQUEST_PARTIAL_RESULT_COUNT, at most 2 as clamped by the
+   * device: the result is split in an early and a final partial result if
+   * above 1.
+   */
+  int32_t partial_result_count_;
+  PartialResultStats partial_result_stats_;
+  /* How long the results wait for the other buffers of their frame, to be
+   * sent together.
+   */
+  std::chrono::microseconds result_batch_delay_;
+  bool pipeline_active_;
+  bool results_sending_;
+  std::mutex intake_mutex_;
+  std::mutex pipeline_mutex_;
+  std::condition_variable pipeline_cond_;
+  std::condition_variable request_cond_;
+  std::condition_variable result_cond_;
+  std::deque<PendingRequest> pending_requests_;
+  /* Requests taken from pending_requests_ and not in in_flight_ yet */
+  size_t requests_processing_;
+  std::map<int32_t, InFlightRequest> in_flight_;
+  std::unique_ptr<std::thread> request_thread_;
+  std::unique_ptr<std::thread> result_thread_;
+
   std::mutex flush_mutex_;
   std::mutex result_mutex_;
 
@@ -23,6 +23,7 @@
 #include <aidl/android/hardware/camera/device/StreamBuffer.h>
 #include <aidlcommonsupport/NativeHandle.h>
 
+#include <array>
 #include <unordered_map>
 #include <list>
 #include <queue>
@@ -30,8 +31,11 @@
 
 #include <CameraMetadata.h>
 
+#include <arc/cached_frame.h>
 #include <arc/frame_buffer.h>
 #include <helper/mapper_helper.h>
+#include <v4l2/media_graph.h>
+#include <v4l2/v4l2_capability_cache.h>
 #include <v4l2/v4l2_wrapper.h>
 
 #include "v4l2_stream_config.h"
@@ -52,8 +56,11 @@ using aidl::android::hardware::camera::device::Stream;
 using aidl::android::hardware::camera::device::StreamBuffer;
 
 using ::android::hardware::camera::common::V1_0::helper::MapperHelper;
+using ::android::hardware::camera::common::V1_0::v4l2::MediaGraph;
 using ::android::hardware::camera::common::V1_0::v4l2::StreamFormat;
 using ::android::hardware::camera::common::V1_0::v4l2::StreamFormats;
+using ::android::hardware::camera::common::V1_0::v4l2::V4L2Capabilities;
+using ::android::hardware::camera::common::V1_0::v4l2::V4L2CapabilityCache;
 using ::android::hardware::camera::common::V1_0::v4l2::V4L2Wrapper;
 
 class V4l2Stream {
@@ -67,6 +74,8 @@ public:
     native_handle_t *acquire_fence;
     native_handle_t *release_fence;
     std::shared_ptr<const helper::CameraMetadata> settings;
+    /* When the driver captured the frame, CLOCK_BOOTTIME */
+    int64_t timestamp;
   };
 
   struct CallbackInterface {
@@ -77,12 +86,16 @@ public:
   };
 
 public:
-  static std::shared_ptr<V4l2Stream> Create(const V4l2StreamConfig& config,
-                                            const Stream &stream,
-                                            CallbackInterface *cb);
+  /* |fps_range| is the AE target FPS range expected for the stream, {0, 0}
+   * if unknown.
+   */
+  static std::shared_ptr<V4l2Stream> Create(
+      const V4l2StreamConfig& config, const Stream &stream,
+      CallbackInterface *cb,
+      const std::array<int32_t, 2> &fps_range = {0, 0});
 
   V4l2Stream(const V4l2StreamConfig& config, const Stream &stream,
-             CallbackInterface *cb);
+             CallbackInterface *cb, const std::array<int32_t, 2> &fps_range);
   virtual ~V4l2Stream();
 
   const V4l2StreamConfig &configuration() const { return config_; }
@@ -90,6 +103,18 @@ public:
 
   void setUsage(const BufferUsage &usage) { stream_.usage = usage; }
 
+  /* Size of the BLOB buffers, including the transport header */
+  void setBlobBufferSize(uint32_t size) { blob_buffer_size_ = size; }
+
+  /* Whether the driver captures directly into the framework buffers */
+  bool isZeroCopy() const { return memory_ == V4L2_MEMORY_DMABUF; }
+
+  /* Control transaction of the stream device: the V4L2 controls staged on
+   * it in between are set together.
+   */
+  void beginControls() { v4l2_wrapper_->BeginControls(); }
+  int commitControls() { return v4l2_wrapper_->CommitControls(); }
+
   bool isCompatible(const Stream& stream);
   Status update(const Stream& stream);
 
@@ -106,17 +131,33 @@ private:
   Status initialize();
   Status configureDriver();
   Status configurePipeline(const StreamFormat &format);
+  Status configureBuffers(const StreamFormat &format);
+  bool canImportBuffers(const StreamFormat &format);
+  Status fallbackToMmap();
 
   Status findBestFitFormat(const Stream &stream, StreamFormat *stream_format);
+  Status findScaledFormat(uint32_t format, uint32_t width, uint32_t height,
+                          StreamFormat *stream_format);
+  int getPipelineSubdev(std::shared_ptr<MediaGraph> *graph,
+                        MediaGraph::Subdev *subdev);
+  bool supportsFrameRate(const StreamFormat &format);
+  void configureFrameRate();
+  void updateFrameRate(const helper::CameraMetadata &settings);
 
   void captureRequestThread();
+  void wakeupCaptureThread();
+
+  Status enqueueDriverBuffer(int index, const StreamBuffer &sb);
 
   Status processCaptureResultConversion(
        const std::unique_ptr<arc::V4L2FrameBuffer> &v4l2_buffer,
        TrackedStreamBuffer &capture_info);
+  int copyFrame(const arc::V4L2FrameBuffer &src, uint32_t fourcc,
+                arc::FrameBuffer *dst);
 
   Status importBuffer(const StreamBuffer &stream_buffer);
   Status saveBuffer(const StreamBuffer &stream_buffer);
+  bool hasDriverLayout(buffer_handle_t buffer);
   buffer_handle_t getSavedBuffer(int64_t id);
 
 private:
@@ -129,18 +170,34 @@ private:
   /* V4L2 Wrapper */
   std::shared_ptr<V4L2Wrapper> v4l2_wrapper_;
   std::shared_ptr<V4L2Wrapper::Connection> connection_;
+  /* Media graph of the configured pipeline */
+  std::shared_ptr<MediaGraph> graph_;
 
-  /* All formats supported by the driver */
+  /* All formats supported by the driver, and their frame durations */
+  std::shared_ptr<const V4L2Capabilities> capabilities_;
   StreamFormats supported_formats_;
-  /* Supported driver formats from which we can convert to another one */
-  StreamFormats qualified_formats_;
+  /* Driver formats from which we can convert to another one, by preference */
+  std::vector<uint32_t> qualified_formats_;
+
+  /* Frame rate */
+  std::array<int32_t, 2> fps_range_;
+  std::array<int64_t, 2> frame_duration_range_;
+  /* Frame duration programmed in the driver, 0 if none */
+  int64_t frame_duration_;
 
   /* V4l2 buffers */
+  uint32_t memory_;
+  /* Whether the framework buffers were found not to match the driver ones */
+  bool dmabuf_rejected_;
+  StreamFormat driver_format_;
+  uint32_t num_v4l2_buffers_;
+  uint32_t v4l2_buffer_size_;
   std::vector<std::unique_ptr<arc::V4L2FrameBuffer>> v4l2_buffers_;
   std::queue<int> available_buffers_;
   std::mutex v4l2_buffer_mutex_;
 
   /* Framework buffers */
+  uint32_t blob_buffer_size_;
   std::unordered_map<int64_t, buffer_handle_t> buffer_map_;
   std::mutex buffer_mutex_;
 
@@ -152,8 +209,12 @@ private:
   std::queue<TrackedStreamBuffer> capture_queue_;
   std::unique_ptr<std::thread> capture_result_thread_;
   bool capture_active_;
+  /* eventfd used to wake up the capture thread while waiting for the driver */
+  base::unique_fd wakeup_fd_;
 
+  /* Conversion context, kept across frames to avoid per-frame allocations */
   std::mutex convert_mutex_;
+  arc::CachedFrame cached_frame_;
 
   bool started_;
 };
@@ -18,10 +18,14 @@
 
 #include <log/log.h>
 
+#include <arc/image_processor.h>
 #include <parser/metadata_factory.h>
 
 #define CONFIGURATION_FILE "/vendor/etc/config/metadata_definitions.xml"
 
+/* The sessions send an early and a final partial result at most */
+#define MAX_PARTIAL_RESULT_COUNT 2
+
 namespace android {
 namespace hardware {
 namespace camera {
@@ -30,6 +34,9 @@ namespace implementation {
 
 using aidl::android::hardware::camera::device::StreamType;
 using aidl::android::hardware::camera::device::StreamRotation;
+using aidl::android::hardware::graphics::common::PixelFormat;
+
+using ::android::hardware::camera::common::V1_0::arc::ImageProcessor;
 
 const std::string V4l2CameraDevice::kDeviceVersion = "1.1";
 
@@ -89,6 +96,9 @@ Status V4l2CameraDevice::initialize() {
     return Status::INTERNAL_ERROR;
   }
 
+  updateMinFrameDurations(out.get());
+  updatePartialResultCount(out.get());
+
   static_info_.reset(StaticProperties::NewStaticProperties(std::move(out)));
   if (!static_info_) {
     ALOGE("%s: failed to initialize static properties from device metadata",
@@ -99,6 +109,207 @@ Status V4l2CameraDevice::initialize() {
   return Status::OK;
 }
 
+/* The partial results must be numbered in order up to the advertised count:
+ * a configured count above what the sessions send is clamped.
+ */
+void V4l2CameraDevice::updatePartialResultCount(
+    CameraMetadataHelper *metadata) {
+  camera_metadata_entry entry =
+                    metadata->find(ANDROID_REQUEST_PARTIAL_RESULT_COUNT);
+  if (entry.count != 1 || entry.data.i32[0] <= MAX_PARTIAL_RESULT_COUNT)
+    return;
+
+  ALOGW("%s: %d partial results configured, only %d are sent", __func__,
+            entry.data.i32[0], MAX_PARTIAL_RESULT_COUNT);
+
+  int32_t count = MAX_PARTIAL_RESULT_COUNT;
+  metadata->update(ANDROID_REQUEST_PARTIAL_RESULT_COUNT, &count, 1);
+}
+
+/* Advertise the minimum frame durations reported by the drivers instead of
+ * the configured ones, so that the frame rates the sensor allows at each
+ * size can be used. Each entry only considers the driver formats a stream
+ * of its pixel format is captured from: the format itself, or the qualified
+ * formats it is converted from. Entries the drivers report nothing for are
+ * left as is.
+ */
+void V4l2CameraDevice::updateMinFrameDurations(CameraMetadataHelper *metadata) {
+  camera_metadata_entry entry =
+                    metadata->find(ANDROID_SCALER_AVAILABLE_MIN_FRAME_DURATIONS);
+  if (entry.count == 0 || entry.count % 4)
+    return;
+
+  struct Node {
+    std::shared_ptr<const V4L2Capabilities> capabilities;
+    std::vector<uint32_t> qualified_formats;
+    uint32_t implementation_defined_format;
+  };
+
+  std::vector<Node> nodes;
+  for (const V4l2StreamConfig &stream_config : config_.streams) {
+    std::shared_ptr<V4L2Wrapper> wrapper =
+        std::make_shared<V4L2Wrapper>(stream_config.node);
+    V4L2Wrapper::Connection connection(wrapper);
+
+    Node node;
+    if (connection.status() ||
+        V4L2CapabilityCache::GetInstance().GetCapabilities(wrapper,
+                                                           &node.capabilities)) {
+      ALOGW("%s: cannot get %s capabilities", __func__, stream_config.node);
+      continue;
+    }
+
+    if (ImageProcessor::GetQualifiedFormats(node.capabilities->formats,
+                                            &node.qualified_formats))
+      node.qualified_formats.clear();
+
+    node.implementation_defined_format =
+                                    stream_config.implementation_defined_format;
+    nodes.push_back(std::move(node));
+  }
+
+  /* Entries are (format, width, height, duration) */
+  std::vector<int64_t> durations(entry.data.i64, entry.data.i64 + entry.count);
+  for (size_t i = 0; i < durations.size(); i += 4) {
+    int64_t min_duration = 0;
+
+    for (const Node &node : nodes) {
+      uint32_t fourcc = StreamFormat::HalToV4L2PixelFormat(
+                            static_cast<PixelFormat>(durations[i]),
+                            node.implementation_defined_format);
+      if (fourcc == 0)
+        continue;
+
+      bool can_convert =
+                ImageProcessor::SupportsConversion(V4L2_PIX_FMT_YUV420, fourcc);
+      const V4L2Capabilities &capabilities = *node.capabilities;
+
+      for (size_t j = 0; j < capabilities.supported_formats.size(); ++j) {
+        const StreamFormat &format = capabilities.supported_formats[j];
+        uint32_t driver_fourcc = format.v4l2_pixel_format();
+        int64_t duration = capabilities.frame_durations[j][0];
+
+        if (format.width() != durations[i + 1] ||
+            format.height() != durations[i + 2] || duration <= 0)
+          continue;
+
+        /* Separate plane formats are only captured as is */
+        bool qualified = can_convert &&
+            StreamFormat::ContiguousPixelFormat(driver_fourcc) ==
+                driver_fourcc &&
+            std::find(node.qualified_formats.begin(),
+                      node.qualified_formats.end(),
+                      driver_fourcc) != node.qualified_formats.end();
+        if (StreamFormat::ContiguousPixelFormat(driver_fourcc) != fourcc &&
+            !qualified)
+          continue;
+
+        if (min_duration == 0 || duration < min_duration)
+          min_duration = duration;
+      }
+    }
+
+    if (min_duration > 0)
+      durations[i + 3] = min_duration;
+  }
+
+  metadata->update(ANDROID_SCALER_AVAILABLE_MIN_FRAME_DURATIONS,
+                   durations.data(), durations.size());
+
+  updateTargetFpsRanges(metadata, durations);
+  updateStallDurations(metadata, durations);
+}
+
+/* The AE target FPS ranges must be reachable with the advertised minimum
+ * frame durations: ranges above the fastest processed stream are dropped,
+ * and a fixed range at that rate is added if missing.
+ */
+void V4l2CameraDevice::updateTargetFpsRanges(
+    CameraMetadataHelper *metadata, const std::vector<int64_t> &durations) {
+  int64_t min_duration = 0;
+  for (size_t i = 0; i < durations.size(); i += 4) {
+    if (static_cast<PixelFormat>(durations[i]) == PixelFormat::BLOB ||
+        durations[i + 3] <= 0)
+      continue;
+
+    if (min_duration == 0 || durations[i + 3] < min_duration)
+      min_duration = durations[i + 3];
+  }
+
+  camera_metadata_entry entry =
+                metadata->find(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES);
+  if (min_duration == 0 || entry.count % 2)
+    return;
+
+  int32_t max_fps = static_cast<int32_t>(1000000000LL / min_duration);
+  if (max_fps <= 0)
+    return;
+
+  /* Entries are (min, max) */
+  std::vector<int32_t> ranges;
+  bool has_fixed_range = false;
+  for (size_t i = 0; i < entry.count; i += 2) {
+    int32_t min_fps = entry.data.i32[i];
+    int32_t fps = entry.data.i32[i + 1];
+
+    if (fps > max_fps) {
+      ALOGI("%s: drop FPS range [%d, %d] above %d fps", __func__,
+                min_fps, fps, max_fps);
+      continue;
+    }
+
+    if (min_fps == max_fps && fps == max_fps)
+      has_fixed_range = true;
+
+    ranges.push_back(min_fps);
+    ranges.push_back(fps);
+  }
+
+  if (!has_fixed_range) {
+    ranges.push_back(max_fps);
+    ranges.push_back(max_fps);
+  }
+
+  metadata->update(ANDROID_CONTROL_AE_AVAILABLE_TARGET_FPS_RANGES,
+                   ranges.data(), ranges.size());
+}
+
+/* Each BLOB stream configuration needs a stall duration: the missing ones
+ * are given the minimum frame duration of their size, the time to encode
+ * one frame.
+ */
+void V4l2CameraDevice::updateStallDurations(
+    CameraMetadataHelper *metadata, const std::vector<int64_t> &durations) {
+  camera_metadata_entry entry =
+                metadata->find(ANDROID_SCALER_AVAILABLE_STALL_DURATIONS);
+  if (entry.count % 4)
+    return;
+
+  /* Entries are (format, width, height, duration) */
+  std::vector<int64_t> stalls(entry.data.i64, entry.data.i64 + entry.count);
+  size_t count = stalls.size();
+
+  for (size_t i = 0; i < durations.size(); i += 4) {
+    if (static_cast<PixelFormat>(durations[i]) != PixelFormat::BLOB)
+      continue;
+
+    bool found = false;
+    for (size_t j = 0; j < count && !found; j += 4)
+      found = stalls[j] == durations[i] && stalls[j + 1] == durations[i + 1] &&
+              stalls[j + 2] == durations[i + 2];
+
+    if (found)
+      continue;
+
+    stalls.insert(stalls.end(), durations.begin() + i,
+                  durations.begin() + i + 4);
+  }
+
+  if (stalls.size() != count)
+    metadata->update(ANDROID_SCALER_AVAILABLE_STALL_DURATIONS,
+                     stalls.data(), stalls.size());
+}
+
 ScopedAStatus V4l2CameraDevice::getCameraCharacteristics(
     CameraMetadata* characteristics) {
   if (characteristics == nullptr) {
@@ -21,6 +21,10 @@
 #include <log/log.h>
 
 #include <inttypes.h>
+#include <utils/Timers.h>
+
+#include <algorithm>
+#include <atomic>
 
 #include <v4l2/stream_format.h>
 
@@ -43,7 +47,6 @@ using aidl::android::hardware::camera::device::StreamType;
 using aidl::android::hardware::camera::device::NotifyMsg;
 using aidl::android::hardware::camera::device::ShutterMsg;
 using aidl::android::hardware::camera::device::ErrorMsg;
-using aidl::android::hardware::camera::device::CaptureResult;
 
 using aidl::android::hardware::camera::metadata::ScalerAvailableStreamUseCases;
 
@@ -55,6 +58,16 @@ using ::android::hardware::camera::common::V1_0::v4l2::StreamFormat;
 #define RES_FMQ_SIZE_PROPERTY "ro.vendor.camera.res.fmq.size"
 #define CAMERA_RESULT_METADATA_QUEUE_SIZE  (1 << 20) /* 1MB */
 
+#define PIPELINE_DEPTH_PROPERTY "vendor.camera.pipeline.depth"
+#define PIPELINE_DEPTH_DEFAULT 4
+
+#define RESULT_BATCH_DELAY_PROPERTY "vendor.camera.result.batch_delay_us"
+#define RESULT_BATCH_DELAY_DEFAULT 2000
+
+#define PARTIAL_RESULT_STATS_PERIOD 300 /* frames */
+
+#define REQUEST_FAST_PATH_PROPERTY "vendor.camera.request.fast_path.enable"
+
 static NativeHandle makeToAidlIfNotNull(const native_handle_t* nh) {
   if (nh == nullptr) {
     return NativeHandle();
@@ -62,6 +75,31 @@ static NativeHandle makeToAidlIfNotNull(const native_handle_t* nh) {
   return makeToAidl(nh);
 }
 
+static NativeHandle dupToAidlIfNotNull(const NativeHandle &handle) {
+  if (handle.fds.size() == 0 && handle.ints.size() == 0) {
+    return NativeHandle();
+  }
+
+  native_handle_t *nh = makeFromAidl(handle);
+  NativeHandle dup = dupToAidl(nh);
+  native_handle_delete(nh);
+
+  return dup;
+}
+
+static NotifyMsg makeErrorMsg(int32_t frame_number, int32_t stream_id,
+                              ErrorCode error) {
+  NotifyMsg error_msg;
+  ErrorMsg msg = {
+    .frameNumber = frame_number,
+    .errorStreamId = stream_id,
+    .errorCode = error,
+  };
+  error_msg.set<NotifyMsg::Tag::error>(std::move(msg));
+
+  return error_msg;
+}
+
 std::shared_ptr<V4l2CameraDeviceSession> V4l2CameraDeviceSession::Create(
     const V4l2CameraConfig &config,
     std::shared_ptr<Metadata> metadata,
@@ -98,11 +136,31 @@ V4l2CameraDeviceSession::V4l2CameraDeviceSession(
     callback_(callback),
     metadata_(metadata),
     static_info_(static_info),
+    request_fast_path_(true),
+    result_timestamp_index_(-1),
+    pipeline_depth_(PIPELINE_DEPTH_DEFAULT),
+    partial_result_count_(1),
+    result_batch_delay_(RESULT_BATCH_DELAY_DEFAULT),
+    pipeline_active_(false),
+    results_sending_(false),
+    requests_processing_(0),
     closed_(false)
 { }
 
 V4l2CameraDeviceSession::~V4l2CameraDeviceSession()
-{ }
+{
+  /* The pipeline threads must not outlive the session */
+  stopPipeline();
+
+  if (isp_thread_ && isp_thread_->joinable()) {
+    {
+      std::lock_guard lock(isp_mutex_);
+      closed_ = true;
+    }
+    isp_cond_.notify_one();
+    isp_thread_->join();
+  }
+}
 
 Status V4l2CameraDeviceSession::initialize() {
   ALOGV("%s (%d): Initializing camera device session", __func__, config_.id);
@@ -139,6 +197,36 @@ Status V4l2CameraDeviceSession::initialize() {
     return Status::INTERNAL_ERROR;
   }
 
+  /* Launch the request pipeline */
+  int32_t depth = property_get_int32(PIPELINE_DEPTH_PROPERTY,
+                                     PIPELINE_DEPTH_DEFAULT);
+  if (depth < 1) {
+    ALOGW("%s (%d): invalid pipeline depth %d, using %d",
+        __func__, config_.id, depth, PIPELINE_DEPTH_DEFAULT);
+    depth = PIPELINE_DEPTH_DEFAULT;
+  }
+  pipeline_depth_ = depth;
+
+  result_batch_delay_ = std::chrono::microseconds(
+      std::max(0, property_get_int32(RESULT_BATCH_DELAY_PROPERTY,
+                                     RESULT_BATCH_DELAY_DEFAULT)));
+
+  request_fast_path_ = property_get_bool(REQUEST_FAST_PATH_PROPERTY, true);
+
+  /* Split the result metadata if the framework expects several parts */
+  camera_metadata_ro_entry entry;
+  int res = find_camera_metadata_ro_entry(static_info_->raw_metadata(),
+                                          ANDROID_REQUEST_PARTIAL_RESULT_COUNT,
+                                          &entry);
+  if (res == 0 && entry.count == 1 && entry.data.i32[0] > 1)
+    partial_result_count_ = entry.data.i32[0];
+
+  pipeline_active_ = true;
+  request_thread_.reset(
+      new std::thread(&V4l2CameraDeviceSession::requestThread, this));
+  result_thread_.reset(
+      new std::thread(&V4l2CameraDeviceSession::resultThread, this));
+
   /* Launch the ISP thread */
   isp_thread_.reset(
       new std::thread(&V4l2CameraDeviceSession::ISPThread, this));
@@ -154,8 +242,28 @@ Status V4l2CameraDeviceSession::initStatus() {
 }
 
 ScopedAStatus V4l2CameraDeviceSession::close() {
+  /* No new request is accepted from now on */
+  {
+    std::lock_guard lock(pipeline_mutex_);
+    if (closed_)
+      return ScopedAStatus::ok();
+
+    closed_ = true;
+  }
+  pipeline_cond_.notify_all();
+
+  /* The requests in the pipeline are completed while the result thread can
+   * still send them.
+   */
+  {
+    std::lock_guard l(flush_mutex_);
+    drainPipeline();
+  }
+
+  /* No request must be queued to the streams once they are released */
+  stopPipeline();
+
   stream_map_.clear();
-  closed_ = true;
 
   isp_cond_.notify_one();
   if (isp_thread_)
@@ -179,6 +287,14 @@ ScopedAStatus V4l2CameraDeviceSession::configureStreams(
                 static_cast<int32_t>(status));
   }
 
+  /* The devices are reconfigured: the next settings are applied again, even
+   * if unchanged.
+   */
+  {
+    std::lock_guard l(intake_mutex_);
+    last_request_settings_.reset();
+  }
+
   /* Turn off the v4l2 driver stream and clean */
   status = configureStreamsClean(requested_configuration);
   if (status != Status::OK) {
@@ -200,6 +316,31 @@ ScopedAStatus V4l2CameraDeviceSession::configureStreams(
                 static_cast<int32_t>(status));
   }
 
+  /* Not fatal, the results are then filled without layout. The timestamp
+   * the session sets in each result is part of the layout.
+   */
+  helper::CameraMetadata layout;
+  int64_t timestamp = 0;
+  layout.update(ANDROID_SENSOR_TIMESTAMP, &timestamp, 1);
+
+  if (metadata_->CompileResultLayout(&layout)) {
+    ALOGW("%s (%d): cannot compile the result metadata layout",
+              __func__, config_.id);
+    std::lock_guard lock(result_layout_mutex_);
+    result_layout_.clear();
+    result_timestamp_index_ = -1;
+  } else {
+    camera_metadata_ro_entry entry;
+    const camera_metadata_t *raw = layout.getAndLock();
+    ssize_t index = find_camera_metadata_ro_entry(
+        raw, ANDROID_SENSOR_TIMESTAMP, &entry) ? -1 : entry.index;
+    layout.unlock(raw);
+
+    std::lock_guard lock(result_layout_mutex_);
+    result_layout_.acquire(layout);
+    result_timestamp_index_ = index;
+  }
+
   ALOGV("%s (%d): configure streams successfull", __func__, config_.id);
 
   return ScopedAStatus::ok();
@@ -265,8 +406,27 @@ Status V4l2CameraDeviceSession::configureStreamsClean(
   return Status::OK;
 }
 
+/* The AE target FPS range of the session parameters, {0, 0} if not set */
+static std::array<int32_t, 2> getSessionFpsRange(
+    const StreamConfiguration &configuration) {
+  const std::vector<uint8_t> &params = configuration.sessionParams.metadata;
+  if (params.empty())
+    return {0, 0};
+
+  camera_metadata_ro_entry entry;
+  int res = find_camera_metadata_ro_entry(
+      reinterpret_cast<const camera_metadata_t *>(params.data()),
+      ANDROID_CONTROL_AE_TARGET_FPS_RANGE, &entry);
+  if (res || entry.count != 2)
+    return {0, 0};
+
+  return {entry.data.i32[0], entry.data.i32[1]};
+}
+
 Status V4l2CameraDeviceSession::configureDriverStreams(
     const StreamConfiguration &requested_configuration) {
+  std::array<int32_t, 2> fps_range =
+                                getSessionFpsRange(requested_configuration);
 
   for (const Stream &stream : requested_configuration.streams) {
     decltype(stream_map_)::const_iterator it = stream_map_.find(stream.id);
@@ -282,7 +442,8 @@ Status V4l2CameraDeviceSession::configureDriverStreams(
         return status;
 
       std::shared_ptr<V4l2Stream> v4l2_stream = V4l2Stream::Create(
-                                                    stream_conf, stream, this);
+                                                    stream_conf, stream, this,
+                                                    fps_range);
       if (v4l2_stream == nullptr) {
         config_.streams.push_back(std::move(stream_conf));
         return Status::INTERNAL_ERROR;
@@ -295,6 +456,22 @@ Status V4l2CameraDeviceSession::configureDriverStreams(
   return Status::OK;
 }
 
+int32_t V4l2CameraDeviceSession::getJpegMaxSize(const Stream &stream) {
+  camera_metadata_ro_entry entry;
+
+  int res = find_camera_metadata_ro_entry(static_info_->raw_metadata(),
+                                          ANDROID_JPEG_MAX_SIZE, &entry);
+  if (!res && entry.count == 1 && entry.data.i32[0] > 0)
+    return entry.data.i32[0];
+
+  /* Without a static max size, never expect the JPEG image to be larger than
+   * the uncompressed YUV420 frame it is encoded from.
+   */
+  ALOGW("%s (%d): no JPEG max size in static metadata", __func__, config_.id);
+
+  return stream.width * stream.height * 3 / 2 + sizeof(CameraBlob);
+}
+
 Status V4l2CameraDeviceSession::findBestStreamConfiguration(
     const Stream &stream, V4l2StreamConfig &res) {
   auto it = config_.streams.cbegin();
@@ -362,6 +539,14 @@ Status V4l2CameraDeviceSession::configureStreamsResult(
           static_cast<int64_t>(res.producerUsage) |
           static_cast<int64_t>(BufferUsage::CPU_WRITE_OFTEN)
       );
+
+      /* The driver writes directly into the buffer */
+      if (v4l2_stream->isZeroCopy()) {
+        res.producerUsage = static_cast<BufferUsage>(
+            static_cast<int64_t>(res.producerUsage) |
+            static_cast<int64_t>(BufferUsage::CAMERA_OUTPUT)
+        );
+      }
     } else {
       res.consumerUsage = static_cast<BufferUsage>(
           static_cast<int64_t>(res.consumerUsage) |
@@ -383,6 +568,10 @@ Status V4l2CameraDeviceSession::configureStreamsResult(
         static_cast<int64_t>(res.consumerUsage)
     ));
 
+    /* BLOB buffers are allocated by the framework with the JPEG max size */
+    if (stream.format == PixelFormat::BLOB)
+      v4l2_stream->setBlobBufferSize(getJpegMaxSize(stream));
+
     res.overrideDataSpace = stream.dataSpace;
 
     ALOGV("%s (%d): stream %d configured: type: %d, format: 0x%x, w: %d, h: %d"
@@ -460,10 +649,44 @@ ScopedAStatus V4l2CameraDeviceSession::flush() {
                 static_cast<int32_t>(status));
   }
 
+  drainPipeline();
+
+  return ScopedAStatus::ok();
+}
+
+/*
+ *  This method fails the requests not queued to the streams yet, returns the
+ *  buffers queued to the streams and waits for every result to be sent.
+ *  Must be called with flush_mutex_ held.
+ *
+ */
+void V4l2CameraDeviceSession::drainPipeline() {
+  {
+    std::lock_guard lock(pipeline_mutex_);
+    failPendingRequestsLocked();
+  }
+  result_cond_.notify_one();
+
   for (const auto &p : stream_map_)
     p.second->flush();
 
-  return ScopedAStatus::ok();
+  /* Every buffer has completed, wait for the results to be sent */
+  std::unique_lock lock(pipeline_mutex_);
+  pipeline_cond_.wait(lock, [this] {
+    return !pipeline_active_ || (in_flight_.empty() && !results_sending_);
+  });
+}
+
+/* Fail the requests not queued to the streams yet.
+ * Must be called with pipeline_mutex_ held.
+ */
+void V4l2CameraDeviceSession::failPendingRequestsLocked() {
+  for (PendingRequest &pending : pending_requests_) {
+    InFlightRequest &request = in_flight_[pending.frame_number];
+    request.pending_buffers = pending.buffers.size();
+    failBuffersLocked(&request, pending.buffers, 0);
+  }
+  pending_requests_.clear();
 }
 
 ScopedAStatus V4l2CameraDeviceSession::getCaptureRequestMetadataQueue(
@@ -535,7 +758,8 @@ ScopedAStatus V4l2CameraDeviceSession::processCaptureRequest(
 
   updateBufferCaches(caches_to_remove);
 
-  std::lock_guard l(flush_mutex_);
+  /* Requests are only validated here, and processed by the pipeline */
+  std::lock_guard l(intake_mutex_);
 
   Status res = Status::OK;
   for (size_t i = 0; i < requests.size(); ++i) {
@@ -563,20 +787,45 @@ Status V4l2CameraDeviceSession::processOneCaptureRequest(
   if (status != Status::OK)
     return status;
 
-  std::shared_ptr<helper::CameraMetadata> settings;
-  status = processCaptureRequestMetadata(request, settings);
-  if (status != Status::OK)
-    return status;
+  PendingRequest pending;
+  pending.frame_number = request.frameNumber;
+  pending.intake_time = systemTime(SYSTEM_TIME_MONOTONIC);
 
-  status = processCaptureRequestEnqueue(request, settings);
+  status = processCaptureRequestMetadata(request, pending.settings);
   if (status != Status::OK)
     return status;
 
-  if (settings)
-    processCaptureMetadataResult(request.frameNumber, *settings);
+  /* The buffers and fences of the request are only valid during this call */
+  for (const StreamBuffer &sb : request.outputBuffers) {
+    StreamBuffer buffer = {
+      .streamId = sb.streamId,
+      .bufferId = sb.bufferId,
+      .buffer = dupToAidlIfNotNull(sb.buffer),
+      .status = sb.status,
+      .acquireFence = dupToAidlIfNotNull(sb.acquireFence),
+    };
+    pending.buffers.push_back(std::move(buffer));
+  }
 
   /* TODO: handle inputBuffer ? */
 
+  /* Wait for room in the pipeline */
+  std::unique_lock lock(pipeline_mutex_);
+  pipeline_cond_.wait(lock, [this] {
+    return !pipeline_active_ || closed_ ||
+           pending_requests_.size() + requests_processing_ +
+               in_flight_.size() < pipeline_depth_;
+  });
+
+  if (!pipeline_active_ || closed_) {
+    ALOGE("%s (%d): capture request while the pipeline is stopped !",
+              __func__, config_.id);
+    return Status::INTERNAL_ERROR;
+  }
+
+  pending_requests_.push_back(std::move(pending));
+  request_cond_.notify_one();
+
   return Status::OK;
 }
 
@@ -607,32 +856,47 @@ Status V4l2CameraDeviceSession::processCaptureRequestVerification(
     return Status::ILLEGAL_ARGUMENT;
   }
 
+  for (const StreamBuffer &sb : request.outputBuffers) {
+    if (stream_map_.find(sb.streamId) == stream_map_.cend()) {
+      ALOGE("%s (%d): The stream %d is not tracked !",
+                __func__, config_.id, sb.streamId);
+      return Status::ILLEGAL_ARGUMENT;
+    }
+  }
+
   return Status::OK;
 }
 
 Status V4l2CameraDeviceSession::processCaptureRequestMetadata(
     const CaptureRequest &request,
     std::shared_ptr<helper::CameraMetadata> &metadata) {
-  std::vector<uint8_t> settings;
-
-  /* Capture Settings */
+  /* Capture Settings, without settings the previous ones are reused */
   if (request.fmqSettingsSize > 0) {
-    settings.resize(request.fmqSettingsSize);
+    std::vector<uint8_t> settings(request.fmqSettingsSize);
 
     if (!request_metadata_queue_->read(reinterpret_cast<int8_t *>(settings.data()),
                                        request.fmqSettingsSize)) {
       ALOGE("%s (%d): capture request settings metadata couldn't be read from "
             "fmq !", __func__, config_.id);
-      processCaptureRequestError(request, ErrorCode::ERROR_REQUEST);
+      processCaptureRequestError(request.frameNumber, ErrorCode::ERROR_REQUEST);
       return Status::ILLEGAL_ARGUMENT;
     }
-  } else if (request.settings.metadata.size() > 0) {
-    settings = request.settings.metadata;
-  } else {
-    settings = previous_settings_;
+
+    if (settings != previous_settings_) {
+      previous_settings_ = std::move(settings);
+      last_request_settings_.reset();
+    }
+  } else if (request.settings.metadata.size() > 0 &&
+             request.settings.metadata != previous_settings_) {
+    previous_settings_ = request.settings.metadata;
+    last_request_settings_.reset();
   }
 
-  previous_settings_ = std::move(settings);
+  /* The settings are unchanged: they were already validated */
+  if (last_request_settings_) {
+    metadata = last_request_settings_;
+    return Status::OK;
+  }
 
   const camera_metadata_t *aux =
       reinterpret_cast<const camera_metadata_t *>(previous_settings_.data());
@@ -643,47 +907,244 @@ Status V4l2CameraDeviceSession::processCaptureRequestMetadata(
 
   if (!metadata_->IsValidRequest(*metadata)) {
     ALOGE("%s (%d): invalid request settings !", __func__, config_.id);
-    processCaptureRequestError(request, ErrorCode::ERROR_REQUEST);
+    processCaptureRequestError(request.frameNumber, ErrorCode::ERROR_REQUEST);
     return Status::ILLEGAL_ARGUMENT;
   }
 
+  if (request_fast_path_)
+    last_request_settings_ = metadata;
+
+  return Status::OK;
+}
+
+/* Remove the entries of |metadata|, keeping its storage */
+static void clearEntries(helper::CameraMetadata *metadata) {
+  camera_metadata_t *raw = metadata->release();
+  if (raw == nullptr)
+    return;
+
+  metadata->acquire(place_camera_metadata(
+      raw, get_camera_metadata_size(raw),
+      get_camera_metadata_entry_capacity(raw),
+      get_camera_metadata_data_capacity(raw)));
+}
+
+/* Make |metadata| a copy of the compiled |layout|, keeping its storage when
+ * it has the size of the layout. The copy keeps the spare room of the
+ * layout, so that its entries are then updated in place.
+ */
+static void copyLayout(const helper::CameraMetadata &layout,
+                       helper::CameraMetadata *metadata) {
+  if (layout.isEmpty()) {
+    clearEntries(metadata);
+    return;
+  }
+
+  const camera_metadata_t *src = layout.getAndLock();
+  size_t size = get_camera_metadata_size(src);
+
+  camera_metadata_t *raw = metadata->release();
+  if (raw != nullptr && get_camera_metadata_size(raw) != size) {
+    free_camera_metadata(raw);
+    raw = nullptr;
+  }
+  if (raw == nullptr)
+    raw = allocate_camera_metadata(get_camera_metadata_entry_capacity(src),
+                                   get_camera_metadata_data_capacity(src));
+
+  /* copy_camera_metadata() would compact the copy, the buffer being
+   * position independent it is copied as is.
+   */
+  if (raw != nullptr && get_camera_metadata_size(raw) == size)
+    memcpy(raw, src, size);
+  else if (raw != nullptr)
+    raw = copy_camera_metadata(raw, get_camera_metadata_size(raw), src);
+
+  layout.unlock(src);
+
+  if (raw != nullptr)
+    metadata->acquire(raw);
+  else
+    *metadata = layout;
+}
+
+/* Set |count| values of the entry |tag| of |metadata| in place, at |index|
+ * when the entry is there, e.g. in a copy of the result layout.
+ */
+static void updateEntryAt(helper::CameraMetadata *metadata, ssize_t index,
+                          uint32_t tag, const int64_t *data, size_t count) {
+  camera_metadata_t *raw = index < 0 ? nullptr : metadata->release();
+  if (raw != nullptr) {
+    camera_metadata_ro_entry entry;
+    int res = get_camera_metadata_ro_entry(raw, index, &entry);
+    if (res == 0 && entry.tag == tag)
+      res = update_camera_metadata_entry(raw, index, data, count, nullptr);
+    else
+      res = -ENOENT;
+
+    metadata->acquire(raw);
+    if (res == 0)
+      return;
+  }
+
+  metadata->update(tag, data, count);
+}
+
+/* Update |metadata| with the entries of |src|, except those of |skip| */
+static void updateEntries(const helper::CameraMetadata &src,
+                          helper::CameraMetadata *metadata,
+                          const helper::CameraMetadata *skip = nullptr) {
+  const camera_metadata_t *raw_src = src.getAndLock();
+  size_t count = get_camera_metadata_entry_count(raw_src);
+
+  for (size_t i = 0; i < count; ++i) {
+    camera_metadata_ro_entry entry;
+    if (get_camera_metadata_ro_entry(raw_src, i, &entry) ||
+        (skip && skip->exists(entry.tag)))
+      continue;
+
+    metadata->update(entry);
+  }
+
+  src.unlock(raw_src);
+}
+
+/*
+ *  This method returns a metadata of the result pool which no frame uses
+ *  anymore, to be filled in place: once the pool holds as many buffers as
+ *  the pipeline needs, the results are filled without allocating. It is
+ *  only called from the request thread.
+ *
+ */
+std::shared_ptr<helper::CameraMetadata>
+V4l2CameraDeviceSession::acquireResultMetadata() {
+  for (const std::shared_ptr<helper::CameraMetadata> &metadata : result_pool_) {
+    if (metadata.use_count() == 1) {
+      /* Synchronizes with the release by the last other owner */
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return metadata;
+    }
+  }
+
+  result_pool_.push_back(std::make_shared<helper::CameraMetadata>());
+
+  return result_pool_.back();
+}
+
+/*
+ *  This method applies the settings of a request, and fills the result
+ *  metadata kept for |request| and the settings given to the streams. It is
+ *  only called from the request thread, in frame order. The settings shared
+ *  by repeating requests are only applied once, their result metadata is
+ *  reused, the result thread setting the timestamp of each frame.
+ *  The settings of the request are never modified, since they may be shared
+ *  with the frames still captured.
+ *
+ *  @return Status::OK on success, request->result_valid telling whether the
+ *          result metadata could be filled
+ *          Status::INTERNAL_ERROR if the settings cannot be applied
+ *
+ */
+Status V4l2CameraDeviceSession::processCaptureRequestSettings(
+    PendingRequest &pending, InFlightRequest *request) {
+  if (pending.settings == applied_settings_.settings) {
+    request->early_result = applied_settings_.early_result;
+    request->result = applied_settings_.result;
+    pending.stream_settings = applied_settings_.stream_settings;
+    return Status::OK;
+  }
+
+  applied_settings_ = AppliedSettings();
+
+  const helper::CameraMetadata &settings = *pending.settings;
+  pending.stream_settings = pending.settings;
+
   /* Setting and getting settings are best effort here,
    * since there's no way to know through V4L2 exactly what
    * settings are used for a buffer unless we were to enqueue them
-   * one at a time, which would be too slow
+   * one at a time, which would be too slow. Streams using media requests
+   * (vendor.camera.media_request.enable) queue each buffer with its own
+   * request, but no setting is mapped to their V4L2 controls: the requests
+   * only carry the buffers.
    */
-  int res = metadata_->SetRequestSettings(*metadata);
+  for (const auto &p : stream_map_)
+    p.second->beginControls();
+
+  int res = metadata_->SetRequestSettings(settings);
+
+  /* The V4L2 controls staged on the stream devices are set together, once
+   * all the settings are known.
+   */
+  for (const auto &p : stream_map_) {
+    int err = p.second->commitControls();
+    if (!res)
+      res = err;
+  }
+
   if (res) {
     ALOGE("%s (%d): failed to set settings: %d !", __func__, config_.id, res);
-    processCaptureRequestError(request, ErrorCode::ERROR_REQUEST);
     return Status::INTERNAL_ERROR;
   }
 
-  res = metadata_->FillResultMetadata(metadata.get());
+  /* The components update the entries of the layout in place */
+  std::shared_ptr<helper::CameraMetadata> dynamic = acquireResultMetadata();
+  {
+    std::lock_guard lock(result_layout_mutex_);
+    copyLayout(result_layout_, dynamic.get());
+  }
+
+  res = metadata_->FillResultMetadata(dynamic.get());
   if (res) {
     ALOGE("%s (%d): failed to fill result metadata !", __func__, config_.id);
-    /* Notify the metadata won't be available for this capture and continue */
-    processCaptureRequestError(request, ErrorCode::ERROR_RESULT);
+    /* The metadata won't be available for this capture, continue */
+    request->result_valid = false;
+    return Status::OK;
+  }
+
+  /* The streams get the whole result metadata, e.g. for the JPEG EXIF */
+  std::shared_ptr<helper::CameraMetadata> stream_settings =
+                                                    acquireResultMetadata();
+  clearEntries(stream_settings.get());
+  updateEntries(settings, stream_settings.get(), dynamic.get());
+  updateEntries(*dynamic, stream_settings.get());
+  pending.stream_settings = stream_settings;
+
+  if (partial_result_count_ > 1) {
+    /* The keys only derived from the request go in the early partial
+     * result, the final one holds what the components filled.
+     */
+    request->early_result = acquireResultMetadata();
+    clearEntries(request->early_result.get());
+    updateEntries(settings, request->early_result.get(), dynamic.get());
+  } else {
+    updateEntries(settings, dynamic.get(), dynamic.get());
   }
+  request->result = dynamic;
+
+  applied_settings_ = {
+    .settings = pending.settings,
+    .stream_settings = stream_settings,
+    .early_result = request->early_result,
+    .result = request->result,
+  };
 
   return Status::OK;
 }
 
 Status V4l2CameraDeviceSession::processCaptureRequestEnqueue(
-    const CaptureRequest &request,
-    const std::shared_ptr<const helper::CameraMetadata> &settings) {
+    PendingRequest &pending, size_t *num_queued) {
+  for (*num_queued = 0; *num_queued < pending.buffers.size(); ++(*num_queued)) {
+    const StreamBuffer &sb = pending.buffers[*num_queued];
 
-  for (const StreamBuffer &sb : request.outputBuffers) {
     decltype(stream_map_)::const_iterator it = stream_map_.find(sb.streamId);
     if (it == stream_map_.cend()) {
       ALOGE("%s (%d): The stream %d is not tracked !",
                 __func__, config_.id, sb.streamId);
-      processCaptureRequestError(request, ErrorCode::ERROR_REQUEST);
       return Status::ILLEGAL_ARGUMENT;
     }
 
-    Status status = it->second->processCaptureBuffer(request.frameNumber,
-                                                     sb, settings);
+    Status status = it->second->processCaptureBuffer(pending.frame_number,
+                                                     sb, pending.stream_settings);
     if (status != Status::OK)
       return status;
   }
@@ -691,60 +1152,505 @@ Status V4l2CameraDeviceSession::processCaptureRequestEnqueue(
   return Status::OK;
 }
 
-void V4l2CameraDeviceSession::processCaptureMetadataResult(
-    int32_t frame_number, const helper::CameraMetadata &settings) {
-  int64_t timestamp = 0;
-  MetadataCommon::SingleTagValue(settings, ANDROID_SENSOR_TIMESTAMP, &timestamp);
+void V4l2CameraDeviceSession::requestThread() {
+  ALOGI("%s: Request Thread started", __func__);
 
-  int64_t exposure_time = 0;
-  MetadataCommon::SingleTagValue(settings, ANDROID_SENSOR_EXPOSURE_TIME, &exposure_time);
+  while (1) {
+    std::unique_lock lock(pipeline_mutex_);
+    request_cond_.wait(lock, [this] {
+      return !pipeline_active_ || !pending_requests_.empty();
+    });
 
-  NotifyMsg msg;
-  ShutterMsg shutter = {
-    .frameNumber = frame_number,
-    .timestamp = timestamp,
-    .readoutTimestamp = timestamp + exposure_time,
+    if (!pipeline_active_)
+      break;
+
+    lock.unlock();
+
+    /* A flush must not occur while a request is partially queued */
+    std::lock_guard flush_lock(flush_mutex_);
+
+    lock.lock();
+    if (pending_requests_.empty()) {
+      /* The pending requests were flushed meanwhile */
+      continue;
+    }
+
+    PendingRequest pending = std::move(pending_requests_.front());
+    pending_requests_.pop_front();
+    /* Counted until tracked in flight, see processPendingRequest() */
+    ++requests_processing_;
+    lock.unlock();
+
+    processPendingRequest(pending);
+  }
+
+  ALOGI("%s: Request Thread ended", __func__);
+}
+
+void V4l2CameraDeviceSession::processPendingRequest(PendingRequest &pending) {
+  InFlightRequest in_flight;
+  in_flight.intake_time = pending.intake_time;
+  in_flight.pending_buffers = pending.buffers.size();
+
+  Status status = processCaptureRequestSettings(pending, &in_flight);
+  MetadataCommon::SingleTagValue(*pending.settings,
+                                 ANDROID_SENSOR_EXPOSURE_TIME,
+                                 &in_flight.exposure_time);
+
+  /* The request is tracked before its buffers may complete, its early
+   * partial result can already be sent.
+   */
+  {
+    std::lock_guard lock(pipeline_mutex_);
+    InFlightRequest &request = in_flight_[pending.frame_number];
+    request = std::move(in_flight);
+    --requests_processing_;
+
+    if (status != Status::OK)
+      failBuffersLocked(&request, pending.buffers, 0);
+
+    result_cond_.notify_one();
+
+    if (status != Status::OK)
+      return;
+  }
+
+  size_t num_queued = 0;
+  status = processCaptureRequestEnqueue(pending, &num_queued);
+  if (status != Status::OK) {
+    ALOGE("%s (%d): frame %d: only %zu/%zu buffers queued !", __func__,
+              config_.id, pending.frame_number, num_queued,
+              pending.buffers.size());
+
+    std::lock_guard lock(pipeline_mutex_);
+    failBuffersLocked(&in_flight_[pending.frame_number], pending.buffers,
+                      num_queued);
+    result_cond_.notify_one();
+  }
+}
+
+/* Fail |request|, completing its |buffers| from |first| on with an error.
+ * Must be called with pipeline_mutex_ held.
+ */
+void V4l2CameraDeviceSession::failBuffersLocked(
+    InFlightRequest *request, std::vector<StreamBuffer> &buffers,
+    size_t first) {
+  request->failed = true;
+
+  for (size_t i = first; i < buffers.size(); ++i) {
+    StreamBuffer &sb = buffers[i];
+
+    /* The buffer was never used, it is released with its acquire fence */
+    StreamBuffer error = {
+      .streamId = sb.streamId,
+      .bufferId = sb.bufferId,
+      .status = BufferStatus::ERROR,
+      .releaseFence = std::move(sb.acquireFence)
+    };
+    request->completed.push_back({ std::move(error), true });
+    --request->pending_buffers;
+  }
+}
+
+void V4l2CameraDeviceSession::completeBuffer(
+    const V4l2Stream::TrackedStreamBuffer &tsb, bool error) {
+  StreamBuffer sb = {
+    .streamId = tsb.stream_id,
+    .bufferId = tsb.buffer_id,
+    .status = error ? BufferStatus::ERROR : tsb.status,
+    .releaseFence = makeToAidlIfNotNull(error ? tsb.acquire_fence
+                                              : tsb.release_fence)
   };
-  msg.set<NotifyMsg::Tag::shutter>(std::move(shutter));
-  callback_->notify({ std::move(msg) });
 
-  const camera_metadata_t *metadata = settings.getAndLock();
-  uint32_t size = get_camera_metadata_size(metadata);
-  const int8_t *data = reinterpret_cast<const int8_t *>(metadata);
+  std::unique_lock lock(pipeline_mutex_);
 
-  CaptureResult result;
-  result.frameNumber = frame_number;
-  result.inputBuffer.streamId = -1;
-  result.partialResult = 1;
+  auto it = in_flight_.find(tsb.frame_number);
+  if (it == in_flight_.end()) {
+    ALOGE("%s (%d): frame %d is not in flight !",
+              __func__, config_.id, tsb.frame_number);
+    lock.unlock();
+    sendBufferResult(tsb.frame_number, std::move(sb));
+    return;
+  }
 
-  bool res = result_metadata_queue_->write(data, size);
-  if (!res) {
-    ALOGE("%s: failed to write metadata to FMQ", __func__);
-    result.fmqResultSize = 0;
-    result.result.metadata = std::vector<uint8_t>(data, data + size);
-  } else {
-    result.fmqResultSize = size;
+  InFlightRequest &request = it->second;
+  if (!error && request.timestamp == 0)
+    request.timestamp = tsb.timestamp;
+
+  request.completed.push_back({ std::move(sb), error });
+  --request.pending_buffers;
+
+  result_cond_.notify_one();
+}
+
+void V4l2CameraDeviceSession::resultThread() {
+  ALOGI("%s: Result Thread started", __func__);
+
+  std::unique_lock lock(pipeline_mutex_);
+  while (pipeline_active_) {
+    std::vector<FrameResult> results;
+    collectFrameResultsLocked(&results);
+
+    if (results.empty()) {
+      result_cond_.wait(lock);
+      continue;
+    }
+
+    /* The streams capture a frame at about the same time: give its other
+     * buffers a chance to complete and be sent along, within the batch
+     * delay.
+     */
+    auto deadline = std::chrono::steady_clock::now() + result_batch_delay_;
+    while (pipeline_active_ && hasIncompleteFramesLocked(results) &&
+           result_cond_.wait_until(lock, deadline) != std::cv_status::timeout)
+      collectFrameResultsLocked(&results);
+    collectFrameResultsLocked(&results);
+
+    results_sending_ = true;
+    lock.unlock();
+
+    sendFrameResults(results);
+
+    lock.lock();
+    results_sending_ = false;
+
+    /* Room for new requests, or a flush may be complete */
+    pipeline_cond_.notify_all();
   }
 
-  std::vector<CaptureResult> results;
-  results.push_back(std::move(result));
+  ALOGI("%s: Result Thread ended", __func__);
+}
+
+/* Whether some buffers of |results| frames are still being captured.
+ * Must be called with pipeline_mutex_ held.
+ */
+bool V4l2CameraDeviceSession::hasIncompleteFramesLocked(
+    const std::vector<FrameResult> &results) {
+  for (const FrameResult &result : results) {
+    auto it = in_flight_.find(result.frame_number);
+    if (it != in_flight_.end() && it->second.pending_buffers > 0)
+      return true;
+  }
+
+  return false;
+}
+
+/* The result of |frame_number| in |results|, added if missing.
+ * Must be called with pipeline_mutex_ held.
+ */
+V4l2CameraDeviceSession::FrameResult &V4l2CameraDeviceSession::getFrameResult(
+    std::vector<FrameResult> *results, int32_t frame_number) {
+  for (FrameResult &result : *results) {
+    if (result.frame_number == frame_number)
+      return result;
+  }
+
+  FrameResult result = {
+    .frame_number = frame_number,
+    .request_error = false,
+    .request_failed = false,
+    .shutter = false,
+    .timestamp = 0,
+    .exposure_time = 0,
+    .early_metadata = nullptr,
+    .metadata = nullptr,
+    .result_error = false,
+    .first_partial = false,
+    .intake_time = 0,
+  };
+  results->push_back(std::move(result));
+
+  return results->back();
+}
+
+/*
+ *  This method collects what can be sent for the in flight requests, merged
+ *  into |results| when they already hold their frame. The early partial
+ *  results only depend on the requests, they are sent as soon as possible.
+ *  The shutters must be notified in frame order, and before any buffer of
+ *  their frame: the first request not captured yet holds back the following
+ *  ones.
+ *  Must be called with pipeline_mutex_ held.
+ *
+ */
+void V4l2CameraDeviceSession::collectFrameResultsLocked(
+    std::vector<FrameResult> *results) {
+  for (auto &[frame_number, request] : in_flight_) {
+    if (request.early_result == nullptr || request.early_sent ||
+        request.failed)
+      continue;
+
+    FrameResult &result = getFrameResult(results, frame_number);
+    result.early_metadata = request.early_result;
+    result.first_partial = true;
+    result.intake_time = request.intake_time;
+
+    request.early_sent = true;
+  }
+
+  for (auto it = in_flight_.begin(); it != in_flight_.end();) {
+    InFlightRequest &request = it->second;
+    bool shutter = false;
+    bool request_error = false;
+
+    if (!request.failed && !request.shutter_sent) {
+      bool captured = std::any_of(request.completed.begin(),
+                                  request.completed.end(),
+                                  [](const CompletedBuffer &b) {
+                                    return !b.error;
+                                  });
+
+      if (!captured) {
+        if (request.pending_buffers > 0)
+          break;
+
+        /* Nothing was captured for this request, e.g. on flush */
+        request.failed = true;
+      } else {
+        shutter = true;
+        request.shutter_sent = true;
+      }
+    }
+
+    /* ERROR_REQUEST is only allowed while nothing was sent for the frame,
+     * its buffers are then in error too. Otherwise the missing final result
+     * and each buffer are reported in error.
+     */
+    bool partially_sent = request.early_sent || request.shutter_sent;
+    bool result_error = false;
+    if (request.failed && !request.error_sent) {
+      request_error = !partially_sent;
+      result_error = partially_sent && !request.shutter_sent;
+      request.error_sent = true;
+    }
+
+    if (request.failed && partially_sent) {
+      for (CompletedBuffer &completed : request.completed)
+        completed.error = true;
+    }
+
+    if (shutter || request_error || result_error ||
+        !request.completed.empty()) {
+      FrameResult &result = getFrameResult(results, it->first);
+      result.request_error |= request_error;
+      result.result_error |= result_error;
+      result.request_failed = request.failed && !partially_sent;
+
+      if (shutter) {
+        result.shutter = true;
+        result.timestamp = request.timestamp;
+        result.exposure_time = request.exposure_time;
+
+        if (!request.result_valid) {
+          result.result_error = true;
+        } else {
+          result.metadata = request.result;
+          if (request.early_result == nullptr) {
+            result.first_partial = true;
+            result.intake_time = request.intake_time;
+          }
+        }
+      }
+
+      for (CompletedBuffer &completed : request.completed)
+        result.buffers.push_back(std::move(completed));
+      request.completed.clear();
+    }
+
+    if (request.pending_buffers == 0)
+      it = in_flight_.erase(it);
+    else
+      ++it;
+  }
+
+  std::sort(results->begin(), results->end(),
+            [](const FrameResult &a, const FrameResult &b) {
+              return a.frame_number < b.frame_number;
+            });
+}
+
+/*
+ *  This method sends the collected results, with a single notify() for all
+ *  their messages, then a single processCaptureResult() holding for each
+ *  frame its metadata and its buffers.
+ *
+ */
+void V4l2CameraDeviceSession::sendFrameResults(
+    std::vector<FrameResult> &results) {
+  std::vector<NotifyMsg> notifies;
+  std::vector<CaptureResult> captures;
+
+  ssize_t timestamp_index;
   {
+    std::lock_guard lock(result_layout_mutex_);
+    timestamp_index = result_timestamp_index_;
+  }
+
+  for (FrameResult &result : results) {
+    if (result.request_error)
+      notifies.push_back(makeErrorMsg(result.frame_number, -1,
+                                      ErrorCode::ERROR_REQUEST));
+
+    if (result.shutter) {
+      NotifyMsg msg;
+      ShutterMsg shutter = {
+        .frameNumber = result.frame_number,
+        .timestamp = result.timestamp,
+        .readoutTimestamp = result.timestamp + result.exposure_time,
+      };
+      msg.set<NotifyMsg::Tag::shutter>(std::move(shutter));
+      notifies.push_back(std::move(msg));
+    }
+
+    if (result.result_error)
+      notifies.push_back(makeErrorMsg(result.frame_number, -1,
+                                      ErrorCode::ERROR_RESULT));
+
+    if (result.early_metadata) {
+      CaptureResult early = {
+        .frameNumber = result.frame_number,
+        .fmqResultSize = 0,
+        .partialResult = 1
+      };
+      early.inputBuffer.streamId = -1;
+
+      writeResultMetadata(*result.early_metadata, &early);
+      captures.push_back(std::move(early));
+    }
+
+    CaptureResult capture = {
+      .frameNumber = result.frame_number,
+      .fmqResultSize = 0,
+      .partialResult = 0
+    };
+    capture.inputBuffer.streamId = -1;
+
+    if (result.metadata) {
+      /* The final result is only read from here, the timestamp of the
+       * capture is set in place, at its index in the layout.
+       */
+      updateEntryAt(result.metadata.get(), timestamp_index,
+                    ANDROID_SENSOR_TIMESTAMP, &result.timestamp, 1);
+
+      writeResultMetadata(*result.metadata, &capture);
+      capture.partialResult = partial_result_count_;
+    }
+
+    for (CompletedBuffer &completed : result.buffers) {
+      StreamBuffer &sb = completed.buffer;
+
+      /* All the buffers of a failed request are in error */
+      if (result.request_failed) {
+        sb.status = BufferStatus::ERROR;
+      } else if (completed.error) {
+        ALOGE("%s: buffer error frame: %d, stream: %d",
+                  __func__, result.frame_number, sb.streamId);
+        notifies.push_back(makeErrorMsg(result.frame_number, sb.streamId,
+                                        ErrorCode::ERROR_BUFFER));
+      }
+
+      capture.outputBuffers.push_back(std::move(sb));
+    }
+
+    if (result.metadata || !capture.outputBuffers.empty())
+      captures.push_back(std::move(capture));
+  }
+
+  ALOGV("%s: %zu frames, %zu messages, %zu results", __func__,
+            results.size(), notifies.size(), captures.size());
+
+  /* The shutters must be notified before the results of their frame */
+  if (!notifies.empty())
+    callback_->notify(std::move(notifies));
+
+  if (!captures.empty()) {
     /* the callback must not be called concurently */
     std::lock_guard lock(result_mutex_);
-    callback_->processCaptureResult(std::move(results));
+    callback_->processCaptureResult(std::move(captures));
+  }
+
+  for (const FrameResult &result : results) {
+    if (result.first_partial)
+      updatePartialResultStats(result.intake_time);
+  }
+}
+
+/* Track the delay to the first partial results, logged periodically.
+ * Only called from the result thread.
+ */
+void V4l2CameraDeviceSession::updatePartialResultStats(int64_t intake_time) {
+  PartialResultStats &stats = partial_result_stats_;
+  int64_t delay = systemTime(SYSTEM_TIME_MONOTONIC) - intake_time;
+
+  ++stats.count;
+  stats.total_ns += delay;
+  stats.max_ns = std::max(stats.max_ns, delay);
+
+  if (stats.count < PARTIAL_RESULT_STATS_PERIOD)
+    return;
+
+  ALOGI("%s (%d): first partial result after %" PRId64 " us on average, "
+        "%" PRId64 " us at most, over %u frames", __func__, config_.id,
+        stats.total_ns / stats.count / 1000, stats.max_ns / 1000, stats.count);
+
+  stats = PartialResultStats();
+}
+
+void V4l2CameraDeviceSession::stopPipeline() {
+  {
+    std::lock_guard lock(pipeline_mutex_);
+    pipeline_active_ = false;
   }
+  pipeline_cond_.notify_all();
+  request_cond_.notify_all();
+  result_cond_.notify_all();
+
+  if (request_thread_) {
+    request_thread_->join();
+    request_thread_.reset();
+  }
+
+  if (result_thread_) {
+    result_thread_->join();
+    result_thread_.reset();
+  }
+
+  /* Nothing sends the results anymore: the buffers of the requests left in
+   * the pipeline are returned now, since the framework waits for them.
+   */
+  std::vector<FrameResult> results;
+  {
+    std::lock_guard lock(pipeline_mutex_);
+    failPendingRequestsLocked();
+    collectFrameResultsLocked(&results);
+  }
+
+  if (!results.empty())
+    sendFrameResults(results);
+}
+
+/* Put |metadata| in |result|, through the result FMQ when possible */
+void V4l2CameraDeviceSession::writeResultMetadata(
+    const helper::CameraMetadata &metadata, CaptureResult *result) {
+  const camera_metadata_t *raw_metadata = metadata.getAndLock();
+  uint32_t size = get_camera_metadata_size(raw_metadata);
+  const int8_t *data = reinterpret_cast<const int8_t *>(raw_metadata);
+
+  bool res = result_metadata_queue_->write(data, size);
+  if (!res) {
+    ALOGE("%s: failed to write metadata to FMQ", __func__);
+    result->fmqResultSize = 0;
+    result->result.metadata = std::vector<uint8_t>(data, data + size);
+  } else {
+    result->fmqResultSize = size;
+  }
+
+  metadata.unlock(raw_metadata);
 }
 
 void V4l2CameraDeviceSession::processCaptureRequestError(
-    const CaptureRequest &request, ErrorCode error) {
-  NotifyMsg error_msg;
-  ErrorMsg msg = {
-    .frameNumber = request.frameNumber,
-    .errorStreamId = -1,
-    .errorCode = error,
-  };
-  error_msg.set<NotifyMsg::Tag::error>(std::move(msg));
-  callback_->notify({ std::move(error_msg) });
+    int32_t frame_number, ErrorCode error) {
+  callback_->notify({ makeErrorMsg(frame_number, -1, error) });
 
   if (error == ErrorCode::ERROR_DEVICE)
     close();
@@ -752,36 +1658,20 @@ void V4l2CameraDeviceSession::processCaptureRequestError(
 
 void V4l2CameraDeviceSession::processCaptureBufferError(
     const V4l2Stream::TrackedStreamBuffer &tsb) {
-  ALOGE("%s: buffer error frame: %d, stream: %d",
-            __func__, tsb.frame_number, tsb.stream_id);
-  NotifyMsg error_msg;
-  ErrorMsg error = {
-    .frameNumber = tsb.frame_number,
-    .errorStreamId = tsb.stream_id,
-    .errorCode = ErrorCode::ERROR_BUFFER
-  };
-  error_msg.set<NotifyMsg::Tag::error>(std::move(error));
-  callback_->notify({ std::move(error_msg) });
-
-  V4l2Stream::TrackedStreamBuffer aux = tsb;
-  aux.status = BufferStatus::ERROR;
-  aux.release_fence = tsb.acquire_fence;
-
-  processCaptureBufferResult(std::move(aux));
+  completeBuffer(tsb, true);
 }
 
 void V4l2CameraDeviceSession::processCaptureBufferResult(
     const V4l2Stream::TrackedStreamBuffer &tsb) {
   ALOGV("%s: buffer result frame: %d, stream: %d",
             __func__, tsb.frame_number, tsb.stream_id);
-  StreamBuffer sb = {
-    .streamId = tsb.stream_id,
-    .bufferId = tsb.buffer_id,
-    .status = tsb.status,
-    .releaseFence = makeToAidlIfNotNull(tsb.release_fence)
-  };
+  completeBuffer(tsb, false);
+}
+
+void V4l2CameraDeviceSession::sendBufferResult(int32_t frame_number,
+                                               StreamBuffer &&sb) {
   CaptureResult result = {
-    .frameNumber = tsb.frame_number,
+    .frameNumber = frame_number,
     .fmqResultSize = 0,
     .partialResult = 0
   };
@@ -20,10 +20,16 @@
 
 #include <log/log.h>
 
+#include <cutils/properties.h>
 #include <linux/v4l2-subdev.h>
+#include <sync/sync.h>
+#include <sys/eventfd.h>
+#include <utils/Timers.h>
 
 #include <inttypes.h>
 
+#include <algorithm>
+
 #include <arc/image_processor.h>
 #include <arc/cached_frame.h>
 
@@ -52,8 +58,21 @@ static const std::map<uint32_t, uint32_t> v4l2_to_bus = {
   { V4L2_PIX_FMT_NV61, MEDIA_BUS_FMT_YVYU8_1X16 },
   { V4L2_PIX_FMT_YUV420, MEDIA_BUS_FMT_UYVY8_1_5X8 },
   { V4L2_PIX_FMT_YVU420, MEDIA_BUS_FMT_VYUY8_1_5X8 },
+  { V4L2_PIX_FMT_NV12M, MEDIA_BUS_FMT_YUYV8_1_5X8 },
+  { V4L2_PIX_FMT_NV21M, MEDIA_BUS_FMT_YVYU8_1_5X8 },
+  { V4L2_PIX_FMT_NV16M, MEDIA_BUS_FMT_YUYV8_1X16 },
+  { V4L2_PIX_FMT_NV61M, MEDIA_BUS_FMT_YVYU8_1X16 },
+  { V4L2_PIX_FMT_YUV420M, MEDIA_BUS_FMT_UYVY8_1_5X8 },
+  { V4L2_PIX_FMT_YVU420M, MEDIA_BUS_FMT_VYUY8_1_5X8 },
 };
 
+#define DMABUF_PROPERTY "vendor.camera.dmabuf.enable"
+#define MEDIA_REQUEST_PROPERTY "vendor.camera.media_request.enable"
+#define MEDIA_NODE_PROPERTY "vendor.camera.media.node"
+#define MEDIA_NODE_DEFAULT "/dev/media0"
+#define HW_SCALING_PROPERTY "vendor.camera.hw_scaling.enable"
+#define FENCE_TIMEOUT_MS 1000
+
 static bool IsAidlNativeHandleNull(const NativeHandle &handle) {
   return (handle.fds.size() == 0 && handle.ints.size() == 0);
 }
@@ -71,13 +90,164 @@ static native_handle_t *dupFromAidlIfNotNull(const NativeHandle &handle) {
   return dupFromAidl(handle);
 }
 
+/* The stride, in bytes, of the gralloc buffers of |fourcc|: the one the HAL
+ * writes the converted frames with, see ImageProcessor. 0 if unknown.
+ */
+static uint32_t grallocStride(uint32_t fourcc, uint32_t width) {
+  switch (fourcc) {
+    case V4L2_PIX_FMT_YVU420:
+      return (width + 15) & ~15;
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+      return width;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_RGB565:
+      return width * 2;
+    case V4L2_PIX_FMT_RGB24:
+      return width * 3;
+    case V4L2_PIX_FMT_ABGR32:
+    case V4L2_PIX_FMT_ARGB32:
+      return width * 4;
+    default:
+      return 0;
+  }
+}
+
+/* The stride, in bytes, of color plane |plane| of the gralloc buffers of
+ * |fourcc|. YV12 chroma lines are aligned on 16 bytes too.
+ */
+static uint32_t grallocPlaneStride(uint32_t fourcc, uint32_t width,
+                                   size_t plane) {
+  if (plane == 0)
+    return grallocStride(fourcc, width);
+
+  switch (fourcc) {
+    case V4L2_PIX_FMT_YVU420:
+      return (width / 2 + 15) & ~15;
+    case V4L2_PIX_FMT_YUV420:
+      return width / 2;
+    default:
+      return grallocStride(fourcc, width);
+  }
+}
+
+/* The stride, in bytes, of color plane |plane| of the driver buffers of
+ * |fourcc|, from the bytes per line of the buffer planes. The chroma lines
+ * of a planar format stored in a single buffer are half as long.
+ */
+static uint32_t driverPlaneStride(uint32_t fourcc,
+                                  const std::vector<uint32_t> &strides,
+                                  size_t plane) {
+  if (strides.size() > 1)
+    return plane < strides.size() ? strides[plane] : 0;
+
+  if (strides.empty())
+    return 0;
+
+  if (plane > 0 && (StreamFormat::ContiguousPixelFormat(fourcc) ==
+                        V4L2_PIX_FMT_YUV420 ||
+                    StreamFormat::ContiguousPixelFormat(fourcc) ==
+                        V4L2_PIX_FMT_YVU420))
+    return strides[0] / 2;
+
+  return strides[0];
+}
+
+/* The color planes of a |fourcc| frame, as the bytes of each line and the
+ * number of lines. Empty if the layout is unknown.
+ */
+struct ColorPlane {
+  uint32_t line_size;
+  uint32_t lines;
+};
+
+static std::vector<ColorPlane> colorPlanes(uint32_t fourcc, uint32_t width,
+                                           uint32_t height) {
+  switch (fourcc) {
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+      return {{width, height}, {width, height / 2}};
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+      return {{width, height}, {width, height}};
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+      return {{width, height}, {width / 2, height / 2},
+              {width / 2, height / 2}};
+    default: {
+      uint32_t line_size = grallocStride(fourcc, width);
+      if (!line_size)
+        return {};
+
+      return {{line_size, height}};
+    }
+  }
+}
+
+/* The layout of the color planes of the single buffer YUV frames the driver
+ * captures, as gralloc describes it: offsets are from the start of the luma
+ * plane.
+ */
+struct YCbCrPlanes {
+  uint32_t y_stride;
+  uint32_t c_stride;
+  uint32_t chroma_step;
+  size_t cb_offset;
+  size_t cr_offset;
+};
+
+/* The layout of the |fourcc| frames the driver captures with the |strides|
+ * bytes per line, |height| lines high.
+ *
+ * @return false if unknown, e.g. for packed formats
+ */
+static bool driverYCbCrPlanes(uint32_t fourcc,
+                              const std::vector<uint32_t> &strides,
+                              uint32_t height, YCbCrPlanes *planes) {
+  if (strides.size() != 1)
+    return false;
+
+  uint32_t stride = strides[0];
+  size_t luma_size = static_cast<size_t>(stride) * height;
+  size_t chroma_size = static_cast<size_t>(stride / 2) * (height / 2);
+
+  switch (fourcc) {
+    case V4L2_PIX_FMT_YUV420:
+      *planes = {stride, stride / 2, 1, luma_size, luma_size + chroma_size};
+      return true;
+    case V4L2_PIX_FMT_YVU420:
+      *planes = {stride, stride / 2, 1, luma_size + chroma_size, luma_size};
+      return true;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV16:
+      *planes = {stride, stride, 2, luma_size, luma_size + 1};
+      return true;
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV61:
+      *planes = {stride, stride, 2, luma_size + 1, luma_size};
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Whether the planes of |fourcc| frames are stored in separate buffers. Such
+ * frames are only copied as is, ImageProcessor reading the first plane only.
+ */
+static bool hasSeparatePlanes(uint32_t fourcc) {
+  return StreamFormat::ContiguousPixelFormat(fourcc) != fourcc;
+}
+
 MapperHelper V4l2Stream::mapper_helper_;
 
-std::shared_ptr<V4l2Stream> V4l2Stream::Create(const V4l2StreamConfig& config,
-                                               const Stream &stream,
-                                               CallbackInterface *cb) {
+std::shared_ptr<V4l2Stream> V4l2Stream::Create(
+    const V4l2StreamConfig& config, const Stream &stream,
+    CallbackInterface *cb, const std::array<int32_t, 2> &fps_range) {
   std::shared_ptr<V4l2Stream> res = std::make_shared<V4l2Stream>(config,
-                                                                 stream, cb);
+                                                                 stream, cb,
+                                                                 fps_range);
   if (res == nullptr) {
     ALOGE("%s (%s): Cannot Create V4l2Stream !", __func__, config.node);
     return nullptr;
@@ -93,13 +263,24 @@ std::shared_ptr<V4l2Stream> V4l2Stream::Create(const V4l2StreamConfig& config,
 }
 
 V4l2Stream::V4l2Stream(const V4l2StreamConfig& config, const Stream &stream,
-                       CallbackInterface *cb)
+                       CallbackInterface *cb,
+                       const std::array<int32_t, 2> &fps_range)
   : config_(config),
     stream_(stream),
     cb_(cb),
     v4l2_wrapper_(new V4L2Wrapper(config.node)),
     connection_(nullptr),
+    fps_range_(fps_range),
+    frame_duration_range_({0, 0}),
+    frame_duration_(0),
+    memory_(V4L2_MEMORY_MMAP),
+    dmabuf_rejected_(false),
+    driver_format_(0, 0, 0),
+    num_v4l2_buffers_(0),
+    v4l2_buffer_size_(0),
+    blob_buffer_size_(0),
     capture_active_(false),
+    wakeup_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
     started_(false)
 { }
 
@@ -107,6 +288,10 @@ V4l2Stream::~V4l2Stream()
 {
   flush();
 
+  /* The next user of the pipeline may be another process */
+  if (graph_ != nullptr)
+    graph_->InvalidateConfiguration();
+
   /* Free all allocated v4l2 buffers.
    * This will also unmap buffers
    */
@@ -127,42 +312,43 @@ V4l2Stream::~V4l2Stream()
     capture_active_ = false;
   }
   capture_cond_.notify_all();
+  wakeupCaptureThread();
   if (capture_result_thread_)
     capture_result_thread_->join();
 }
 
 Status V4l2Stream::initialize() {
+  if (wakeup_fd_.get() < 0) {
+    ALOGE("%s (%s): cannot create capture wakeup eventfd: %s !",
+              __func__, config_.node, strerror(errno));
+    return Status::INTERNAL_ERROR;
+  }
+
   /* New connection to the V4L2 camera */
   connection_.reset(new V4L2Wrapper::Connection(v4l2_wrapper_));
   if (connection_->status()) {
     ALOGE("%s (%s): v4l2 connection failure: %d !",
               __func__, config_.node, connection_->status());
+    /* The node is gone, another device may show up at the same path */
+    V4L2CapabilityCache::GetInstance().Invalidate(config_.node);
     return Status::CAMERA_DISCONNECTED;
   }
 
-  /* Retrieve all supported formats */
-  std::set<uint32_t> v4l2_pixel_format;
-  if (v4l2_wrapper_->GetFormats(&v4l2_pixel_format)) {
-    ALOGE("%s (%s): failed to get formats !", __func__, config_.node);
-    return Status::INTERNAL_ERROR;
-  }
-
-  if (v4l2_wrapper_->GetSupportedFormats(v4l2_pixel_format,
-                                         &supported_formats_)) {
+  /* Retrieve all supported formats, only enumerated once per node */
+  if (V4L2CapabilityCache::GetInstance().GetCapabilities(v4l2_wrapper_,
+                                                         &capabilities_)) {
     ALOGE("%s (%s): failed to get supported formats !", __func__, config_.node);
     return Status::INTERNAL_ERROR;
   }
 
-  std::vector<uint32_t> v4l2_qualified_format;
-  if (ImageProcessor::GetQualifiedFormats(v4l2_pixel_format,
-                                          &v4l2_qualified_format)) {
+  supported_formats_ = capabilities_->supported_formats;
+
+  if (ImageProcessor::GetQualifiedFormats(capabilities_->formats,
+                                          &qualified_formats_)) {
     ALOGE("%s (%s): can't get qualified formats !", __func__, config_.node);
     return Status::INTERNAL_ERROR;
   }
 
-  qualified_formats_ = StreamFormat::GetQualifiedStreams(v4l2_qualified_format,
-                                                         supported_formats_);
-
 
   Status status = configureDriver();
   if (status != Status::OK)
@@ -188,6 +374,162 @@ Status V4l2Stream::configureDriver() {
   if (status != Status::OK)
     return status;
 
+  const std::array<int64_t, 2> *durations =
+                                    capabilities_->FrameDurations(format);
+  frame_duration_range_ = durations ? *durations : std::array<int64_t, 2>{};
+  /* The driver may reset the frame interval along with the format */
+  frame_duration_ = 0;
+  configureFrameRate();
+
+  return configureBuffers(format);
+}
+
+/* Whether the driver can capture |format| at the maximum of the target FPS
+ * range. Formats without frame interval information are assumed to.
+ */
+bool V4l2Stream::supportsFrameRate(const StreamFormat &format) {
+  if (fps_range_[1] <= 0)
+    return true;
+
+  const std::array<int64_t, 2> *durations =
+                                    capabilities_->FrameDurations(format);
+  if (durations == nullptr || (*durations)[0] <= 0)
+    return true;
+
+  return (*durations)[0] <= 1000000000LL / fps_range_[1];
+}
+
+/* Program the frame interval matching the maximum of the target FPS range,
+ * within what the current format allows. S_PARM is only issued when the
+ * interval changes, and never while streaming: the change is then applied
+ * when the stream is started again.
+ */
+void V4l2Stream::configureFrameRate() {
+  if (fps_range_[1] <= 0 || frame_duration_range_[0] <= 0)
+    return;
+
+  int64_t duration = 1000000000LL / fps_range_[1];
+  duration = std::clamp(duration, frame_duration_range_[0],
+                        frame_duration_range_[1]);
+  if (duration == frame_duration_)
+    return;
+
+  if (started_) {
+    ALOGV("%s (%s): frame duration %" PRId64 " ns deferred until stream on",
+              __func__, config_.node, duration);
+    return;
+  }
+
+  int64_t applied = 0;
+
+  int res = v4l2_wrapper_->SetFrameDuration(duration, &applied);
+  if (res) {
+    ALOGW("%s (%s): cannot set frame duration %" PRId64 " ns: %d",
+              __func__, config_.node, duration, res);
+    return;
+  }
+
+  frame_duration_ = duration;
+
+  ALOGI("%s (%s): frame duration %" PRId64 " ns for FPS range [%d, %d]",
+            __func__, config_.node, applied, fps_range_[0], fps_range_[1]);
+}
+
+void V4l2Stream::updateFrameRate(const helper::CameraMetadata &settings) {
+  camera_metadata_ro_entry entry =
+                            settings.find(ANDROID_CONTROL_AE_TARGET_FPS_RANGE);
+  if (entry.count != 2)
+    return;
+
+  std::array<int32_t, 2> fps_range = {entry.data.i32[0], entry.data.i32[1]};
+  if (fps_range == fps_range_)
+    return;
+
+  fps_range_ = fps_range;
+  configureFrameRate();
+}
+
+bool V4l2Stream::canImportBuffers(const StreamFormat &format) {
+  if (!property_get_bool(DMABUF_PROPERTY, false) || dmabuf_rejected_)
+    return false;
+
+  /* JPEG blobs need a transport header appended by the HAL */
+  if (format.v4l2_pixel_format() == V4L2_PIX_FMT_JPEG)
+    return false;
+
+  /* The driver can only write into the framework buffer when no conversion
+   * or scaling is needed. Formats whose planes are stored in separate buffers
+   * never match, the framework buffer being a single dma-buf.
+   */
+  uint32_t fourcc = StreamFormat::HalToV4L2PixelFormat(
+      stream_.format, config_.implementation_defined_format);
+
+  if (format.v4l2_pixel_format() != fourcc ||
+      format.width() != static_cast<uint32_t>(stream_.width) ||
+      format.height() != static_cast<uint32_t>(stream_.height))
+    return false;
+
+  /* The gralloc layout of packed formats cannot be checked, the mapper
+   * only reporting the stride of YUV buffers.
+   */
+  std::vector<uint32_t> strides = v4l2_wrapper_->GetPlaneStrides();
+  YCbCrPlanes planes;
+  if (!driverYCbCrPlanes(fourcc, strides, format.height(), &planes)) {
+    ALOGI("%s (%s): layout of format 0x%x cannot be checked", __func__,
+              config_.node, fourcc);
+    return false;
+  }
+
+  /* The driver lines must be laid out like the gralloc ones, see
+   * hasDriverLayout() for the actual buffers.
+   */
+  for (size_t plane = 0; plane < colorPlanes(fourcc, 0, 0).size(); ++plane) {
+    uint32_t driver_stride = driverPlaneStride(fourcc, strides, plane);
+    uint32_t gralloc_stride = grallocPlaneStride(fourcc, stream_.width, plane);
+
+    if (driver_stride != gralloc_stride) {
+      ALOGI("%s (%s): plane %zu driver stride %u does not match gralloc "
+            "stride %u", __func__, config_.node, plane, driver_stride,
+                gralloc_stride);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ *  This method stops capturing into the framework buffers, whose layout
+ *  does not match the driver one: the frames are copied from driver buffers
+ *  instead. Only possible before streaming.
+ *
+ *  @return Status::OK on success
+ *
+ */
+Status V4l2Stream::fallbackToMmap() {
+  std::lock_guard l(v4l2_buffer_mutex_);
+
+  if (memory_ != V4L2_MEMORY_DMABUF)
+    return Status::OK;
+
+  if (started_) {
+    ALOGE("%s (%s): cannot change the buffers while streaming",
+              __func__, config_.node);
+    return Status::INTERNAL_ERROR;
+  }
+
+  ALOGW("%s (%s): framework buffer layout does not match the driver one, "
+        "fallback to MMAP", __func__, config_.node);
+
+  dmabuf_rejected_ = true;
+
+  return configureBuffers(driver_format_);
+}
+
+Status V4l2Stream::configureBuffers(const StreamFormat &format) {
+  driver_format_ = format;
+  memory_ = canImportBuffers(format) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+
   /* request some buffer to the driver and get the actual allocated buffer and
    * their size
    */
@@ -195,29 +537,72 @@ Status V4l2Stream::configureDriver() {
   uint32_t buffer_size = 0;
 
   int res = v4l2_wrapper_->RequestBuffers(config_.num_buffers,
-                                          &num_done, &buffer_size);
+                                          &num_done, &buffer_size, memory_);
+  if (res && memory_ == V4L2_MEMORY_DMABUF) {
+    ALOGW("%s (%s): driver refused DMABUF mode, fallback to MMAP",
+              __func__, config_.node);
+    memory_ = V4L2_MEMORY_MMAP;
+    res = v4l2_wrapper_->RequestBuffers(config_.num_buffers,
+                                        &num_done, &buffer_size, memory_);
+  }
+
   if (res || num_done == 0 || buffer_size == 0) {
     ALOGE("%s (%s): Request buffers for new format failed: %d !",
               __func__, config_.node, res);
     return Status::INTERNAL_ERROR;
   }
 
-  int32_t fd = -1;
+  num_v4l2_buffers_ = num_done;
+  v4l2_buffer_size_ = buffer_size;
+
+  /* Optionally queue each buffer through its own media request. The
+   * requests only carry the buffers: no request setting is mapped to a V4L2
+   * control of the stream device yet.
+   */
+  if (property_get_bool(MEDIA_REQUEST_PROPERTY, false)) {
+    char media_node[PROPERTY_VALUE_MAX];
+    property_get(MEDIA_NODE_PROPERTY, media_node, MEDIA_NODE_DEFAULT);
+
+    if (v4l2_wrapper_->EnableRequests(media_node))
+      ALOGW("%s (%s): media requests not available", __func__,
+                config_.node);
+  }
+
+  if (memory_ == V4L2_MEMORY_DMABUF) {
+    ALOGI("%s (%s): capture directly into framework buffers: format 0x%x "
+          "(%dx%d), size: %d", __func__, config_.node,
+              format.v4l2_pixel_format(), format.width(), format.height(),
+              buffer_size);
+    return Status::OK;
+  }
+
+  /* Each plane of a multi-planar buffer is exported and mapped on its own */
+  std::vector<uint32_t> plane_sizes = v4l2_wrapper_->GetPlaneSizes();
+
   for (size_t i = 0; i < num_done; ++i) {
-    res = v4l2_wrapper_->ExportBuffer(i, &fd);
-    if (res) {
-      ALOGE("%s (%s): can't get v4l2 allocated buffer: %d !",
-                __func__, config_.node, res);
-      return Status::INTERNAL_ERROR;
+    std::vector<base::unique_fd> fds;
+
+    for (size_t plane = 0; plane < plane_sizes.size(); ++plane) {
+      int32_t fd = -1;
+
+      res = v4l2_wrapper_->ExportBuffer(i, plane, &fd);
+      if (res) {
+        ALOGE("%s (%s): can't get v4l2 allocated buffer: %d !",
+                  __func__, config_.node, res);
+        return Status::INTERNAL_ERROR;
+      }
+
+      fds.emplace_back(fd);
     }
 
-    ALOGV("%s (%s): export buffer %zu: format 0x%x (%dx%d), size: %d",
-              __func__, config_.node, i, format.v4l2_pixel_format(),
-              format.width(), format.height(), buffer_size);
+    ALOGV("%s (%s): export buffer %zu: format 0x%x (%dx%d), size: %d, "
+          "planes: %zu", __func__, config_.node, i,
+              format.v4l2_pixel_format(), format.width(), format.height(),
+              buffer_size, plane_sizes.size());
 
     std::unique_ptr<arc::V4L2FrameBuffer> v4l2_buffer =
-        std::make_unique<arc::V4L2FrameBuffer>(base::unique_fd(fd),
-                                               buffer_size,
+        std::make_unique<arc::V4L2FrameBuffer>(std::move(fds),
+                                               plane_sizes,
                                                format.width(),
                                                format.height(),
                                                format.v4l2_pixel_format());
@@ -240,41 +625,235 @@ Status V4l2Stream::findBestFitFormat(const Stream &stream,
   ALOGV("%s (%s): framework requesting format %x = %x (%dx%d)",
             __func__, config_.node, stream.format, format, width, height);
 
+  /* Candidates by preference: the needed format itself, then the
+   * qualified formats it can be converted from.
+   */
+  StreamFormats candidates;
+
   int index = StreamFormat::FindMatchingFormat(supported_formats_,
                                                format, width, height);
-  if (index >= 0) {
-    *stream_format = supported_formats_[index];
-    return Status::OK;
-  }
-
-  ALOGI("%s (%s): the driver doesn't support the needed format (0x%x)",
-            __func__, config_.node, format);
+  if (index >= 0)
+    candidates.push_back(supported_formats_[index]);
+  else
+    ALOGI("%s (%s): the driver doesn't support the needed format (0x%x)",
+              __func__, config_.node, format);
 
-  /* The driver can't use the format.
-   * Check if the requested format can be converted from YU12.
+  /* Check if the requested format can be converted from YU12.
    * For now, all conversion will be done through CachedFrame which will
    * imediately convert the qualified format into YU12.
    */
-  if (!ImageProcessor::SupportsConversion(V4L2_PIX_FMT_YUV420, format)) {
+  if (ImageProcessor::SupportsConversion(V4L2_PIX_FMT_YUV420, format)) {
+    for (uint32_t qualified_format : qualified_formats_) {
+      index = StreamFormat::FindMatchingFormat(supported_formats_,
+                                               qualified_format, width, height);
+      if (index >= 0 &&
+          !hasSeparatePlanes(supported_formats_[index].v4l2_pixel_format()))
+        candidates.push_back(supported_formats_[index]);
+    }
+  }
+
+  /* The size is not enumerated by the driver, it has to be scaled */
+  if (candidates.empty())
+    return findScaledFormat(format, width, height, stream_format);
+
+  /* Prefer the first candidate reaching the target frame rate */
+  *stream_format = candidates.front();
+  for (const StreamFormat &candidate : candidates) {
+    if (supportsFrameRate(candidate)) {
+      *stream_format = candidate;
+      break;
+    }
+  }
+
+  if (StreamFormat::ContiguousPixelFormat(stream_format->v4l2_pixel_format()) !=
+      format)
+    ALOGI("%s (%s): found qualified format 0x%x", __func__, config_.node,
+              stream_format->v4l2_pixel_format());
+
+  return Status::OK;
+}
+
+/*
+ *  This method looks for a format to capture a size the driver does not
+ *  enumerate. By preference:
+ *   - the subdev composes the exact size, no software processing is needed,
+ *   - the subdev composes the nearest size it can, software scales the rest,
+ *   - the smallest enumerated size covering the request, scaled by software,
+ *     preferably of the same aspect ratio.
+ *  Software scaling is done by CachedFrame, from a qualified format. It
+ *  crops the center of sources of another aspect ratio instead of
+ *  stretching them.
+ *
+ *  @return Status::OK on success
+ *          Status::ILLEGAL_ARGUMENT if the size cannot be produced
+ *
+ */
+Status V4l2Stream::findScaledFormat(uint32_t format, uint32_t width,
+                                    uint32_t height,
+                                    StreamFormat *stream_format) {
+  bool can_scale = ImageProcessor::SupportsConversion(V4L2_PIX_FMT_YUV420,
+                                                      format);
+  uint32_t buffer_type = v4l2_wrapper_->GetBufferType();
+
+  /* Driver formats to try by preference: the needed one, then those it can
+   * be converted from.
+   */
+  std::vector<uint32_t> fourccs;
+  for (uint32_t fourcc : capabilities_->formats) {
+    if (StreamFormat::ContiguousPixelFormat(fourcc) == format)
+      fourccs.push_back(fourcc);
+  }
+  if (can_scale)
+    fourccs.insert(fourccs.end(), qualified_formats_.begin(),
+                   qualified_formats_.end());
+
+  std::shared_ptr<MediaGraph> graph;
+  MediaGraph::Subdev subdev;
+  std::unique_ptr<StreamFormat> nearest;
+
+  uint32_t compose_width = width;
+  uint32_t compose_height = height;
+
+  if (property_get_bool(HW_SCALING_PROPERTY, true) &&
+      getPipelineSubdev(&graph, &subdev) == 0 &&
+      graph->TryCompose(subdev, &compose_width, &compose_height) == 0) {
+    for (uint32_t fourcc : fourccs) {
+      /* The video node must accept the composed size as is */
+      StreamFormat composed(fourcc, compose_width, compose_height,
+                            buffer_type);
+      StreamFormat result(0, 0, 0);
+      if (v4l2_wrapper_->TryFormat(composed, &result) ||
+          result.v4l2_pixel_format() != fourcc ||
+          result.width() != compose_width ||
+          result.height() != compose_height)
+        continue;
+
+      if (compose_width == width && compose_height == height) {
+        ALOGI("%s (%s): hardware scaling to %dx%d, format 0x%x",
+                  __func__, config_.node, width, height, fourcc);
+        *stream_format = composed;
+        return Status::OK;
+      }
+
+      /* The rest has to be scaled by software, from a qualified format */
+      bool qualified = std::find(qualified_formats_.begin(),
+                                 qualified_formats_.end(),
+                                 fourcc) != qualified_formats_.end();
+      if (can_scale && qualified && !hasSeparatePlanes(fourcc) &&
+          nearest == nullptr)
+        nearest = std::make_unique<StreamFormat>(composed);
+    }
+  }
+
+  if (nearest != nullptr) {
+    ALOGI("%s (%s): hardware scaling to %dx%d, software scaling to %dx%d",
+              __func__, config_.node, nearest->width(), nearest->height(),
+              width, height);
+    *stream_format = *nearest;
+    return Status::OK;
+  }
+
+  if (!can_scale) {
     ALOGE("%s (%s): conversion between YU12 and 0x%x is not supported !",
               __func__, config_.node, format);
     return Status::ILLEGAL_ARGUMENT;
   }
 
-  /* The format can be converted from YU12, find a qualified format */
-  index = StreamFormat::FindFormatByResolution(qualified_formats_,
-                                                   width, height);
-  if (index >= 0) {
-    *stream_format = qualified_formats_[index];
-    ALOGI("%s (%s): found qualified format 0x%x at index %d", __func__,
-              config_.node, stream_format->v4l2_pixel_format(), index);
-    return Status::OK;
+  /* Last resort: downscale the smallest enumerated size covering the
+   * request, or upscale the largest one. Sizes of the same aspect ratio as
+   * the request are preferred, as they need no cropping.
+   */
+  auto same_ratio = [width, height](const StreamFormat &f) {
+    return static_cast<uint64_t>(f.width()) * height ==
+           static_cast<uint64_t>(f.height()) * width;
+  };
+
+  const StreamFormat *best = nullptr;
+  for (uint32_t fourcc : qualified_formats_) {
+    if (hasSeparatePlanes(fourcc))
+      continue;
+
+    for (const StreamFormat &supported : supported_formats_) {
+      if (supported.v4l2_pixel_format() != fourcc)
+        continue;
+
+      bool covers = supported.width() >= width && supported.height() >= height;
+      uint64_t area = static_cast<uint64_t>(supported.width()) *
+                      supported.height();
+
+      if (best == nullptr) {
+        best = &supported;
+        continue;
+      }
+
+      bool best_covers = best->width() >= width && best->height() >= height;
+      uint64_t best_area = static_cast<uint64_t>(best->width()) *
+                           best->height();
+
+      if (covers != best_covers) {
+        if (covers)
+          best = &supported;
+        continue;
+      }
+
+      if (same_ratio(supported) != same_ratio(*best)) {
+        if (same_ratio(supported))
+          best = &supported;
+        continue;
+      }
+
+      if ((covers && area < best_area) || (!covers && area > best_area))
+        best = &supported;
+    }
+
+    /* Qualified formats are by preference */
+    if (best != nullptr)
+      break;
+  }
+
+  if (best == nullptr) {
+    ALOGE("%s (%s): no format found to fullfill framework request !",
+              __func__, config_.node);
+    return Status::ILLEGAL_ARGUMENT;
+  }
+
+  ALOGI("%s (%s): software scaling from %dx%d to %dx%d, format 0x%x",
+            __func__, config_.node, best->width(), best->height(), width,
+            height, best->v4l2_pixel_format());
+  *stream_format = *best;
+
+  return Status::OK;
+}
+
+/*
+ *  This method gets the subdev feeding the video node, from the media graph.
+ *
+ *  @return 0 on success, a negative error code otherwise
+ *
+ */
+int V4l2Stream::getPipelineSubdev(std::shared_ptr<MediaGraph> *graph,
+                                  MediaGraph::Subdev *subdev) {
+  char media_node[PROPERTY_VALUE_MAX];
+  property_get(MEDIA_NODE_PROPERTY, media_node, MEDIA_NODE_DEFAULT);
+
+  *graph = MediaGraph::GetInstance(media_node);
+  if (*graph == nullptr) {
+    ALOGE("%s (%s): cannot get media graph of %s",
+              __func__, config_.node, media_node);
+    return -ENODEV;
   }
 
-  ALOGE("%s (%s): no format found to fullfill framework request !",
-            __func__, config_.node);
+  std::vector<MediaGraph::Subdev> subdevs;
+  int res = (*graph)->GetUpstreamSubdevs(config_.node, &subdevs);
+  if (res) {
+    ALOGE("%s (%s): cannot find v4l2 sub-device: %d",
+              __func__, config_.node, res);
+    return res;
+  }
 
-  return Status::ILLEGAL_ARGUMENT;
+  *subdev = subdevs.front();
+
+  return 0;
 }
 
 Status V4l2Stream::configurePipeline(const StreamFormat &format) {
@@ -291,53 +870,29 @@ Status V4l2Stream::configurePipeline(const StreamFormat &format) {
     return Status::INTERNAL_ERROR;
   }
 
-  std::string dev(config_.node);
-  std::string subdev = "/dev/v4l-subdev" + dev.substr(10);
-  int fd = open(subdev.c_str(), O_RDWR);
-  if (fd == -1) {
-    ALOGE("%s (%s): cannot open v4l2 sub-device %s (%d)",
-              __func__, config_.node, subdev.c_str(), errno);
+  std::shared_ptr<MediaGraph> graph;
+  MediaGraph::Subdev subdev;
+  if (getPipelineSubdev(&graph, &subdev))
     return Status::INTERNAL_ERROR;
-  }
 
-  v4l2_subdev_selection sel;
-  memset(&sel, 0, sizeof(sel));
-  sel.pad = 0;
-  sel.target = V4L2_SEL_TGT_COMPOSE;
-  sel.which = V4L2_SUBDEV_FORMAT_ACTIVE;
-  sel.r.left = 0;
-  sel.r.top = 0;
-  sel.r.width = format.width();
-  sel.r.height = format.height();
-  res = ioctl(fd, VIDIOC_SUBDEV_S_SELECTION, &sel);
-  if (res != 0) {
-    ALOGE("%s (%s): SUBDEV_S_SELECTION failed: %d", __func__, config_.node, res);
-    close(fd);
-    return Status::INTERNAL_ERROR;
-  }
+  graph_ = graph;
 
-  v4l2_subdev_format new_format;
-  new_format.pad = 1;
-  new_format.which = V4L2_SUBDEV_FORMAT_ACTIVE;
-  res = ioctl(fd, VIDIOC_SUBDEV_G_FMT, &new_format);
-  if (res != 0) {
-    ALOGE("%s (%s): SUBDEV_G_FMT failed: %d", __func__, config_.node, res);
-    close(fd);
+  /* Nothing is issued to the subdev if its configuration is unchanged */
+  res = graph->SetCompose(subdev, format.width(), format.height());
+  if (res) {
+    ALOGE("%s (%s): SUBDEV_S_SELECTION failed on %s: %d",
+              __func__, config_.node, subdev.path.c_str(), res);
     return Status::INTERNAL_ERROR;
   }
 
-  new_format.format.width = format.width();
-  new_format.format.height = format.height();
-  new_format.format.code = v4l2_to_bus.at(format.v4l2_pixel_format());
-  res = ioctl(fd, VIDIOC_SUBDEV_S_FMT, &new_format);
-  if (res != 0) {
-    ALOGE("%s (%s): SUBDEV_S_FMT failed: %d", __func__, config_.node, res);
-    close(fd);
+  res = graph->SetFormat(subdev, format.width(), format.height(),
+                         v4l2_to_bus.at(format.v4l2_pixel_format()));
+  if (res) {
+    ALOGE("%s (%s): SUBDEV_S_FMT failed on %s: %d",
+              __func__, config_.node, subdev.path.c_str(), res);
     return Status::INTERNAL_ERROR;
   }
 
-  close(fd);
-
   return Status::OK;
 }
 
@@ -363,13 +918,39 @@ Status V4l2Stream::processCaptureBuffer(
   if (status != Status::OK)
     return status;
 
+  native_handle_t *acquire_fence = dupFromAidlIfNotNull(sb.acquireFence);
+
+  /* The driver writes into an imported buffer as soon as it is queued, so
+   * the consumer must have released it first. The wait happens on the
+   * request thread, before taking the buffer lock the capture thread needs.
+   */
+  if (memory_ == V4L2_MEMORY_DMABUF && acquire_fence) {
+    int res = acquire_fence->numFds == 1 ?
+        sync_wait(acquire_fence->data[0], FENCE_TIMEOUT_MS) : 0;
+
+    native_handle_close(acquire_fence);
+    native_handle_delete(acquire_fence);
+    acquire_fence = nullptr;
+
+    if (res) {
+      ALOGE("%s (%s): acquire fence wait failed: %d !",
+                __func__, config_.node, res);
+      return Status::INTERNAL_ERROR;
+    }
+  }
+
   std::lock_guard l(v4l2_buffer_mutex_);
+  if (settings)
+    updateFrameRate(*settings);
+
   /* Make sure the stream is on. */
   if (!started_) {
+    /* Apply the frame rate changes requested while streaming */
+    configureFrameRate();
     v4l2_wrapper_->StreamOn();
 
     /* queue all buffers to the available list */
-    for (size_t i = 0; i < v4l2_buffers_.size(); ++i)
+    for (size_t i = 0; i < num_v4l2_buffers_; ++i)
       available_buffers_.push(i);
 
     started_ = true;
@@ -378,15 +959,24 @@ Status V4l2Stream::processCaptureBuffer(
   if (available_buffers_.empty()) {
     ALOGE("%s (%s): no v4l2 buffer available",
               __func__, config_.node);
+    if (acquire_fence) {
+      native_handle_close(acquire_fence);
+      native_handle_delete(acquire_fence);
+    }
     return Status::INTERNAL_ERROR;
   }
 
   int buffer_id = available_buffers_.front();
   available_buffers_.pop();
-  if (v4l2_wrapper_->EnqueueRequest(buffer_id)) {
-    ALOGE("%s (%s): can't requeue a buffer in the driver",
-              __func__, config_.node);
-    return Status::INTERNAL_ERROR;
+
+  status = enqueueDriverBuffer(buffer_id, sb);
+  if (status != Status::OK) {
+    available_buffers_.push(buffer_id);
+    if (acquire_fence) {
+      native_handle_close(acquire_fence);
+      native_handle_delete(acquire_fence);
+    }
+    return status;
   }
 
   TrackedStreamBuffer tsb = {
@@ -394,9 +984,10 @@ Status V4l2Stream::processCaptureBuffer(
     .stream_id = sb.streamId,
     .buffer_id = sb.bufferId,
     .status = BufferStatus::OK,
-    .acquire_fence = dupFromAidlIfNotNull(sb.acquireFence),
+    .acquire_fence = acquire_fence,
     .release_fence = nullptr,
-    .settings = settings
+    .settings = settings,
+    .timestamp = 0
   };
 
   {
@@ -408,6 +999,34 @@ Status V4l2Stream::processCaptureBuffer(
   return Status::OK;
 }
 
+Status V4l2Stream::enqueueDriverBuffer(int index, const StreamBuffer &sb) {
+  if (memory_ != V4L2_MEMORY_DMABUF) {
+    if (v4l2_wrapper_->EnqueueRequest(index)) {
+      ALOGE("%s (%s): can't requeue a buffer in the driver",
+                __func__, config_.node);
+      return Status::INTERNAL_ERROR;
+    }
+
+    return Status::OK;
+  }
+
+  buffer_handle_t buffer = getSavedBuffer(sb.bufferId);
+  if (buffer == nullptr || buffer->numFds < 1) {
+    ALOGE("%s (%s): buffer %" PRIu64 " has no dma-buf to import !",
+              __func__, config_.node, sb.bufferId);
+    return Status::INTERNAL_ERROR;
+  }
+
+  if (v4l2_wrapper_->EnqueueDmabufRequest(index, buffer->data[0],
+                                          v4l2_buffer_size_)) {
+    ALOGE("%s (%s): can't queue framework buffer in the driver",
+              __func__, config_.node);
+    return Status::INTERNAL_ERROR;
+  }
+
+  return Status::OK;
+}
+
 void V4l2Stream::captureRequestThread() {
   ALOGI("%s (%s): Capture Result Thread started", __func__, config_.node);
 
@@ -422,10 +1041,18 @@ void V4l2Stream::captureRequestThread() {
 
     capture_lock.unlock();
 
+    /* Sleep until the driver completes a buffer or we are woken up by a flush
+     * or the stream destruction. Driver errors are reported by the DQBUF.
+     */
+    int res = v4l2_wrapper_->WaitForBuffer(wakeup_fd_.get());
+    if (res == -EINTR)
+      continue;
+
     uint32_t index = 0;
-    int res = v4l2_wrapper_->DequeueRequest(&index);
+    int64_t timestamp = 0;
+    std::vector<uint32_t> plane_bytesused;
+    res = v4l2_wrapper_->DequeueRequest(&index, &timestamp, &plane_bytesused);
     if (res == -EAGAIN) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
       /* No v4l2 buffer available yet, continue */
       continue;
     }
@@ -448,17 +1075,23 @@ void V4l2Stream::captureRequestThread() {
     capture_queue_.pop();
     capture_lock.unlock();
 
+    tsb.timestamp = timestamp;
+
     Status status = Status::OK;
     if (res < 0) {
       ALOGE("%s (%s): V4L2 wrapped failed to dequeue buffer !",
                 __func__, config_.node);
       status = Status::INTERNAL_ERROR;
     } else {
-      /* Convert and copy the buffer into the client buffer */
-      std::unique_ptr<arc::V4L2FrameBuffer> &v4l2_buffer = v4l2_buffers_[index];
-      v4l2_buffer->SetDataSize(res);
-
-      status = processCaptureResultConversion(v4l2_buffer, tsb);
+      if (memory_ != V4L2_MEMORY_DMABUF) {
+        /* Convert and copy the buffer into the client buffer */
+        std::unique_ptr<arc::V4L2FrameBuffer> &v4l2_buffer =
+                                                        v4l2_buffers_[index];
+        if (v4l2_buffer->SetPlaneDataSizes(plane_bytesused))
+          status = Status::INTERNAL_ERROR;
+        else
+          status = processCaptureResultConversion(v4l2_buffer, tsb);
+      }
 
       /* Set the buffer index back to the available buffer list */
       {
@@ -487,6 +1120,13 @@ void V4l2Stream::captureRequestThread() {
   ALOGI("%s (%s): Capture Result Thread ended", __func__, config_.node);
 }
 
+void V4l2Stream::wakeupCaptureThread() {
+  uint64_t count = 1;
+  if (TEMP_FAILURE_RETRY(write(wakeup_fd_.get(), &count, sizeof(count))) < 0)
+    ALOGE("%s (%s): cannot wake up capture thread: %s",
+              __func__, config_.node, strerror(errno));
+}
+
 Status V4l2Stream::processCaptureResultConversion(
     const std::unique_ptr<arc::V4L2FrameBuffer> &v4l2_buffer,
     TrackedStreamBuffer &tsb) {
@@ -507,10 +1147,24 @@ Status V4l2Stream::processCaptureResultConversion(
    * GrallocFrameBuffer does not have support for the transformation to
    * [fourcc|, it will assume that the amount of data to lock is based on
    * |v4l2_buffer buffer_size|, otherwise it will use the
-   * ImageProcessor::ConvertedSize.
+   * ImageProcessor::ConvertedSize. BLOB buffers are locked as a whole, so
+   * that the JPEG encoder can write into them directly.
    */
+  uint32_t buffer_length = v4l2_buffer->GetDataSize();
+  if (fourcc == V4L2_PIX_FMT_JPEG) {
+    /* The transport header goes at the end of the BLOB buffer, whose size
+     * has nothing to do with the driver buffer.
+     */
+    if (!blob_buffer_size_) {
+      ALOGE("%s (%s): unknown BLOB buffer size !", __func__, config_.node);
+      return Status::INTERNAL_ERROR;
+    }
+
+    buffer_length = blob_buffer_size_;
+  }
+
   arc::GrallocFrameBuffer output_frame(
-      buffer, stream_.width, stream_.height, fourcc, v4l2_buffer->GetDataSize(),
+      buffer, stream_.width, stream_.height, fourcc, buffer_length,
       static_cast<int32_t>(stream_.usage) & (
           static_cast<int32_t>(BufferUsage::CPU_READ_MASK) |
           static_cast<int32_t>(BufferUsage::CPU_WRITE_MASK)
@@ -523,21 +1177,27 @@ Status V4l2Stream::processCaptureResultConversion(
     return Status::INTERNAL_ERROR;
   }
 
-  if (v4l2_buffer->GetFourcc() == fourcc &&
+  if (StreamFormat::ContiguousPixelFormat(v4l2_buffer->GetFourcc()) ==
+          fourcc &&
       v4l2_buffer->GetWidth() == width &&
       v4l2_buffer->GetHeight() == height) {
     // If no format conversion needs to be applied, directly copy the data over.
-    memcpy(output_frame.GetData(),
-           v4l2_buffer->GetData(), v4l2_buffer->GetDataSize());
+    if (copyFrame(*v4l2_buffer, fourcc, &output_frame))
+      status = Status::INTERNAL_ERROR;
+  } else if (v4l2_buffer->GetNumPlanes() > 1) {
+    ALOGE("%s (%s): cannot convert from 0x%x, its planes are separate !",
+              __func__, config_.node, v4l2_buffer->GetFourcc());
+    status = Status::INTERNAL_ERROR;
   } else {
     std::lock_guard l(convert_mutex_);
-    arc::CachedFrame cached_frame;
-    cached_frame.SetSource(v4l2_buffer.get(), 0);
-    res = cached_frame.Convert(*(tsb.settings), &output_frame);
+    res = cached_frame_.SetSource(v4l2_buffer.get(), 0);
+    if (!res)
+      res = cached_frame_.Convert(*(tsb.settings), &output_frame);
     if (res) {
       ALOGE("%s (%s): conversion failed !", __func__, config_.node);
       status = Status::INTERNAL_ERROR;
     }
+    cached_frame_.UnsetSource();
   }
 
   hidl_handle handle;
@@ -548,6 +1208,62 @@ Status V4l2Stream::processCaptureResultConversion(
   return status;
 }
 
+/*
+ *  This method copies a frame captured in the format and size of the stream,
+ *  line by line, since the driver lines may be longer than the gralloc ones.
+ *  Planes stored in separate buffers are copied to their place in the gralloc
+ *  buffer.
+ *
+ *  @return 0 on success
+ *          -EINVAL if the frame layout is unknown or the frame is incomplete
+ *
+ */
+int V4l2Stream::copyFrame(const arc::V4L2FrameBuffer &src, uint32_t fourcc,
+                          arc::FrameBuffer *dst) {
+  std::vector<ColorPlane> planes = colorPlanes(fourcc, src.GetWidth(),
+                                               src.GetHeight());
+  std::vector<uint32_t> strides = v4l2_wrapper_->GetPlaneStrides();
+  bool separate = src.GetNumPlanes() > 1;
+
+  if (planes.empty() || (separate && src.GetNumPlanes() != planes.size())) {
+    ALOGE("%s (%s): unknown layout of format 0x%x !",
+              __func__, config_.node, src.GetFourcc());
+    return -EINVAL;
+  }
+
+  uint8_t *dst_line = dst->GetData();
+  size_t src_offset = 0;
+
+  for (size_t i = 0; i < planes.size(); ++i) {
+    const ColorPlane &plane = planes[i];
+    uint32_t src_stride = driverPlaneStride(src.GetFourcc(), strides, i);
+    uint32_t dst_stride = grallocPlaneStride(fourcc, src.GetWidth(), i);
+
+    if (separate)
+      src_offset = 0;
+
+    size_t src_plane = separate ? i : 0;
+    const uint8_t *src_line = src.GetPlaneData(src_plane) + src_offset;
+
+    if (plane.lines && (src_stride < plane.line_size ||
+        src_offset + static_cast<size_t>(plane.lines - 1) * src_stride +
+            plane.line_size > src.GetPlaneDataSize(src_plane))) {
+      ALOGE("%s (%s): plane %zu is incomplete !", __func__, config_.node, i);
+      return -EINVAL;
+    }
+
+    for (uint32_t line = 0; line < plane.lines; ++line) {
+      memcpy(dst_line, src_line, plane.line_size);
+      src_line += src_stride;
+      dst_line += dst_stride;
+    }
+
+    src_offset += static_cast<size_t>(plane.lines) * src_stride;
+  }
+
+  return 0;
+}
+
 void V4l2Stream::flush() {
   std::lock_guard flush_lock(flush_mutex_);
   std::unique_lock capture_lock(capture_mutex_);
@@ -577,6 +1293,9 @@ void V4l2Stream::flush() {
   }
   v4l2_wrapper_->StreamOff();
   started_ = false;
+
+  /* The capture thread may still be waiting on the now stopped driver */
+  wakeupCaptureThread();
 }
 
 Status V4l2Stream::importBuffer(const StreamBuffer &stream_buffer) {
@@ -603,12 +1322,67 @@ Status V4l2Stream::saveBuffer(const StreamBuffer &stream_buffer) {
     return Status::INTERNAL_ERROR;
   }
 
+  if (memory_ == V4L2_MEMORY_DMABUF && !hasDriverLayout(buffer) &&
+      fallbackToMmap() != Status::OK) {
+    ALOGE("%s (%s): output buffer %" PRIu64 " cannot be captured into",
+              __func__, config_.node, stream_buffer.bufferId);
+    mapper_helper_.freeBuffer(buffer);
+    return Status::INTERNAL_ERROR;
+  }
+
   std::lock_guard lock(buffer_mutex_);
   buffer_map_[stream_buffer.bufferId] = buffer;
 
   return Status::OK;
 }
 
+/*
+ *  This method checks that the driver can capture into |buffer|: the
+ *  strides, chroma step and chroma plane offsets gralloc reports must be
+ *  those of the driver frames.
+ *
+ */
+bool V4l2Stream::hasDriverLayout(buffer_handle_t buffer) {
+  uint32_t fourcc = StreamFormat::HalToV4L2PixelFormat(
+      stream_.format, config_.implementation_defined_format);
+
+  YCbCrPlanes planes;
+  if (!driverYCbCrPlanes(fourcc, v4l2_wrapper_->GetPlaneStrides(),
+                         stream_.height, &planes))
+    return false;
+
+  hidl_handle acquire_fence;
+  YCbCrLayout layout = mapper_helper_.lockYCbCr(
+      buffer, static_cast<uint64_t>(stream_.usage), stream_.width,
+      stream_.height, acquire_fence);
+  if (layout.y == nullptr) {
+    ALOGE("%s (%s): cannot lock buffer", __func__, config_.node);
+    return false;
+  }
+
+  hidl_handle release_fence;
+  mapper_helper_.unlock(buffer, &release_fence);
+
+  const uint8_t *y = static_cast<const uint8_t *>(layout.y);
+  ptrdiff_t cb_offset = static_cast<const uint8_t *>(layout.cb) - y;
+  ptrdiff_t cr_offset = static_cast<const uint8_t *>(layout.cr) - y;
+
+  if (layout.yStride != planes.y_stride ||
+      layout.cStride != planes.c_stride ||
+      layout.chromaStep != planes.chroma_step ||
+      cb_offset != static_cast<ptrdiff_t>(planes.cb_offset) ||
+      cr_offset != static_cast<ptrdiff_t>(planes.cr_offset)) {
+    ALOGW("%s (%s): gralloc layout %u/%u/%u cb %td cr %td, driver layout "
+          "%u/%u/%u cb %zu cr %zu", __func__, config_.node, layout.yStride,
+              layout.cStride, layout.chromaStep, cb_offset, cr_offset,
+              planes.y_stride, planes.c_stride, planes.chroma_step,
+              planes.cb_offset, planes.cr_offset);
+    return false;
+  }
+
+  return true;
+}
+
 buffer_handle_t V4l2Stream::getSavedBuffer(int64_t buffer_id) {
   std::lock_guard lock(buffer_mutex_);
 
@@ -5,6 +5,7 @@
 #include <aidl/android/hardware/camera/provider/ICameraProviderCallback.h>
 #include <aidl/android/hardware/camera/common/Status.h>
 
+#include <mutex>
 #include <unordered_map>
 #include <regex>
 
@@ -13,6 +14,12 @@
 namespace android {
 namespace hardware {
 namespace camera {
+namespace device {
+namespace implementation {
+class V4l2CameraDevice;
+} // implementation
+} // device
+
 namespace provider {
 namespace implementation {
 
@@ -27,6 +34,7 @@ using aidl::android::hardware::camera::provider::ICameraProviderCallback;
 using ndk::ScopedAStatus;
 
 using ::android::hardware::camera::device::implementation::V4l2CameraConfig;
+using ::android::hardware::camera::device::implementation::V4l2CameraDevice;
 
 class V4l2CameraProvider : public BnCameraProvider {
 public:
@@ -69,6 +77,13 @@ private:
   std::vector<VendorTagSection> vendor_tag_sections_;
   std::unordered_map<std::string, V4l2CameraConfig> v4l2_cameras_;
 
+  /* Devices are created once, so that their configuration is only parsed
+   * once. Protected by devices_lock_.
+   */
+  std::unordered_map<std::string,
+                     std::shared_ptr<V4l2CameraDevice>> v4l2_devices_;
+  std::mutex devices_lock_;
+
 };
 
 } // implementation
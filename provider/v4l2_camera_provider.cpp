@@ -20,8 +20,12 @@
 // #define LOG_NDEBUG 0
 #include <log/log.h>
 
+#include <v4l2/v4l2_capability_cache.h>
+
 #include "v4l2_camera_device.h"
 
+#define CAPS_CACHE_DIR_PROPERTY "vendor.camera.caps_cache.dir"
+
 namespace android {
 namespace hardware {
 namespace camera {
@@ -34,6 +38,10 @@ using ::android::hardware::camera::device::implementation::V4l2CameraConfig;
 using ::android::hardware::camera::device::implementation::V4l2StreamConfig;
 using ::android::hardware::camera::device::implementation::V4l2CameraDevice;
 
+using ::android::hardware::camera::common::V1_0::v4l2::V4L2Capabilities;
+using ::android::hardware::camera::common::V1_0::v4l2::V4L2CapabilityCache;
+using ::android::hardware::camera::common::V1_0::v4l2::V4L2Wrapper;
+
 const std::string V4l2CameraProvider::kProviderName = "internal";
 // "device@<version>/internal/<id>"
 const std::regex V4l2CameraProvider::kDeviceNameRegex(
@@ -66,6 +74,36 @@ V4l2CameraProvider::V4l2CameraProvider()
 V4l2CameraProvider::~V4l2CameraProvider()
 { }
 
+/* Enumerate the capabilities of the camera nodes ahead of the first stream
+ * configuration.
+ */
+static void cacheCapabilities(const V4l2CameraConfig &config) {
+  for (const V4l2StreamConfig &stream_config : config.streams) {
+    std::shared_ptr<V4L2Wrapper> wrapper =
+        std::make_shared<V4L2Wrapper>(stream_config.node);
+    V4L2Wrapper::Connection connection(wrapper);
+    if (connection.status()) {
+      ALOGW("%s: cannot connect to %s: %d", __func__, stream_config.node,
+                connection.status());
+      V4L2CapabilityCache::GetInstance().Invalidate(stream_config.node);
+      continue;
+    }
+
+    std::shared_ptr<const V4L2Capabilities> capabilities;
+    if (V4L2CapabilityCache::GetInstance().GetCapabilities(wrapper,
+                                                           &capabilities))
+      ALOGW("%s: cannot get %s capabilities", __func__, stream_config.node);
+  }
+}
+
+/* Forget the capabilities of the camera nodes, which may have been removed
+ * or replaced by another device.
+ */
+static void invalidateCapabilities(const V4l2CameraConfig &config) {
+  for (const V4l2StreamConfig &stream_config : config.streams)
+    V4L2CapabilityCache::GetInstance().Invalidate(stream_config.node);
+}
+
 Status V4l2CameraProvider::initialize() {
   ALOGV("%s: enter", __func__);
 
@@ -102,6 +140,20 @@ Status V4l2CameraProvider::initialize() {
   std::string name = "device@" + V4l2CameraDevice::kDeviceVersion +
                      "/" + kProviderName + "/" + std::to_string(config.id);
 
+  /* Optionally keep the capabilities across restarts of the provider */
+  char caps_cache_dir[PROPERTY_VALUE_MAX];
+  property_get(CAPS_CACHE_DIR_PROPERTY, caps_cache_dir, "");
+  V4L2CapabilityCache::GetInstance().SetPersistentDir(caps_cache_dir);
+
+  cacheCapabilities(config);
+
+  /* A device failing here is created again when it is requested */
+  std::shared_ptr<V4l2CameraDevice> device = V4l2CameraDevice::Create(config);
+  if (device != nullptr)
+    v4l2_devices_[name] = device;
+  else
+    invalidateCapabilities(config);
+
   v4l2_cameras_[name] = std::move(config);
 
   return Status::OK;
@@ -208,7 +260,17 @@ ScopedAStatus V4l2CameraProvider::getCameraDeviceInterface(
                 static_cast<int32_t>(Status::ILLEGAL_ARGUMENT));
   }
 
-  *device = V4l2CameraDevice::Create(it->second);
+  std::lock_guard lock(devices_lock_);
+
+  std::shared_ptr<V4l2CameraDevice> &v4l2_device =
+                                        v4l2_devices_[camera_device_name];
+  if (v4l2_device == nullptr) {
+    v4l2_device = V4l2CameraDevice::Create(it->second);
+    if (v4l2_device == nullptr)
+      invalidateCapabilities(it->second);
+  }
+
+  *device = v4l2_device;
 
   return ScopedAStatus::ok();
 }